@@ -0,0 +1,97 @@
+#ifndef __CHECKSUM_H__
+#define __CHECKSUM_H__
+
+// checksum.h
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Length in bytes of a SHA-256 digest
+#define SHA256_LEN 32
+
+// Length in bytes of the strong checksum kept for each block of a file
+#define STRONG_SUM_LEN 16
+
+// Smallest, average and largest content-defined chunk
+#define CDC_MIN_CHUNK (2 * 1024)
+#define CDC_AVG_CHUNK (8 * 1024)
+#define CDC_MAX_CHUNK (64 * 1024)
+
+// Smallest and largest block size used for delta write-back signatures
+#define MIN_DELTA_BLOCK 2048
+#define MAX_DELTA_BLOCK (128 * 1024)
+
+// Signature of one block of a file: an rsync-style rolling checksum
+//   that can be slid one byte at a time, and a truncated SHA-256
+//   digest used to confirm a rolling checksum hit.
+//   The layout is sent over the wire as is.
+struct block_sig {
+	uint32_t weak;
+	unsigned char strong[STRONG_SUM_LEN];
+};
+
+// Incremental SHA-256 state
+struct sha256_ctx {
+	uint32_t state[8];
+	uint64_t bitlen;
+	unsigned char data[64];
+	size_t datalen;
+};
+
+
+// sha256_init / sha256_update / sha256_final
+//    Incrementally compute the SHA-256 digest of a byte stream.
+//    sha256_final writes SHA256_LEN bytes to out.
+
+void sha256_init( struct sha256_ctx *ctx );
+void sha256_update( struct sha256_ctx *ctx, const void *data, size_t len );
+void sha256_final( struct sha256_ctx *ctx, unsigned char *out );
+
+
+// sha256
+//    Compute the SHA-256 digest of len bytes at data into out.
+
+void sha256( const void *data, size_t len, unsigned char *out );
+
+
+// rollsum_block
+//    Compute the rolling checksum of the len bytes at data.
+//    Returns: the checksum, low 16 bits hold the byte sum and the high
+//       16 bits hold the position-weighted sum.
+
+uint32_t rollsum_block( const unsigned char *data, size_t len );
+
+
+// rollsum_roll
+//    Slide a rolling checksum over a window of len bytes by one byte,
+//       removing out from the front and appending in at the back.
+//    Returns: the checksum of the new window.
+
+uint32_t rollsum_roll( uint32_t sum, unsigned char out, unsigned char in, size_t len );
+
+
+// block_sig_compute
+//    Fill sig with the rolling and strong checksums of len bytes at data.
+
+void block_sig_compute( const unsigned char *data, size_t len, struct block_sig *sig );
+
+
+// delta_block_size
+//    Pick the signature block size for a file of the given size: the
+//       square root of the size, rounded up to a multiple of 1024 and
+//       clamped to [MIN_DELTA_BLOCK, MAX_DELTA_BLOCK].
+
+size_t delta_block_size( uint64_t file_size );
+
+
+// cdc_chunk_len
+//    Find the first content-defined chunk boundary in len bytes at data,
+//       using FastCDC: a gear rolling hash with normalized chunking, so
+//       chunks cluster around CDC_AVG_CHUNK and an edit only moves the
+//       boundaries next to it.
+//    Returns: the length of the first chunk, between CDC_MIN_CHUNK and
+//       CDC_MAX_CHUNK unless len is shorter.
+
+size_t cdc_chunk_len( const unsigned char *data, size_t len );
+
+#endif
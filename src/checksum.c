@@ -0,0 +1,271 @@
+/**
+    * @file checksum.c
+    * @brief Checksums shared by the client library and the server.
+    * @details
+    * 1. sha256: SHA-256 digest, used as the strong checksum of file blocks.
+    * 2. rollsum: rsync-style rolling checksum, used to find blocks of an old file version
+    *    at any byte offset of a new one.
+    * 3. block_sig: the (rolling, strong) pair stored for each block of a file.
+    * 4. cdc: content-defined chunking, used to deduplicate write payloads.
+    * This file must not call any of the functions mylib.c replaces.
+    * @author Jacqueline Tsai yunhsuat@andrew.cmu.edu
+ */
+
+#include <string.h>
+#include "checksum.h"
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+/**
+    * @brief Run the SHA-256 compression function over one 64-byte block.
+    * @param ctx The hash state.
+    * @param data The 64-byte block.
+    */
+static void sha256_transform(struct sha256_ctx *ctx, const unsigned char *data) {
+    uint32_t m[64];
+    for (int i = 0; i < 16; i++) {
+        m[i] = ((uint32_t)data[i * 4] << 24) | ((uint32_t)data[i * 4 + 1] << 16) |
+               ((uint32_t)data[i * 4 + 2] << 8) | ((uint32_t)data[i * 4 + 3]);
+    }
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = ROTR(m[i - 15], 7) ^ ROTR(m[i - 15], 18) ^ (m[i - 15] >> 3);
+        uint32_t s1 = ROTR(m[i - 2], 17) ^ ROTR(m[i - 2], 19) ^ (m[i - 2] >> 10);
+        m[i] = m[i - 16] + s0 + m[i - 7] + s1;
+    }
+
+    uint32_t a = ctx->state[0], b = ctx->state[1], c = ctx->state[2], d = ctx->state[3];
+    uint32_t e = ctx->state[4], f = ctx->state[5], g = ctx->state[6], h = ctx->state[7];
+    for (int i = 0; i < 64; i++) {
+        uint32_t t1 = h + (ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + m[i];
+        uint32_t t2 = (ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+    ctx->state[0] += a; ctx->state[1] += b; ctx->state[2] += c; ctx->state[3] += d;
+    ctx->state[4] += e; ctx->state[5] += f; ctx->state[6] += g; ctx->state[7] += h;
+}
+
+/**
+    * @brief Reset a SHA-256 state.
+    * @param ctx The hash state.
+    */
+void sha256_init(struct sha256_ctx *ctx) {
+    static const uint32_t iv[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    memcpy(ctx->state, iv, sizeof(iv));
+    ctx->bitlen = 0;
+    ctx->datalen = 0;
+}
+
+/**
+    * @brief Feed bytes into a SHA-256 state.
+    * @param ctx The hash state.
+    * @param data The bytes to hash.
+    * @param len The number of bytes.
+    */
+void sha256_update(struct sha256_ctx *ctx, const void *data, size_t len) {
+    const unsigned char *p = data;
+    ctx->bitlen += (uint64_t)len * 8;
+    if (ctx->datalen > 0) {
+        size_t take = 64 - ctx->datalen < len ? 64 - ctx->datalen : len;
+        memcpy(ctx->data + ctx->datalen, p, take);
+        ctx->datalen += take;
+        p += take;
+        len -= take;
+        if (ctx->datalen < 64) {
+            return;
+        }
+        sha256_transform(ctx, ctx->data);
+        ctx->datalen = 0;
+    }
+    while (len >= 64) {
+        sha256_transform(ctx, p);
+        p += 64;
+        len -= 64;
+    }
+    memcpy(ctx->data, p, len);
+    ctx->datalen = len;
+}
+
+/**
+    * @brief Finish a SHA-256 computation.
+    * @param ctx The hash state.
+    * @param out The buffer receiving SHA256_LEN bytes.
+    */
+void sha256_final(struct sha256_ctx *ctx, unsigned char *out) {
+    uint64_t bitlen = ctx->bitlen;
+    unsigned char pad[72] = {0x80};
+    size_t padlen = ctx->datalen < 56 ? 56 - ctx->datalen : 120 - ctx->datalen;
+    for (int i = 0; i < 8; i++) {
+        pad[padlen + i] = (unsigned char)(bitlen >> (56 - 8 * i));
+    }
+    sha256_update(ctx, pad, padlen + 8);
+    for (int i = 0; i < 8; i++) {
+        out[i * 4] = (unsigned char)(ctx->state[i] >> 24);
+        out[i * 4 + 1] = (unsigned char)(ctx->state[i] >> 16);
+        out[i * 4 + 2] = (unsigned char)(ctx->state[i] >> 8);
+        out[i * 4 + 3] = (unsigned char)(ctx->state[i]);
+    }
+}
+
+/**
+    * @brief Compute the SHA-256 digest of a buffer.
+    * @param data The bytes to hash.
+    * @param len The number of bytes.
+    * @param out The buffer receiving SHA256_LEN bytes.
+    */
+void sha256(const void *data, size_t len, unsigned char *out) {
+    struct sha256_ctx ctx;
+    sha256_init(&ctx);
+    sha256_update(&ctx, data, len);
+    sha256_final(&ctx, out);
+}
+
+/**
+    * @brief Compute the rolling checksum of a window.
+    * @param data The window.
+    * @param len The window length.
+    * @return The checksum, byte sum in the low half and weighted sum in the high half.
+    */
+uint32_t rollsum_block(const unsigned char *data, size_t len) {
+    uint32_t a = 0, b = 0;
+    for (size_t i = 0; i < len; i++) {
+        a += data[i];
+        b += (uint32_t)(len - i) * data[i];
+    }
+    return (a & 0xffff) | (b << 16);
+}
+
+/**
+    * @brief Slide a rolling checksum by one byte.
+    * @param sum The checksum of the current window.
+    * @param out The byte leaving the window.
+    * @param in The byte entering the window.
+    * @param len The window length.
+    * @return The checksum of the new window.
+    */
+uint32_t rollsum_roll(uint32_t sum, unsigned char out, unsigned char in, size_t len) {
+    uint32_t a = sum & 0xffff, b = sum >> 16;
+    a = (a - out + in) & 0xffff;
+    b = (b - (uint32_t)len * out + a) & 0xffff;
+    return a | (b << 16);
+}
+
+/**
+    * @brief Compute the signature of one block.
+    * @param data The block.
+    * @param len The block length.
+    * @param sig The signature to fill.
+    */
+void block_sig_compute(const unsigned char *data, size_t len, struct block_sig *sig) {
+    unsigned char digest[SHA256_LEN];
+    sig->weak = rollsum_block(data, len);
+    sha256(data, len, digest);
+    memcpy(sig->strong, digest, STRONG_SUM_LEN);
+}
+
+/**
+    * @brief Pick the signature block size for a file.
+    * @param file_size The size of the file.
+    * @return The block size in bytes.
+    */
+size_t delta_block_size(uint64_t file_size) {
+    // integer square root by Newton's method
+    uint64_t root = file_size, next = (file_size + 1) / 2;
+    while (next < root) {
+        root = next;
+        next = (root + file_size / root) / 2;
+    }
+    size_t block = (size_t)((root + 1023) & ~(uint64_t)1023);
+    if (block < MIN_DELTA_BLOCK) block = MIN_DELTA_BLOCK;
+    if (block > MAX_DELTA_BLOCK) block = MAX_DELTA_BLOCK;
+    return block;
+}
+
+// Bits of the gear hash tested below and above the average chunk size (FastCDC normalization level 2)
+#define CDC_MASK_SMALL 0xfffe000000000000ULL
+#define CDC_MASK_LARGE 0xffe0000000000000ULL
+
+static uint64_t gear[256], gear_shifted[256];
+static int gear_ready;
+
+/**
+    * @brief Fill the gear tables with fixed pseudo-random values.
+    * @details Every client must chunk identically, so the values come from a fixed splitmix64 sequence.
+    */
+static void gear_init(void) {
+    uint64_t x = 0x6a09e667f3bcc908ULL;
+    for (int i = 0; i < 256; i++) {
+        x += 0x9e3779b97f4a7c15ULL;
+        uint64_t z = x;
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        gear[i] = z ^ (z >> 31);
+        gear_shifted[i] = gear[i] << 1;
+    }
+    gear_ready = 1;
+}
+
+/**
+    * @brief Scan for a chunk boundary, two bytes per step.
+    * @details Rolling two bytes per iteration with a pre-shifted table halves the loop overhead,
+    * the boundary is still tested at every byte.
+    * @return The offset just past the boundary, or end if none was found.
+    */
+static size_t cdc_scan(const unsigned char *data, size_t i, size_t end, uint64_t *hash, uint64_t mask) {
+    uint64_t h = *hash;
+    for (; i + 2 <= end; i += 2) {
+        h = (h << 2) + gear_shifted[data[i]];
+        if (!(h & (mask << 1))) {
+            *hash = h >> 1;
+            return i + 1;
+        }
+        h += gear[data[i + 1]];
+        if (!(h & mask)) {
+            *hash = h;
+            return i + 2;
+        }
+    }
+    if (i < end) {
+        h = (h << 1) + gear[data[i]];
+        i++;
+    }
+    *hash = h;
+    return end;
+}
+
+/**
+    * @brief Find the first content-defined chunk boundary.
+    * @param data The bytes to chunk.
+    * @param len The number of bytes.
+    * @return The length of the first chunk.
+    */
+size_t cdc_chunk_len(const unsigned char *data, size_t len) {
+    if (!gear_ready) {
+        gear_init();
+    }
+    if (len <= CDC_MIN_CHUNK) {
+        return len;
+    }
+    size_t end = len < CDC_MAX_CHUNK ? len : CDC_MAX_CHUNK;
+    size_t normal = end < CDC_AVG_CHUNK ? end : CDC_AVG_CHUNK;
+    uint64_t h = 0;
+    // Boundaries are never cut before CDC_MIN_CHUNK, so those bytes are skipped.
+    size_t i = cdc_scan(data, CDC_MIN_CHUNK, normal, &h, CDC_MASK_SMALL);
+    if (i < normal) {
+        return i;
+    }
+    return cdc_scan(data, normal, end, &h, CDC_MASK_LARGE);
+}
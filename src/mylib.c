@@ -15,6 +15,27 @@
     * 8. getdirentries: The function is used to get directory entries.
     * 9. getdirtree: The function is used to get the directory tree.
     * 10. freedirtree: The function is used to free the directory tree.
+    * 11. copy_file_range, sendfile, splice: Copies between two remote files are done by the server.
+    * When RPC_CACHE_DIR is set, regular files are served from whole-file copies cached in that directory,
+    * and files modified locally are written back on close as deltas against the server version.
+    * When RPC_DEDUP=1, large writes are split into content-defined chunks and only chunks the server
+    * does not already store are sent.
+    * The memory held by client caches is kept within RPC_MEM_BUDGET by evicting from the caches whose
+    * memory earns the fewest hits.
+    * Reads and writes are sized from the measured round trip time and bandwidth of the connection, and
+    * small reads and writes of uncached files go through read-ahead and write-behind buffers.
+    * Writes to files opened with O_APPEND are records: each lands whole and unsplit, even with many
+    * processes appending to the same file, and small records are sent in batches.
+    * RPC_PREFETCH names a manifest of files fetched into the cache in one request at startup,
+    * and RPC_PREFETCH_RECORD a file the opened paths are appended to, to be used as a manifest later.
+    * With RPC_SIBLING_PREFETCH=N, the Nth file opened in a directory has the server push the small
+    * files of that directory into the cache while the program goes on.
+    * A file opened write-only that no one else has open is delegated to this client, whose writes
+    * then stay in a local buffer until close, fsync or a recall from the server.
+    * With RPC_UPLOAD_BATCH=1, files created with O_CREAT | O_TRUNC for writing are written locally and
+    * uploaded in batches when closed.
+    * When the server exports read-only published data, attributes, directory listings, directory trees
+    * and cached files are kept for the generation of the export and never revalidated.
     * The functions are implemented using the socket programming interface, TCP/IP protocol, and C programming language.
     * @author Jacqueline Tsai yunhsuat@andrew.cmu.edu
  */
@@ -29,6 +50,7 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <sys/stat.h>
 #include <fcntl.h>
@@ -36,7 +58,14 @@
 #include <stdarg.h>
 #include <string.h>
 #include <err.h>
+#include <dirent.h>
+#include <limits.h>
+#include <stddef.h>
+#include <time.h>
+#include <sys/sendfile.h>
+#include <sys/mman.h>
 #include "dirtree.h"
+#include "checksum.h"
 
 // Define the maximum message length
 #define MAX_MSG_LEN 4096
@@ -44,6 +73,75 @@
 // Define the offset to distinguish between the file descriptors returned by the server
 #define FD_OFFSET 5000
 
+// Define the number of server file descriptors the client keeps cache state for
+#define MAX_REMOTE_FDS 4096
+
+// Define the number of written ranges tracked per cached file before close ranges are joined
+#define MAX_DIRTY_EXTENTS 64
+
+// Define the longest literal run of a delta instruction
+#define MAX_LITERAL (64 * 1024)
+
+// Flag of the apply delta request: the delta can be applied to the file in place
+#define DELTA_INPLACE 1
+
+// Flags of the fetch files request: send file content, not only attributes, select the
+// files by a directory and a glob pattern instead of a list, and send content only for files
+// no larger than a limit
+#define FETCH_CONTENT 1
+#define FETCH_GLOB 2
+#define FETCH_SMALL 4
+
+// Define the largest sibling file whose content is pushed, and the number of directories whose
+// opens are counted
+#define SIBLING_MAX_SIZE (64 * 1024)
+#define SIBLING_DIRS 64
+
+// Define the smallest write that is deduplicated, and the number of chunks sent per request
+#define DEDUP_MIN_WRITE (4 * CDC_AVG_CHUNK)
+#define DEDUP_BATCH 512
+
+// Define the number of chunk hashes remembered as held by the server, a power of two
+#define KNOWN_CHUNKS (1 << 16)
+
+// Define the bytes and the number of closed files gathered in an upload batch before it is sent
+#define UPLOAD_BATCH_BYTES (32 * 1024 * 1024)
+#define UPLOAD_BATCH_FILES 1024
+
+// Define the number of hash buckets of the cache of a read-only export
+#define EXPORT_BUCKETS 4096
+
+// Define the default memory budget of all client caches together, and the number of caches
+#define DEFAULT_MEM_BUDGET (64 * 1024 * 1024)
+#define MAX_MEM_CACHES 16
+
+// Define how often memory pressure is sampled, and the PSI avg10 percentage above which
+// the caches are held to half their budget
+#define PRESSURE_INTERVAL_NS 1000000000ULL
+#define PRESSURE_THRESHOLD 10.0
+
+// Define the bounds of the adaptive transfer size, and the size used until the link is measured
+#define MIN_TRANSFER (16 * 1024)
+#define MAX_TRANSFER (8 * 1024 * 1024)
+#define INITIAL_TRANSFER (64 * 1024)
+
+// Define the number of bandwidth samples the maximum is taken over, the smallest transfer that
+// gives a bandwidth sample, and how long a minimum round trip time is trusted
+#define BW_WINDOW 10
+#define MIN_BW_SAMPLE (8 * 1024)
+#define MIN_RTT_WINDOW_NS (10 * 1000000000ULL)
+
+// Modes of the buffer of a remote file descriptor
+#define STREAM_READ_AHEAD 1
+#define STREAM_WRITE_BEHIND 2
+#define STREAM_APPEND 3
+
+// Define how long a record may wait in an append batch for more records
+#define APPEND_MAX_DELAY_NS (10 * 1000000ULL)
+
+// Define the largest buffer of writes to a delegated file, sent when it fills
+#define DELEGATION_MAX_BUFFER (16 * 1024 * 1024)
+
 // The following line declares a function pointer with the same prototype as the open function.  
 int (*orig_open)(const char *pathname, int flags, ...);  // mode_t mode is needed when flags includes O_CREAT
 int (*orig_close)(int fd);
@@ -55,22 +153,103 @@ int (*orig_unlink)(const char *pathname);
 ssize_t (*orig_getdirentries)(int fd, char *buf, size_t nbyte, off_t *restrict basep);
 struct dirtreenode *(*orig_getdirtree)(const char *path);
 void (*orig_freedirtree)(struct dirtreenode *dt);
+ssize_t (*orig_copy_file_range)(int fd_in, off64_t *off_in, int fd_out, off64_t *off_out, size_t len, unsigned int flags);
+ssize_t (*orig_sendfile)(int out_fd, int in_fd, off_t *offset, size_t count);
+ssize_t (*orig_splice)(int fd_in, off64_t *off_in, int fd_out, off64_t *off_out, size_t len, unsigned int flags);
+int (*orig_fsync)(int fd);
+int (*orig_fdatasync)(int fd);
+
+ssize_t readHelper(int fd, void *buf, size_t count);
+int closeRequest(int fd);
+off_t lseekRequest(int fd, off_t offset, int whence);
+void flushAllWriteBehind(void);
+void siblingDrain(void);
+void delegationCheck(void);
+void delegationSync(const char *pathname, int give_back);
 
 // socket file descriptor for the connection to the server
 int sockfd;
 
+/**
+    * @brief Counters reported when the program exits, if RPC_METRICS is set.
+    */
+struct client_metrics {
+    uint64_t dedup_bytes;            // bytes written through chunk deduplication
+    uint64_t dedup_sent_bytes;       // chunk data actually sent to the server
+    uint64_t dedup_chunks;
+    uint64_t dedup_duplicate_chunks; // chunks the server already held
+    uint64_t dedup_queries;
+    uint64_t dedup_cpu_ns;           // CPU time spent cutting and hashing chunks
+    uint64_t readahead_fills;
+    uint64_t readahead_bytes;        // bytes of reads served from read-ahead buffers
+    uint64_t write_behind_flushes;
+    uint64_t write_behind_bytes;     // bytes of writes gathered in write-behind buffers
+    uint64_t delegations;            // write delegations granted
+    uint64_t delegation_recalls;     // recalls received from the server
+    uint64_t delegated_writes;       // writes kept in the buffer of a delegated file
+    uint64_t delegated_bytes;
+    uint64_t append_records;         // writes to O_APPEND files
+    uint64_t append_batches;         // append requests sent for them
+    uint64_t append_bytes;
+    uint64_t export_hits;            // requests to a read-only export, or under callbacks, answered from the cache
+    uint64_t export_misses;
+    uint64_t prefetch_files;         // files listed in the prefetch manifest
+    uint64_t prefetch_globs;         // glob patterns listed in it
+    uint64_t prefetch_fetched;       // files whose content was fetched into the cache
+    uint64_t prefetch_unchanged;     // files whose cached version was still current
+    uint64_t prefetch_bytes;
+    uint64_t prefetch_ns;
+    uint64_t sibling_dirs;           // directories whose small files were pushed
+    uint64_t sibling_pushed;         // files whose content was pushed into the cache
+    uint64_t sibling_hits;           // opens served from a pushed file
+    uint64_t sibling_bytes;
+    uint64_t upload_files;           // files sent in upload batches
+    uint64_t upload_batches;
+    uint64_t upload_bytes;
+    uint64_t upload_failures;        // files the server could not write, reported only on stderr
+    uint64_t callback_invalidations; // paths the server called back
+} metrics;
+
+// whether large writes are deduplicated against the server chunk store
+int dedup_enabled;
+
+// whether the response to a sibling prefetch is still to be received, before any other response
+int sibling_pending;
+
 /**
     * @brief Send a request to the server.
     * @param buf The buffer containing the request.
     * @param totalSize The size of the request.
     */
 void sendRequest(char *buf, size_t totalSize) {
+    if (sibling_pending) {
+        siblingDrain();
+    }
     // fprintf(stderr, "try sending %ld bytes...\n", totalSize);
     size_t sentSize = 0;
     while (sentSize < totalSize) {
         sentSize += send(sockfd, buf + sentSize, totalSize - sentSize, 0);
     }
-    fprintf(stderr, "sent req | size: %ld | msg: %s\n", sentSize, buf);
+    fprintf(stderr, "sent req | size: %ld | msg: %.*s\n", sentSize, (int)(sentSize < 64 ? sentSize : 64), buf);
+}
+
+// number of write delegations held, and whether the server recalled them
+int delegations_held;
+int recall_pending;
+
+/**
+    * @brief Take a recall the server sent as urgent data.
+    * @details Urgent data is skipped by ordinary reads, and lost once they go past it, so it is
+    * looked for before each read of a response while delegations are held. The recall itself
+    * needs requests, so it waits for the next call.
+    */
+void urgentData(void) {
+    char c;
+    int saved_errno = errno;
+    while (recv(sockfd, &c, 1, MSG_OOB | MSG_DONTWAIT) == 1) {
+        recall_pending = 1;
+    }
+    errno = saved_errno;
 }
 
 /** 
@@ -82,6 +261,9 @@ void receiveResponse(char *buf, size_t totalSize) {
     // fprintf(stderr, "try receving %ld bytes...\n", totalSize);
     size_t receivedSize = 0;
     while (receivedSize < totalSize) {
+        if (delegations_held > 0) {
+            urgentData();
+        }
         int rv = recv(sockfd, buf + receivedSize, totalSize - receivedSize, 0);
         if (rv < 0) {
             err(1, 0);
@@ -89,64 +271,2502 @@ void receiveResponse(char *buf, size_t totalSize) {
         }  
         receivedSize += rv;
     }
-    fprintf(stderr, "received res | size: %ld | msg: %s\n", receivedSize, buf);
+    fprintf(stderr, "received res | size: %ld | msg: %.*s\n", receivedSize, (int)(receivedSize < 64 ? receivedSize : 64), buf);
 }
 
 /**
-    * @brief Open a file.
-    * @param pathname The path to the file.
-    * @param flags The flags to open the file.
-    * @param ... The mode to open the file.
-    * @return The file descriptor.
+    * @brief A client cache whose memory is accounted by the memory governor.
+    * @details The cache asks for memory with memCharge before it grows, gives it back with memRelease,
+    * and reports hits with memHit. The governor makes room by calling shrink on the caches whose
+    * recent hits per byte held are lowest.
     */
-int open(const char *pathname, int flags, ...) {
-    fprintf(stderr, "mylib: open called | path %s\n", pathname);
+struct mem_cache {
+    const char *name;
+    size_t (*shrink)(size_t want);  // free about want bytes through memRelease, returns the bytes freed
+    size_t bytes;
+    uint64_t hits;                  // recent hits, halved after every eviction pass
+    uint64_t total_hits;
+    uint64_t evictions;
+    uint64_t evicted_bytes;
+};
 
-    mode_t mode=0;
-    if (flags & O_CREAT) {
-        va_list a;
-        va_start(a, flags);
-        mode = va_arg(a, mode_t);
-        va_end(a);
+/**
+    * @brief Accountant of the memory held by all client caches.
+    */
+struct mem_governor {
+    struct mem_cache *caches[MAX_MEM_CACHES];
+    int ncaches;
+    size_t budget;                  // configured budget
+    size_t limit;                   // budget enforced now, lower while the system is short of memory
+    size_t used;
+    size_t peak;
+    uint64_t evictions;
+    uint64_t evicted_bytes;
+    uint64_t refused;               // charges refused because nothing else could be evicted
+    uint64_t pressure_events;
+    uint64_t pressure_checked_ns;
+    char pressure_path[PATH_MAX];   // PSI file of the cgroup, or of the whole system
+} governor;
+
+/**
+    * @brief Current time, in nanoseconds.
+    */
+uint64_t monotonicNs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+    * @brief Read a small local file into a NUL terminated buffer.
+    * @return The number of bytes read, or -1 if error.
+    */
+ssize_t readSmallFile(const char *path, char *buf, size_t size) {
+    int fd = orig_open(path, O_RDONLY);
+    if (fd == -1) {
+        return -1;
     }
-    // Define the format of the message.
-    // Extendability: We can add more fields to the message by adding more offsets and updating totalSize.
-    // Request Format:
-    // | op     | pathname length | pathname    | flags  | mode      |
-    // | int(4) | int(4)          | c_string(n) | int(4) | mode_t(4) |
-    int num_fields = 5;
-    size_t req_length[5] = {4, 4, strlen(pathname), 4, 4};
-    int req_offsets[6] = {0};
-    for (int i = 0; i < 5; i++) { 
-        req_offsets[i + 1] = req_offsets[i] + req_length[i];
+    ssize_t n = orig_read(fd, buf, size - 1);
+    orig_close(fd);
+    buf[n > 0 ? n : 0] = '\0';
+    return n;
+}
+
+/**
+    * @brief Parse a byte count with an optional K, M or G suffix.
+    * @return The byte count, or 0 if it cannot be parsed.
+    */
+size_t parseSize(const char *value) {
+    char *end;
+    unsigned long long n = strtoull(value, &end, 10);
+    switch (*end) {
+        case 'G': case 'g': n <<= 10; // fall through
+        case 'M': case 'm': n <<= 10; // fall through
+        case 'K': case 'k': n <<= 10;
     }
+    return end == value ? 0 : (size_t)n;
+}
 
-    char reqBuf[req_offsets[num_fields]];
-    int op = 0, path_len = strlen(pathname);
-    memcpy(reqBuf + req_offsets[0], &op, req_length[0]);
-    memcpy(reqBuf + req_offsets[1], &path_len, req_length[1]);
-    memcpy(reqBuf + req_offsets[2], pathname, req_length[2]);
-    memcpy(reqBuf + req_offsets[3], &flags, req_length[3]);
-    memcpy(reqBuf + req_offsets[4], &mode, req_length[4]);
-    sendRequest(reqBuf, req_offsets[5]);
+/**
+    * @brief Set up the memory governor.
+    * @details The budget comes from RPC_MEM_BUDGET and is capped at a quarter of the memory.high
+    * limit of the cgroup the program runs in. Memory pressure is read from the PSI file of that
+    * cgroup, or of the whole system when it has none.
+    */
+void memInit(void) {
+    char *budget = getenv("RPC_MEM_BUDGET");
+    governor.budget = budget != NULL && parseSize(budget) > 0 ? parseSize(budget) : DEFAULT_MEM_BUDGET;
 
-    // Response Format:
-    // | fd     | errno  |
+    char cgroup[PATH_MAX], path[PATH_MAX], value[256];
+    governor.pressure_path[0] = '\0';
+    // The cgroup v2 entry of /proc/self/cgroup is the line "0::<path>".
+    char *line = NULL;
+    if (readSmallFile("/proc/self/cgroup", cgroup, sizeof(cgroup)) > 0) {
+        line = strncmp(cgroup, "0::", 3) == 0 ? cgroup : strstr(cgroup, "\n0::");
+    }
+    if (line != NULL) {
+        line += *line == '\n' ? 4 : 3;
+        line[strcspn(line, "\n")] = '\0';
+        snprintf(path, sizeof(path), "/sys/fs/cgroup%s/memory.high", line);
+        if (readSmallFile(path, value, sizeof(value)) > 0 && strncmp(value, "max", 3) != 0) {
+            size_t high = parseSize(value);
+            if (high > 0 && high / 4 < governor.budget) governor.budget = high / 4;
+        }
+        snprintf(path, sizeof(path), "/sys/fs/cgroup%s/memory.pressure", line);
+        if (readSmallFile(path, value, sizeof(value)) > 0) {
+            snprintf(governor.pressure_path, sizeof(governor.pressure_path), "%s", path);
+        }
+    }
+    if (governor.pressure_path[0] == '\0' && readSmallFile("/proc/pressure/memory", value, sizeof(value)) > 0) {
+        snprintf(governor.pressure_path, sizeof(governor.pressure_path), "/proc/pressure/memory");
+    }
+    governor.limit = governor.budget;
+}
+
+/**
+    * @brief Register a cache with the memory governor.
+    */
+void memRegister(struct mem_cache *mc) {
+    if (governor.ncaches < MAX_MEM_CACHES) {
+        governor.caches[governor.ncaches++] = mc;
+    }
+}
+
+/**
+    * @brief Record a cache hit, which makes the memory of the cache more valuable.
+    */
+void memHit(struct mem_cache *mc) {
+    mc->hits++;
+    mc->total_hits++;
+}
+
+/**
+    * @brief Give memory of a cache back to the governor.
+    */
+void memRelease(struct mem_cache *mc, size_t bytes) {
+    if (bytes > mc->bytes) bytes = mc->bytes;
+    mc->bytes -= bytes;
+    governor.used -= bytes;
+}
+
+/**
+    * @brief Shrink caches other than keep until the total fits in target.
+    * @details The cache with the fewest recent hits per byte goes first. Hit counts are halved
+    * after each pass, so caches that were useful long ago lose their advantage.
+    */
+void memShrinkTo(size_t target, struct mem_cache *keep) {
+    char tried[MAX_MEM_CACHES] = {0};
+    while (governor.used > target) {
+        int victim = -1;
+        for (int i = 0; i < governor.ncaches; i++) {
+            struct mem_cache *mc = governor.caches[i];
+            if (mc == keep || tried[i] || mc->bytes == 0 || mc->shrink == NULL) continue;
+            // hits / bytes < victim hits / victim bytes, without dividing
+            struct mem_cache *best = victim == -1 ? NULL : governor.caches[victim];
+            if (best == NULL || (double)mc->hits * best->bytes < (double)best->hits * mc->bytes) {
+                victim = i;
+            }
+        }
+        if (victim == -1) {
+            break;
+        }
+        struct mem_cache *mc = governor.caches[victim];
+        size_t freed = mc->shrink(governor.used - target);
+        tried[victim] = 1;
+        if (freed > 0) {
+            mc->evictions++;
+            mc->evicted_bytes += freed;
+            governor.evictions++;
+            governor.evicted_bytes += freed;
+        }
+    }
+    for (int i = 0; i < governor.ncaches; i++) {
+        governor.caches[i]->hits /= 2;
+    }
+}
+
+/**
+    * @brief Lower the enforced limit while the system is short of memory.
+    * @details The PSI "some avg10" figure is the share of the last 10 seconds in which some task
+    * stalled waiting for memory. It is sampled at most once per PRESSURE_INTERVAL_NS.
+    */
+void memCheckPressure(void) {
+    uint64_t now = monotonicNs();
+    if (governor.pressure_path[0] == '\0' || now - governor.pressure_checked_ns < PRESSURE_INTERVAL_NS) {
+        return;
+    }
+    governor.pressure_checked_ns = now;
+    char value[256];
+    char *avg10;
+    if (readSmallFile(governor.pressure_path, value, sizeof(value)) <= 0 || (avg10 = strstr(value, "avg10=")) == NULL) {
+        return;
+    }
+    size_t limit = strtod(avg10 + 6, NULL) > PRESSURE_THRESHOLD ? governor.budget / 2 : governor.budget;
+    if (limit < governor.limit) {
+        governor.pressure_events++;
+        memShrinkTo(limit, NULL);
+    }
+    governor.limit = limit;
+}
+
+/**
+    * @brief Ask the governor for memory before a cache grows.
+    * @details Other caches are shrunk to make room if needed. The charging cache is not shrunk,
+    * it is refused instead and should not grow.
+    * @return 0 if the memory was granted, -1 if not.
+    */
+int memCharge(struct mem_cache *mc, size_t bytes) {
+    memCheckPressure();
+    if (governor.used + bytes > governor.limit) {
+        memShrinkTo(bytes > governor.limit ? 0 : governor.limit - bytes, mc);
+    }
+    if (governor.used + bytes > governor.limit) {
+        governor.refused++;
+        return -1;
+    }
+    mc->bytes += bytes;
+    governor.used += bytes;
+    if (governor.used > governor.peak) governor.peak = governor.used;
+    return 0;
+}
+
+/**
+    * @brief Estimate of the round trip time and bandwidth of the connection to the server.
+    * @details As in BBR, the round trip time is the minimum seen over MIN_RTT_WINDOW_NS and the
+    * bandwidth is the maximum delivery rate of the last BW_WINDOW transfers. Their product, the
+    * bandwidth-delay product, sizes the transfers.
+    */
+struct link_estimator {
+    uint64_t min_rtt_ns;
+    uint64_t min_rtt_stamp_ns;        // when min_rtt_ns was measured
+    double bw[BW_WINDOW];             // recent delivery rates, bytes per second
+    int next_bw;
+    double max_bw;
+    size_t transfer_size;             // bytes moved by one read or write request
+    uint64_t round_trips;
+    uint64_t bw_samples;
+    uint64_t resizes;
+} estimator = {.transfer_size = INITIAL_TRANSFER};
+
+/**
+    * @brief Pick the transfer size from the bandwidth-delay product.
+    * @details A request waits one round trip before its data flows, so a transfer of S bytes keeps
+    * the link busy S / (S + BDP) of the time. Four times the BDP keeps it 80% busy.
+    */
+void linkResize(void) {
+    size_t bdp = (size_t)(estimator.max_bw * estimator.min_rtt_ns / 1e9);
+    size_t size = MIN_TRANSFER;
+    while (size < 4 * bdp && size < MAX_TRANSFER) size <<= 1;
+    if (size != estimator.transfer_size) {
+        fprintf(stderr, "mylib: transfer size %zu -> %zu | rtt %lu ns | bandwidth %.0f B/s\n",
+                estimator.transfer_size, size, estimator.min_rtt_ns, estimator.max_bw);
+        estimator.transfer_size = size;
+        estimator.resizes++;
+    }
+}
+
+/**
+    * @brief Account one request and response exchanged with the server.
+    * @param bytes The data bytes carried by the exchange.
+    * @param elapsed_ns The time from sending the request to receiving the whole response.
+    */
+void linkSample(size_t bytes, uint64_t elapsed_ns) {
+    uint64_t now = monotonicNs();
+    estimator.round_trips++;
+    // A stale minimum is only replaced by a small exchange, whose time is mostly round trip.
+    if (estimator.min_rtt_ns == 0 || elapsed_ns < estimator.min_rtt_ns ||
+        (now - estimator.min_rtt_stamp_ns > MIN_RTT_WINDOW_NS && bytes < MIN_BW_SAMPLE)) {
+        estimator.min_rtt_ns = elapsed_ns > 0 ? elapsed_ns : 1;
+        estimator.min_rtt_stamp_ns = now;
+    }
+    if (bytes < MIN_BW_SAMPLE) {
+        return;
+    }
+    // The round trip is taken out of the transfer time, but at most half of it, so that timing
+    // noise on a short transfer cannot more than double its rate.
+    uint64_t transfer_ns = elapsed_ns - estimator.min_rtt_ns;
+    if (elapsed_ns < estimator.min_rtt_ns || transfer_ns < elapsed_ns / 2) transfer_ns = elapsed_ns / 2;
+    estimator.bw[estimator.next_bw] = bytes * 1e9 / (transfer_ns > 0 ? transfer_ns : 1);
+    estimator.next_bw = (estimator.next_bw + 1) % BW_WINDOW;
+    estimator.bw_samples++;
+    estimator.max_bw = 0;
+    for (int i = 0; i < BW_WINDOW; i++) {
+        if (estimator.bw[i] > estimator.max_bw) estimator.max_bw = estimator.bw[i];
+    }
+    linkResize();
+}
+
+/**
+    * @brief Header of the signature file kept next to each cached file.
+    * @details It stamps the server version of the file the cached copy was taken from,
+    * and is followed by the block signatures of that version.
+    */
+struct cache_stamp {
+    int64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t ino;
+    uint32_t block_size;
+    uint32_t reserved;
+};
+
+/**
+    * @brief A byte range of a cached copy written since it was opened.
+    */
+struct dirty_extent {
+    off_t start;
+    off_t end;
+};
+
+/**
+    * @brief Client-side state of a remote file served from the local cache.
+    */
+struct cached_file {
+    int local_fd;                  // descriptor of the local copy
+    int writable;                  // opened for writing, local_fd is a private copy
+    int dirty;                     // the local copy differs from the server version
+    char *pathname;                // remote path
+    char entry[PATH_MAX];          // path of the shared cache entry of the base version
+    char private_path[PATH_MAX + 8]; // path of the private copy, empty for read-only opens
+    struct cache_stamp base;       // server version the local copy started from
+    struct block_sig *sigs;        // block signatures of the base version
+    int64_t nsigs;
+    off_t base_valid;              // bytes of the local copy that match the base wherever not dirty
+    int hit;                       // the cache entry was current, nothing was fetched
+    struct dirty_extent extents[MAX_DIRTY_EXTENTS];
+    int nextents;
+};
+
+// directory holding cached copies of remote files, NULL if caching is disabled
+char *cache_dir;
+
+// whether dirty cached files are written back as deltas rather than in full
+int delta_enabled = 1;
+
+// whether the server exports read-only published data, and the generation it is at
+int export_readonly;
+int64_t export_generation;
+
+// cache state of each server file descriptor, NULL if the file is not cached
+struct cached_file *cached_files[MAX_REMOTE_FDS];
+
+/**
+    * @brief Get the cache state of a server file descriptor.
+    * @param fd The server file descriptor.
+    * @return The cache state, or NULL if the file is not served from the cache.
+    */
+struct cached_file *cachedFile(int fd) {
+    if (fd < 0 || fd >= MAX_REMOTE_FDS) {
+        return NULL;
+    }
+    return cached_files[fd];
+}
+
+/**
+    * @brief Get the attributes of a file open on the server.
+    * @param fd The server file descriptor.
+    * @param statbuf The buffer to store the attributes.
+    * @return 0 if successful, -1 if error.
+    */
+int remoteFstat(int fd, struct stat *statbuf) {
+    // Request Format:
+    // | op     | fd     |
     // | int(4) | int(4) |
-    char resBuf[2 * sizeof(int)];
-    receiveResponse(resBuf, 2 * sizeof(int));
-    int fd;
-    memcpy(&fd, resBuf, sizeof(int));
-    memcpy(&errno, resBuf + sizeof(int), sizeof(int));
-    if (fd != -1) fd += FD_OFFSET;
+    int op = 9;
+    char reqBuf[2 * sizeof(uint32_t)];
+    memcpy(reqBuf, &op, sizeof(uint32_t));
+    memcpy(reqBuf + sizeof(uint32_t), &fd, sizeof(uint32_t));
+    sendRequest(reqBuf, sizeof(reqBuf));
 
-    fprintf(stderr, "mylib: open returned | fd %d | errno %d\n\n", fd, errno);
-    return fd;
+    // Response Format:
+    // | res    | errno  | statbuf   |
+    // | int(4) | int(4) | stat_size |
+    char resBuf[2 * sizeof(uint32_t) + sizeof(struct stat)];
+    receiveResponse(resBuf, sizeof(resBuf));
+    int success;
+    memcpy(&success, resBuf, sizeof(uint32_t));
+    memcpy(&errno, resBuf + sizeof(uint32_t), sizeof(uint32_t));
+    memcpy(statbuf, resBuf + 2 * sizeof(uint32_t), sizeof(struct stat));
+    return success;
 }
 
-/** 
-    * @brief Read smaller than MAX_MSG_LEN bytes from a file.
-    * @param fd The file descriptor.
+/**
+    * @brief Fill a cache stamp from the server attributes of a file.
+    * @param stamp The stamp to fill.
+    * @param statbuf The attributes.
+    * @param block_size The signature block size, 0 to pick one from the file size.
+    */
+void stampFromStat(struct cache_stamp *stamp, const struct stat *statbuf, size_t block_size) {
+    memset(stamp, 0, sizeof(*stamp));
+    stamp->size = statbuf->st_size;
+    stamp->mtime_sec = statbuf->st_mtim.tv_sec;
+    stamp->mtime_nsec = statbuf->st_mtim.tv_nsec;
+    stamp->ino = statbuf->st_ino;
+    stamp->block_size = block_size ? block_size : delta_block_size(statbuf->st_size);
+}
+
+/**
+    * @brief Check whether two stamps name the same server version of a file.
+    */
+int sameVersion(const struct cache_stamp *a, const struct cache_stamp *b) {
+    return a->size == b->size && a->mtime_sec == b->mtime_sec &&
+           a->mtime_nsec == b->mtime_nsec && a->ino == b->ino;
+}
+
+/**
+    * @brief Number of signature blocks of a file version.
+    */
+int64_t stampBlocks(const struct cache_stamp *stamp) {
+    return (stamp->size + stamp->block_size - 1) / stamp->block_size;
+}
+
+/**
+    * @brief Length of one block of a file version, the last block may be short.
+    */
+size_t stampBlockLen(const struct cache_stamp *stamp, int64_t block) {
+    off_t start = (off_t)block * stamp->block_size;
+    return stamp->size - start < stamp->block_size ? stamp->size - start : stamp->block_size;
+}
+
+/**
+    * @brief Get the block signatures of a file open on the server.
+    * @param fd The server file descriptor.
+    * @param block_size The block size, 0 to let the server pick.
+    * @param stamp The stamp of the server version the signatures belong to.
+    * @param sigs The signatures, allocated with malloc.
+    * @param nsigs The number of signatures.
+    * @return 0 if successful, -1 if error.
+    */
+int fetchSignatures(int fd, size_t block_size, struct cache_stamp *stamp, struct block_sig **sigs, int64_t *nsigs) {
+    // Request Format:
+    // | op     | fd     | block size |
+    // | int(4) | int(4) | int(4)     |
+    int op = 10;
+    char reqBuf[3 * sizeof(uint32_t)];
+    memcpy(reqBuf, &op, sizeof(uint32_t));
+    memcpy(reqBuf + sizeof(uint32_t), &fd, sizeof(uint32_t));
+    memcpy(reqBuf + 2 * sizeof(uint32_t), &block_size, sizeof(uint32_t));
+    sendRequest(reqBuf, sizeof(reqBuf));
+
+    // Response Format:
+    // | block count | errno  | block size | statbuf   | signatures                 |
+    // | int(8)      | int(4) | int(4)     | stat_size | block_sig(20) * block count |
+    size_t res_length[4] = {sizeof(uint64_t), sizeof(uint32_t), sizeof(uint32_t), sizeof(struct stat)};
+    int res_offsets[5] = {0};
+    for (int i = 0; i < 4; i++) {
+        res_offsets[i + 1] = res_offsets[i] + res_length[i];
+    }
+    char resBuf[res_offsets[4]];
+    receiveResponse(resBuf, res_offsets[4]);
+    int64_t count;
+    uint32_t server_block_size;
+    struct stat statbuf;
+    memcpy(&count, resBuf + res_offsets[0], res_length[0]);
+    memcpy(&errno, resBuf + res_offsets[1], res_length[1]);
+    memcpy(&server_block_size, resBuf + res_offsets[2], res_length[2]);
+    memcpy(&statbuf, resBuf + res_offsets[3], res_length[3]);
+    if (count < 0) {
+        return -1;
+    }
+    stampFromStat(stamp, &statbuf, server_block_size);
+    *nsigs = count;
+    *sigs = malloc((count + 1) * sizeof(struct block_sig));
+    if (count > 0) {
+        receiveResponse((char *)*sigs, count * sizeof(struct block_sig));
+    }
+    fprintf(stderr, "mylib: fetched %ld signatures | block_size %u\n", count, server_block_size);
+    return 0;
+}
+
+/**
+    * @brief Build the path of the cache entry of one version of a remote file.
+    * @details Entries are named after both the path and the version, so a published entry
+    * never changes and concurrent clients can publish the same version without coordination.
+    * @param pathname The remote path.
+    * @param stamp The version.
+    * @param entry The buffer of PATH_MAX bytes to store the entry path.
+    */
+void cacheEntryPath(const char *pathname, const struct cache_stamp *stamp, char *entry) {
+    unsigned char path_digest[SHA256_LEN], version_digest[SHA256_LEN];
+    struct cache_stamp version = *stamp;
+    version.block_size = 0;
+    sha256(pathname, strlen(pathname), path_digest);
+    sha256(&version, sizeof(version), version_digest);
+    int len = snprintf(entry, PATH_MAX, "%s/", cache_dir);
+    for (int i = 0; i < 8; i++) {
+        len += snprintf(entry + len, PATH_MAX - len, "%02x", path_digest[i]);
+    }
+    entry[len++] = '-';
+    for (int i = 0; i < 8; i++) {
+        len += snprintf(entry + len, PATH_MAX - len, "%02x", version_digest[i]);
+    }
+}
+
+// length of the path part of cache entry names, with the dash that follows it
+#define ENTRY_PREFIX_LEN 17
+
+int compareEntryPrefix(const void *key, const void *entry) {
+    return strncmp(key, strrchr(*(char *const *)entry, '/') + 1, ENTRY_PREFIX_LEN);
+}
+
+int compareEntries(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/**
+    * @brief Remove the cache entries of other versions of the files some entries belong to.
+    * @details One pass over the cache directory serves any number of entries. The name of the
+    * current generation of a read-only export is kept as well.
+    * @param entries The entries to keep, reordered.
+    * @param count The number of entries.
+    */
+void pruneCacheEntries(char **entries, int count) {
+    qsort(entries, count, sizeof(char *), compareEntries);
+    char generation[32] = "";
+    if (export_readonly) {
+        snprintf(generation, sizeof(generation), "g%ld", export_generation);
+    }
+    DIR *dir = opendir(cache_dir);
+    if (dir == NULL) {
+        return;
+    }
+    struct dirent *de;
+    while ((de = readdir(dir)) != NULL) {
+        if (strlen(de->d_name) < ENTRY_PREFIX_LEN || de->d_name[ENTRY_PREFIX_LEN - 1] != '-') {
+            continue;
+        }
+        char **keep = bsearch(de->d_name, entries, count, sizeof(char *), compareEntryPrefix);
+        if (keep == NULL || strcmp(de->d_name + ENTRY_PREFIX_LEN, generation) == 0) {
+            continue;
+        }
+        const char *name = strrchr(*keep, '/') + 1;
+        if (strncmp(de->d_name, name, strlen(name)) != 0) {
+            unlinkat(dirfd(dir), de->d_name, 0);
+        }
+    }
+    closedir(dir);
+}
+
+/**
+    * @brief Load the stamp and block signatures stored with a cache entry.
+    * @param entry The cache entry path.
+    * @param stamp The stamp to fill.
+    * @param sigs The signatures, allocated with malloc.
+    * @param nsigs The number of signatures.
+    * @return 0 if successful, -1 if the entry has no usable signature file.
+    */
+int loadSignatures(const char *entry, struct cache_stamp *stamp, struct block_sig **sigs, int64_t *nsigs) {
+    char path[PATH_MAX + 8];
+    snprintf(path, sizeof(path), "%s.sig", entry);
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        return -1;
+    }
+    int ok = fread(stamp, sizeof(*stamp), 1, f) == 1 && stamp->block_size > 0;
+    if (ok) {
+        *nsigs = stampBlocks(stamp);
+        *sigs = malloc((*nsigs + 1) * sizeof(struct block_sig));
+        ok = fread(*sigs, sizeof(struct block_sig), *nsigs, f) == (size_t)*nsigs;
+        if (!ok) free(*sigs);
+    }
+    fclose(f);
+    return ok ? 0 : -1;
+}
+
+/**
+    * @brief Store the stamp and block signatures of a cache entry.
+    * @details The signature file is replaced atomically so concurrent readers see either version.
+    * @return 0 if successful, -1 if error.
+    */
+int saveSignatures(const char *entry, const struct cache_stamp *stamp, const struct block_sig *sigs, int64_t nsigs) {
+    char path[PATH_MAX + 8], tmp[PATH_MAX + 16];
+    snprintf(path, sizeof(path), "%s.sig", entry);
+    snprintf(tmp, sizeof(tmp), "%s.sig.%d", entry, getpid());
+    FILE *f = fopen(tmp, "w");
+    if (f == NULL) {
+        return -1;
+    }
+    int ok = fwrite(stamp, sizeof(*stamp), 1, f) == 1 &&
+             fwrite(sigs, sizeof(struct block_sig), nsigs, f) == (size_t)nsigs;
+    ok = fclose(f) == 0 && ok;
+    if (!ok || rename(tmp, path) == -1) {
+        orig_unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+    * @brief Copy a whole remote file into a local file, computing its block signatures on the way.
+    * @param fd The server file descriptor, positioned at the start of the file.
+    * @param local_fd The local file to fill.
+    * @param stamp The stamp of the version being fetched.
+    * @param sigs The signatures, allocated with malloc.
+    * @return 0 if successful, -1 if error or if the file changed while it was fetched.
+    */
+int fetchFile(int fd, int local_fd, const struct cache_stamp *stamp, struct block_sig **sigs) {
+    int64_t nsigs = stampBlocks(stamp);
+    size_t block_size = stamp->block_size;
+    unsigned char *block = malloc(block_size);
+    *sigs = malloc((nsigs + 1) * sizeof(struct block_sig));
+    size_t maxLen = MAX_MSG_LEN - 8;
+    off_t total = 0;
+    size_t filled = 0;
+    int64_t done = 0;
+    while (total < stamp->size) {
+        size_t want = block_size - filled < maxLen ? block_size - filled : maxLen;
+        ssize_t n = readHelper(fd, block + filled, want);
+        if (n <= 0 || orig_write(local_fd, block + filled, n) != n) {
+            break;
+        }
+        total += n;
+        filled += n;
+        if ((filled == block_size || total == stamp->size) && done < nsigs) {
+            block_sig_compute(block, filled, &(*sigs)[done++]);
+            filled = 0;
+        }
+    }
+    free(block);
+
+    struct stat statbuf;
+    struct cache_stamp now;
+    if (total != stamp->size || done != nsigs || remoteFstat(fd, &statbuf) == -1) {
+        free(*sigs);
+        return -1;
+    }
+    stampFromStat(&now, &statbuf, block_size);
+    if (!sameVersion(&now, stamp)) {
+        free(*sigs);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+    * @brief Copy the content of one local file into another.
+    * @return 0 if successful, -1 if error.
+    */
+int copyLocalFile(int in_fd, int out_fd, off_t size) {
+    off_t in_off = 0, out_off = 0;
+    while (in_off < size) {
+        ssize_t n = orig_copy_file_range(in_fd, &in_off, out_fd, &out_off, size - in_off, 0);
+        if (n <= 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+    * @brief Serve a file just opened on the server from the local cache.
+    * @details Read-only opens share the cache entry, which is refreshed first if the server has a
+    * newer version. Writable opens work on a private copy that is written back when closed.
+    * With O_TRUNC only the block signatures of the server version are needed, not its content.
+    * @param fd The server file descriptor.
+    * @param pathname The remote path.
+    * @param flags The open flags.
+    * @return The cache state, or NULL if the file is served remotely.
+    */
+struct cached_file *cacheOpen(int fd, const char *pathname, int flags) {
+    struct stat statbuf;
+    if (fd >= MAX_REMOTE_FDS || remoteFstat(fd, &statbuf) == -1 || !S_ISREG(statbuf.st_mode)) {
+        return NULL;
+    }
+    struct cached_file *cf = calloc(1, sizeof(struct cached_file));
+    cf->local_fd = -1;
+    cf->writable = (flags & O_ACCMODE) != O_RDONLY;
+    cf->pathname = strdup(pathname);
+
+    struct cache_stamp server;
+    stampFromStat(&server, &statbuf, 0);
+    cacheEntryPath(pathname, &server, cf->entry);
+    int valid = loadSignatures(cf->entry, &cf->base, &cf->sigs, &cf->nsigs) == 0 &&
+                sameVersion(&cf->base, &server);
+    if (valid) {
+        cf->local_fd = orig_open(cf->entry, O_RDONLY);
+        struct stat local;
+        if (cf->local_fd == -1 || fstat(cf->local_fd, &local) == -1 || local.st_size != server.size) {
+            valid = 0;
+        }
+    }
+    if (!valid) {
+        if (cf->local_fd != -1) orig_close(cf->local_fd);
+        cf->local_fd = -1;
+        if (cf->sigs != NULL) free(cf->sigs);
+        cf->sigs = NULL;
+        cf->base = server;
+        cf->nsigs = stampBlocks(&server);
+    }
+
+    if (!cf->writable && valid) {
+        fprintf(stderr, "mylib: cache hit | path %s\n", pathname);
+        cf->hit = 1;
+        return cf;
+    }
+
+    // Fetch the server version, or copy the cached one, into a fresh local file.
+    snprintf(cf->private_path, sizeof(cf->private_path), "%s.XXXXXX", cf->entry);
+    int local_fd = mkstemp(cf->private_path);
+    int ok = local_fd != -1;
+    if (ok && (flags & O_TRUNC)) {
+        cf->dirty = server.size > 0;
+        ok = valid || fetchSignatures(fd, cf->base.block_size, &cf->base, &cf->sigs, &cf->nsigs) == 0;
+    } else if (ok && valid) {
+        ok = copyLocalFile(cf->local_fd, local_fd, server.size) == 0;
+        cf->base_valid = server.size;
+    } else if (ok) {
+        fprintf(stderr, "mylib: cache miss | path %s | size %ld\n", pathname, server.size);
+        ok = fetchFile(fd, local_fd, &cf->base, &cf->sigs) == 0;
+        cf->base_valid = server.size;
+        if (ok && !cf->writable) {
+            // Publish the fetched copy for later opens.
+            ok = rename(cf->private_path, cf->entry) == 0 &&
+                 saveSignatures(cf->entry, &cf->base, cf->sigs, cf->nsigs) == 0;
+            cf->private_path[0] = '\0';
+            char *entry = cf->entry;
+            if (ok) pruneCacheEntries(&entry, 1);
+        }
+    }
+    if (cf->local_fd != -1) orig_close(cf->local_fd);
+    cf->local_fd = local_fd;
+    if (!ok) {
+        fprintf(stderr, "mylib: caching failed, serving remotely | path %s\n", pathname);
+        if (local_fd != -1) orig_close(local_fd);
+        if (cf->private_path[0] != '\0') orig_unlink(cf->private_path);
+        free(cf->sigs);
+        free(cf->pathname);
+        free(cf);
+        return NULL;
+    }
+    orig_lseek(cf->local_fd, 0, SEEK_SET);
+    return cf;
+}
+
+/**
+    * @brief Record that a range of a cached copy was written.
+    * @details Extents are kept sorted and merged. Past MAX_DIRTY_EXTENTS the closest ones are joined,
+    * which only makes the write-back look at more data than needed.
+    */
+void markDirty(struct cached_file *cf, off_t start, off_t end) {
+    cf->dirty = 1;
+    int i = 0;
+    while (i < cf->nextents && cf->extents[i].end < start) i++;
+    int j = i;
+    while (j < cf->nextents && cf->extents[j].start <= end) {
+        if (cf->extents[j].start < start) start = cf->extents[j].start;
+        if (cf->extents[j].end > end) end = cf->extents[j].end;
+        j++;
+    }
+    if (j == i && cf->nextents == MAX_DIRTY_EXTENTS) {
+        // No room for a new extent: join the pair with the smallest gap.
+        int best = 0;
+        for (int k = 1; k + 1 < cf->nextents; k++) {
+            if (cf->extents[k + 1].start - cf->extents[k].end < cf->extents[best + 1].start - cf->extents[best].end) {
+                best = k;
+            }
+        }
+        cf->extents[best].end = cf->extents[best + 1].end;
+        memmove(&cf->extents[best + 1], &cf->extents[best + 2], (cf->nextents - best - 2) * sizeof(struct dirty_extent));
+        cf->nextents--;
+        markDirty(cf, start, end);
+        return;
+    }
+    memmove(&cf->extents[i + 1], &cf->extents[j], (cf->nextents - j) * sizeof(struct dirty_extent));
+    cf->nextents += 1 - (j - i);
+    cf->extents[i].start = start;
+    cf->extents[i].end = end;
+}
+
+/**
+    * @brief Delta instructions being written out.
+    */
+struct delta_writer {
+    FILE *out;
+    size_t block_size;
+    int64_t copy_start;        // pending run of copied base blocks
+    int64_t copy_count;
+    char literal[MAX_LITERAL]; // pending literal data
+    size_t literal_len;
+    off_t dst;                 // offset in the new file of the next byte described
+    int inplace;               // every copy so far reads at or after the offset it writes
+    uint64_t literal_bytes;
+    uint64_t copied_bytes;
+};
+
+/**
+    * @brief Write out the pending copy instruction.
+    */
+void flushCopy(struct delta_writer *dw) {
+    if (dw->copy_count == 0) {
+        return;
+    }
+    fputc('C', dw->out);
+    fwrite(&dw->copy_start, sizeof(uint64_t), 1, dw->out);
+    fwrite(&dw->copy_count, sizeof(uint64_t), 1, dw->out);
+    dw->copy_count = 0;
+}
+
+/**
+    * @brief Write out the pending literal instruction.
+    */
+void flushLiteral(struct delta_writer *dw) {
+    if (dw->literal_len == 0) {
+        return;
+    }
+    int len = dw->literal_len;
+    fputc('L', dw->out);
+    fwrite(&len, sizeof(uint32_t), 1, dw->out);
+    fwrite(dw->literal, 1, dw->literal_len, dw->out);
+    dw->literal_len = 0;
+}
+
+/**
+    * @brief Describe the next bytes of the new file as literal data.
+    */
+void emitLiteral(struct delta_writer *dw, const unsigned char *data, size_t len) {
+    if (len == 0) {
+        return;
+    }
+    flushCopy(dw);
+    dw->dst += len;
+    dw->literal_bytes += len;
+    while (len > 0) {
+        size_t take = MAX_LITERAL - dw->literal_len < len ? MAX_LITERAL - dw->literal_len : len;
+        memcpy(dw->literal + dw->literal_len, data, take);
+        dw->literal_len += take;
+        data += take;
+        len -= take;
+        if (dw->literal_len == MAX_LITERAL) {
+            flushLiteral(dw);
+        }
+    }
+}
+
+/**
+    * @brief Describe the next bytes of the new file as a copy of a base block.
+    */
+void emitCopy(struct delta_writer *dw, int64_t block, size_t len) {
+    flushLiteral(dw);
+    if ((off_t)block * (off_t)dw->block_size < dw->dst) {
+        dw->inplace = 0;
+    }
+    if (dw->copy_count > 0 && dw->copy_start + dw->copy_count == block) {
+        dw->copy_count++;
+    } else {
+        flushCopy(dw);
+        dw->copy_start = block;
+        dw->copy_count = 1;
+    }
+    dw->dst += len;
+    dw->copied_bytes += len;
+}
+
+/**
+    * @brief Hash table from rolling checksums to base blocks.
+    */
+struct sig_index {
+    const struct cache_stamp *base;
+    const struct block_sig *sigs;
+    int64_t *head;
+    int64_t *next;
+    uint32_t mask;
+};
+
+/**
+    * @brief Build the rolling checksum index of the base signatures.
+    */
+void buildSigIndex(struct sig_index *idx, const struct cache_stamp *base, const struct block_sig *sigs, int64_t nsigs) {
+    uint32_t size = 1;
+    while (size < nsigs * 2 && size < (1u << 24)) size <<= 1;
+    idx->base = base;
+    idx->sigs = sigs;
+    idx->mask = size - 1;
+    idx->head = malloc(size * sizeof(int64_t));
+    idx->next = malloc((nsigs + 1) * sizeof(int64_t));
+    memset(idx->head, 0xff, size * sizeof(int64_t));
+    for (int64_t i = nsigs - 1; i >= 0; i--) {
+        uint32_t h = (sigs[i].weak ^ (sigs[i].weak >> 16)) & idx->mask;
+        idx->next[i] = idx->head[h];
+        idx->head[h] = i;
+    }
+}
+
+/**
+    * @brief Find a base block with the given content.
+    * @param idx The index.
+    * @param weak The rolling checksum of data.
+    * @param data The candidate bytes.
+    * @param len The number of bytes.
+    * @param hint A block to try first, usually the one after the previous match.
+    * @return The block number, or -1 if no block matches.
+    */
+int64_t findBlock(struct sig_index *idx, uint32_t weak, const unsigned char *data, size_t len, int64_t hint) {
+    unsigned char digest[SHA256_LEN];
+    int have_digest = 0;
+    int64_t i = idx->head[(weak ^ (weak >> 16)) & idx->mask];
+    int64_t candidate = hint < stampBlocks(idx->base) && hint >= 0 ? hint : i;
+    while (candidate != -1) {
+        const struct block_sig *sig = &idx->sigs[candidate];
+        if (sig->weak == weak && stampBlockLen(idx->base, candidate) == len) {
+            if (!have_digest) {
+                sha256(data, len, digest);
+                have_digest = 1;
+            }
+            if (memcmp(sig->strong, digest, STRONG_SUM_LEN) == 0) {
+                return candidate;
+            }
+        }
+        if (candidate == hint) {
+            candidate = i;
+            hint = -1;
+        } else {
+            candidate = idx->next[candidate];
+        }
+    }
+    return -1;
+}
+
+/**
+    * @brief Describe a range of the new file by matching it against the base blocks at every byte offset.
+    * @param local_fd The new file.
+    * @param dw The delta being written.
+    * @param idx The base block index.
+    * @param start The start of the range.
+    * @param end The end of the range.
+    * @return 0 if successful, -1 if error.
+    */
+int matchRange(int local_fd, struct delta_writer *dw, struct sig_index *idx, off_t start, off_t end) {
+    size_t block_size = idx->base->block_size;
+    size_t cap = 4 * block_size > 1024 * 1024 ? 4 * block_size : 1024 * 1024;
+    unsigned char *buf = malloc(cap);
+    off_t buf_off = start;
+    size_t len = 0, p = 0, lit = 0;
+    int have_sum = 0;
+    uint32_t sum = 0;
+    int64_t hint = -1;
+    while (1) {
+        if (p + block_size > len && buf_off + (off_t)len < end) {
+            // Slide the window: emit what is behind p and read further.
+            emitLiteral(dw, buf + lit, p - lit);
+            memmove(buf, buf + p, len - p);
+            buf_off += p;
+            len -= p;
+            p = lit = 0;
+            while (len < cap && buf_off + (off_t)len < end) {
+                size_t want = cap - len < (size_t)(end - buf_off - len) ? cap - len : (size_t)(end - buf_off - len);
+                ssize_t n = pread(local_fd, buf + len, want, buf_off + len);
+                if (n <= 0) {
+                    free(buf);
+                    return -1;
+                }
+                len += n;
+            }
+        }
+        if (p + block_size > len) {
+            break;
+        }
+        if (!have_sum) {
+            sum = rollsum_block(buf + p, block_size);
+            have_sum = 1;
+        }
+        int64_t block = findBlock(idx, sum, buf + p, block_size, hint);
+        if (block >= 0) {
+            emitLiteral(dw, buf + lit, p - lit);
+            emitCopy(dw, block, block_size);
+            p += block_size;
+            lit = p;
+            have_sum = 0;
+            hint = block + 1;
+            continue;
+        }
+        if (p + block_size < len) {
+            sum = rollsum_roll(sum, buf[p], buf[p + block_size], block_size);
+        } else {
+            have_sum = 0;
+        }
+        p++;
+    }
+
+    // The short last block of the base can only match the end of the new file.
+    int64_t last = stampBlocks(idx->base) - 1;
+    if (last >= 0 && end == dw->dst + (off_t)(len - lit) && stampBlockLen(idx->base, last) == len - p && p < len) {
+        if (findBlock(idx, rollsum_block(buf + p, len - p), buf + p, len - p, last) == last) {
+            emitLiteral(dw, buf + lit, p - lit);
+            emitCopy(dw, last, len - p);
+            lit = p = len;
+        }
+    }
+    emitLiteral(dw, buf + lit, len - lit);
+    free(buf);
+    return 0;
+}
+
+/**
+    * @brief Check whether a base block is untouched at its original offset in the new file.
+    */
+int cleanBlock(struct cached_file *cf, int64_t block, off_t new_size) {
+    if (block >= cf->nsigs) {
+        return 0;
+    }
+    off_t start = block * (off_t)cf->base.block_size;
+    off_t end = start + stampBlockLen(&cf->base, block);
+    off_t limit = cf->base_valid < new_size ? cf->base_valid : new_size;
+    if (end > limit) {
+        return 0;
+    }
+    for (int i = 0; i < cf->nextents; i++) {
+        if (cf->extents[i].start < end && cf->extents[i].end > start) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+    * @brief Write the delta that turns the base version of a cached file into its local copy.
+    * @details Blocks the application never wrote are copied at their offsets without being read.
+    * Everything else is matched against the base blocks with the rolling checksum, so data that
+    * only moved is still not sent.
+    * @param cf The cached file.
+    * @param dw The delta writer.
+    * @param new_size The size of the local copy.
+    * @param use_extents Whether the dirty extents describe the local copy relative to the base.
+    * @param reused Set for each block of the new file whose signature equals the base one.
+    * @return 0 if successful, -1 if error.
+    */
+int writeDelta(struct cached_file *cf, struct delta_writer *dw, off_t new_size, int use_extents, char *reused) {
+    size_t block_size = cf->base.block_size;
+    if (!delta_enabled) {
+        unsigned char data[MAX_LITERAL];
+        for (off_t off = 0; off < new_size; ) {
+            ssize_t n = pread(cf->local_fd, data, sizeof(data), off);
+            if (n <= 0) {
+                return -1;
+            }
+            emitLiteral(dw, data, n);
+            off += n;
+        }
+        return 0;
+    }
+    struct sig_index idx;
+    buildSigIndex(&idx, &cf->base, cf->sigs, cf->nsigs);
+    int rv = 0;
+    off_t cur = 0;
+    while (cur < new_size && rv == 0) {
+        int64_t block = cur / block_size;
+        if (use_extents && cleanBlock(cf, block, new_size)) {
+            size_t len = stampBlockLen(&cf->base, block);
+            size_t new_len = new_size - cur < (off_t)block_size ? new_size - cur : block_size;
+            emitCopy(dw, block, len);
+            reused[block] = len == new_len;
+            cur = dw->dst;
+            continue;
+        }
+        off_t end = cur;
+        do {
+            end = (end / block_size + 1) * block_size;
+        } while (end < new_size && !(use_extents && cleanBlock(cf, end / block_size, new_size)));
+        if (end > new_size) end = new_size;
+        rv = matchRange(cf->local_fd, dw, &idx, cur, end);
+        cur = end;
+    }
+    free(idx.head);
+    free(idx.next);
+    return rv;
+}
+
+/**
+    * @brief Write a dirty cached file back to the server.
+    * @details The delta is built in a temporary file first, so memory use does not grow with the file.
+    * If the server version changed since the copy was taken, fresh signatures are fetched and the
+    * whole copy is matched against them.
+    * @param fd The server file descriptor.
+    * @param cf The cached file.
+    * @return 0 if successful, -1 if error.
+    */
+int writeBack(int fd, struct cached_file *cf) {
+    struct stat local;
+    if (fstat(cf->local_fd, &local) == -1) {
+        return -1;
+    }
+    off_t new_size = local.st_size;
+    int64_t new_blocks = (new_size + cf->base.block_size - 1) / cf->base.block_size;
+    char *reused = calloc(new_blocks + 1, 1);
+    int use_extents = 1;
+    int error = 0;
+    for (int attempt = 0; attempt < 2; attempt++) {
+        struct delta_writer *dw = calloc(1, sizeof(struct delta_writer));
+        dw->out = tmpfile();
+        dw->block_size = cf->base.block_size;
+        dw->inplace = 1;
+        if (dw->out == NULL || writeDelta(cf, dw, new_size, use_extents, reused) == -1) {
+            error = EIO;
+            if (dw->out != NULL) fclose(dw->out);
+            free(dw);
+            break;
+        }
+        flushCopy(dw);
+        flushLiteral(dw);
+        fflush(dw->out);
+        int64_t delta_len = ftell(dw->out);
+        rewind(dw->out);
+
+        // Request Format:
+        // | op     | fd     | block size | flags  | base size | base mtime sec | base mtime nsec | new size | delta length | delta |
+        // | int(4) | int(4) | int(4)     | int(4) | int(8)    | int(8)         | int(8)          | int(8)   | int(8)       | n     |
+        int op = 11, flags = dw->inplace ? DELTA_INPLACE : 0;
+        int64_t size64 = new_size;
+        size_t req_length[9] = {sizeof(uint32_t), sizeof(uint32_t), sizeof(uint32_t), sizeof(uint32_t),
+                                sizeof(uint64_t), sizeof(uint64_t), sizeof(uint64_t), sizeof(uint64_t), sizeof(uint64_t)};
+        int req_offsets[10] = {0};
+        for (int i = 0; i < 9; i++) {
+            req_offsets[i + 1] = req_offsets[i] + req_length[i];
+        }
+        char reqBuf[req_offsets[9] + 1];
+        memcpy(reqBuf + req_offsets[0], &op, req_length[0]);
+        memcpy(reqBuf + req_offsets[1], &fd, req_length[1]);
+        memcpy(reqBuf + req_offsets[2], &cf->base.block_size, req_length[2]);
+        memcpy(reqBuf + req_offsets[3], &flags, req_length[3]);
+        memcpy(reqBuf + req_offsets[4], &cf->base.size, req_length[4]);
+        memcpy(reqBuf + req_offsets[5], &cf->base.mtime_sec, req_length[5]);
+        memcpy(reqBuf + req_offsets[6], &cf->base.mtime_nsec, req_length[6]);
+        memcpy(reqBuf + req_offsets[7], &size64, req_length[7]);
+        memcpy(reqBuf + req_offsets[8], &delta_len, req_length[8]);
+        reqBuf[req_offsets[9]] = '\0';
+        sendRequest(reqBuf, req_offsets[9]);
+        char chunk[MAX_MSG_LEN + 1];
+        size_t n;
+        while ((n = fread(chunk, 1, MAX_MSG_LEN, dw->out)) > 0) {
+            chunk[n] = '\0';
+            sendRequest(chunk, n);
+        }
+        fclose(dw->out);
+        fprintf(stderr, "mylib: delta write-back | size %ld | literal %lu | copied %lu | delta %ld | inplace %d\n",
+                new_size, dw->literal_bytes, dw->copied_bytes, delta_len, dw->inplace);
+        free(dw);
+
+        // Response Format:
+        // | new size | errno  | statbuf   |
+        // | int(8)   | int(4) | stat_size |
+        char resBuf[sizeof(uint64_t) + sizeof(uint32_t) + sizeof(struct stat)];
+        receiveResponse(resBuf, sizeof(resBuf));
+        int64_t result;
+        struct stat statbuf;
+        memcpy(&result, resBuf, sizeof(uint64_t));
+        memcpy(&error, resBuf + sizeof(uint64_t), sizeof(uint32_t));
+        memcpy(&statbuf, resBuf + sizeof(uint64_t) + sizeof(uint32_t), sizeof(struct stat));
+        if (result == new_size) {
+            // The local copy now is the server version.
+            struct block_sig *sigs = malloc((new_blocks + 1) * sizeof(struct block_sig));
+            unsigned char *block = malloc(cf->base.block_size);
+            for (int64_t i = 0; i < new_blocks; i++) {
+                if (reused[i] && i < cf->nsigs) {
+                    sigs[i] = cf->sigs[i];
+                    continue;
+                }
+                ssize_t len = pread(cf->local_fd, block, cf->base.block_size, i * (off_t)cf->base.block_size);
+                block_sig_compute(block, len > 0 ? len : 0, &sigs[i]);
+            }
+            free(block);
+            free(cf->sigs);
+            cf->sigs = sigs;
+            cf->nsigs = new_blocks;
+            stampFromStat(&cf->base, &statbuf, cf->base.block_size);
+            cf->dirty = 0;
+            free(reused);
+            return 0;
+        }
+        if (error != ESTALE || attempt > 0) {
+            break;
+        }
+        // Someone else changed the file: match the whole copy against the current server version.
+        fprintf(stderr, "mylib: delta base is stale, refetching signatures\n");
+        free(cf->sigs);
+        cf->sigs = NULL;
+        if (fetchSignatures(fd, cf->base.block_size, &cf->base, &cf->sigs, &cf->nsigs) == -1) {
+            error = errno;
+            break;
+        }
+        memset(reused, 0, new_blocks + 1);
+        use_extents = 0;
+    }
+    free(reused);
+    errno = error ? error : EIO;
+    return -1;
+}
+
+/**
+    * @brief Stop serving a file from the cache, writing it back first if it is dirty.
+    * @param fd The server file descriptor.
+    * @return 0 if successful, -1 if the write-back failed.
+    */
+int cacheClose(int fd) {
+    struct cached_file *cf = cached_files[fd];
+    cached_files[fd] = NULL;
+    int rv = 0;
+    if (cf->dirty) {
+        rv = writeBack(fd, cf);
+    }
+    int saved_errno = errno;
+    if (cf->private_path[0] != '\0') {
+        // A clean or written back private copy becomes the shared entry for later opens.
+        char entry[PATH_MAX];
+        cacheEntryPath(cf->pathname, &cf->base, entry);
+        if (rv == 0 && rename(cf->private_path, entry) == 0) {
+            saveSignatures(entry, &cf->base, cf->sigs, cf->nsigs);
+            char *keep = entry;
+            pruneCacheEntries(&keep, 1);
+        } else {
+            orig_unlink(cf->private_path);
+        }
+    }
+    orig_close(cf->local_fd);
+    free(cf->sigs);
+    free(cf->pathname);
+    free(cf);
+    errno = saved_errno;
+    return rv;
+}
+
+/**
+    * @brief A server reply kept for the life of the process, valid because the export is read-only,
+    * or until the server calls the path back.
+    */
+struct export_entry {
+    struct export_entry *next;
+    char *key;                     // kind of request, then its arguments
+    char *data;
+    size_t len;
+};
+
+// replies of a read-only export, hashed by key
+struct export_entry *export_table[EXPORT_BUCKETS];
+
+// memory of the export cache, accounted by the memory governor
+struct mem_cache export_cache;
+
+/**
+    * @brief Directory offset of a descriptor opened on a read-only export.
+    * @details Listings are cached by directory offset. A listing served from the cache does not
+    * move the offset of the server descriptor, so the server is told where to continue before
+    * the next listing that is not.
+    */
+struct export_file {
+    char *path;
+    off_t dir_off;                 // directory offset of the application
+    int server_behind;             // the server descriptor is not at dir_off
+};
+
+struct export_file *export_files[MAX_REMOTE_FDS];
+
+/**
+    * @brief Ask the server whether it exports read-only data, and at which generation.
+    */
+void exportRequest(void) {
+    // Request Format:
+    // | op     |
+    // | int(4) |
+    int op = 16;
+    sendRequest((char *)&op, sizeof(uint32_t));
+
+    // Response Format:
+    // | read only | generation |
+    // | int(4)    | int(8)     |
+    char resBuf[sizeof(uint32_t) + sizeof(uint64_t)];
+    receiveResponse(resBuf, sizeof(resBuf));
+    memcpy(&export_readonly, resBuf, sizeof(uint32_t));
+    memcpy(&export_generation, resBuf + sizeof(uint32_t), sizeof(uint64_t));
+    fprintf(stderr, "mylib: export | read only %d | generation %ld\n", export_readonly, export_generation);
+}
+
+/**
+    * @brief Bucket of a key in the export cache, by FNV-1a.
+    */
+size_t exportBucket(const char *key) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (; *key != '\0'; key++) {
+        h = (h ^ (unsigned char)*key) * 0x100000001b3ULL;
+    }
+    return h & (EXPORT_BUCKETS - 1);
+}
+
+/**
+    * @brief Find a cached reply of a read-only export.
+    * @return The entry, or NULL if the request has to go to the server.
+    */
+struct export_entry *exportLookup(const char *key) {
+    for (struct export_entry *e = export_table[exportBucket(key)]; e != NULL; e = e->next) {
+        if (strcmp(e->key, key) == 0) {
+            memHit(&export_cache);
+            metrics.export_hits++;
+            return e;
+        }
+    }
+    metrics.export_misses++;
+    return NULL;
+}
+
+/**
+    * @brief Keep a reply of a read-only export, unless the memory governor refuses the room.
+    */
+void exportStore(const char *key, const void *data, size_t len) {
+    size_t key_len = strlen(key);
+    if (memCharge(&export_cache, sizeof(struct export_entry) + key_len + 1 + len) == -1) {
+        return;
+    }
+    struct export_entry *e = malloc(sizeof(struct export_entry));
+    e->key = strdup(key);
+    e->data = malloc(len + 1);
+    memcpy(e->data, data, len);
+    e->data[len] = '\0';
+    e->len = len;
+    size_t bucket = exportBucket(key);
+    e->next = export_table[bucket];
+    export_table[bucket] = e;
+}
+
+/**
+    * @brief Drop cached replies of a read-only export when the memory governor needs room.
+    * @return The bytes freed.
+    */
+size_t shrinkExportCache(size_t want) {
+    size_t freed = 0;
+    for (int i = 0; i < EXPORT_BUCKETS && freed < want; i++) {
+        while (export_table[i] != NULL) {
+            struct export_entry *e = export_table[i];
+            export_table[i] = e->next;
+            freed += sizeof(struct export_entry) + strlen(e->key) + 1 + e->len;
+            free(e->key);
+            free(e->data);
+            free(e);
+        }
+    }
+    memRelease(&export_cache, freed);
+    return freed;
+}
+
+/**
+    * @brief Name of the cache entry of a file of a read-only export at the current generation.
+    * @details It shares the path part of the name with the entries of cacheEntryPath, so it is pruned
+    * with them when another version of the file is fetched.
+    */
+void exportEntryPath(const char *pathname, char *entry) {
+    unsigned char path_digest[SHA256_LEN];
+    sha256(pathname, strlen(pathname), path_digest);
+    int len = snprintf(entry, PATH_MAX, "%s/", cache_dir);
+    for (int i = 0; i < 8; i++) {
+        len += snprintf(entry + len, PATH_MAX - len, "%02x", path_digest[i]);
+    }
+    snprintf(entry + len, PATH_MAX - len, "-g%ld", export_generation);
+}
+
+/**
+    * @brief Open the cached copy of a file of a read-only export, without asking the server.
+    * @return A local file descriptor, or -1 if the file was not cached at this generation.
+    */
+int exportOpenCached(const char *pathname) {
+    if (cache_dir == NULL) {
+        return -1;
+    }
+    char entry[PATH_MAX];
+    exportEntryPath(pathname, entry);
+    int local_fd = orig_open(entry, O_RDONLY);
+    if (local_fd != -1) {
+        metrics.export_hits++;
+        fprintf(stderr, "mylib: export cache hit | path %s\n", pathname);
+    }
+    return local_fd;
+}
+
+/**
+    * @brief Make a file just cached from a read-only export openable without the server.
+    */
+void exportPublish(struct cached_file *cf) {
+    char entry[PATH_MAX];
+    exportEntryPath(cf->pathname, entry);
+    if (link(cf->entry, entry) == -1 && errno != EEXIST) {
+        fprintf(stderr, "mylib: export publish failed | path %s | errno %d\n", cf->pathname, errno);
+    }
+}
+
+/**
+    * @brief The cached error of looking up a name of a read-only export.
+    * @return ENOENT or ENOTDIR if the name is known not to exist, otherwise 0.
+    */
+int exportMissing(const char *pathname) {
+    char key[PATH_MAX + 8];
+    snprintf(key, sizeof(key), "s%s", pathname);
+    struct export_entry *e = exportLookup(key);
+    int success, error;
+    if (e == NULL) {
+        return 0;
+    }
+    memcpy(&success, e->data, sizeof(uint32_t));
+    memcpy(&error, e->data + sizeof(uint32_t), sizeof(uint32_t));
+    return success == -1 && (error == ENOENT || error == ENOTDIR) ? error : 0;
+}
+
+/**
+    * @brief Remember that a name of a read-only export does not exist, as a failed stat.
+    */
+void exportRememberMissing(const char *pathname, int error) {
+    char key[PATH_MAX + 8];
+    char reply[2 * sizeof(uint32_t) + sizeof(struct stat)] = {0};
+    int success = -1;
+    memcpy(reply, &success, sizeof(uint32_t));
+    memcpy(reply + sizeof(uint32_t), &error, sizeof(uint32_t));
+    snprintf(key, sizeof(key), "s%s", pathname);
+    exportStore(key, reply, sizeof(reply));
+}
+
+/**
+    * @brief Version of a file the client has cached, sent with a fetch files request so the server
+    * leaves out content that did not change. The layout is sent over the wire as is.
+    */
+struct fetch_known {
+    int64_t size;                  // -1 if there is no cached version
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t ino;
+};
+
+/**
+    * @brief A file listed in the prefetch manifest.
+    */
+struct prefetch_item {
+    char *path;
+    char prefix[17];               // path part of the names of its cache entries
+    struct fetch_known known;
+};
+
+// file the paths of opened files are appended to, -1 if none
+int prefetch_record_fd = -1;
+
+// whether a fetch files response is being received, so no other request may be sent
+int fetch_receiving;
+
+/**
+    * @brief A directory whose opens are counted for the sibling prefetch.
+    */
+struct sibling_dir {
+    char *path;
+    int opens;
+    uint64_t last_ns;              // when a file of it was last opened
+};
+
+/**
+    * @brief A file pushed into the cache by a sibling prefetch, until it is opened.
+    */
+struct sibling_file {
+    struct sibling_file *next;
+    char *path;
+};
+
+// opens that make the server push the small files of a directory, 0 if never
+int sibling_threshold;
+
+struct sibling_dir sibling_dirs[SIBLING_DIRS];
+
+// pushed files not opened yet, hashed by path like the export cache
+struct sibling_file *sibling_files[EXPORT_BUCKETS];
+
+struct mem_cache sibling_cache;
+
+/**
+    * @brief Remember a file pushed by a sibling prefetch, to count the opens it serves.
+    */
+void siblingPushed(const char *path) {
+    size_t bucket = exportBucket(path);
+    for (struct sibling_file *f = sibling_files[bucket]; f != NULL; f = f->next) {
+        if (strcmp(f->path, path) == 0) {
+            return;
+        }
+    }
+    size_t bytes = sizeof(struct sibling_file) + strlen(path) + 1;
+    if (memCharge(&sibling_cache, bytes) == -1) {
+        return;
+    }
+    struct sibling_file *f = malloc(sizeof(struct sibling_file));
+    f->path = strdup(path);
+    f->next = sibling_files[bucket];
+    sibling_files[bucket] = f;
+    metrics.sibling_pushed++;
+}
+
+/**
+    * @brief Count an open served from the cache if the file was pushed by a sibling prefetch.
+    * @details Each pushed file counts once, the first time it is opened.
+    */
+void siblingHit(const char *path) {
+    size_t bucket = exportBucket(path);
+    for (struct sibling_file **link = &sibling_files[bucket]; *link != NULL; link = &(*link)->next) {
+        struct sibling_file *f = *link;
+        if (strcmp(f->path, path) == 0) {
+            *link = f->next;
+            memRelease(&sibling_cache, sizeof(struct sibling_file) + strlen(f->path) + 1);
+            memHit(&sibling_cache);
+            free(f->path);
+            free(f);
+            metrics.sibling_hits++;
+            return;
+        }
+    }
+}
+
+/**
+    * @brief Forget the pushed files, which only makes later opens of them go uncounted.
+    * @return The bytes freed.
+    */
+size_t shrinkSiblingFiles(size_t want) {
+    size_t freed = sibling_cache.bytes;
+    for (int i = 0; i < EXPORT_BUCKETS; i++) {
+        while (sibling_files[i] != NULL) {
+            struct sibling_file *f = sibling_files[i];
+            sibling_files[i] = f->next;
+            free(f->path);
+            free(f);
+        }
+    }
+    memRelease(&sibling_cache, freed);
+    return freed;
+}
+
+int comparePrefetchPath(const void *a, const void *b) {
+    return strcmp(((const struct prefetch_item *)a)->path, ((const struct prefetch_item *)b)->path);
+}
+
+int comparePrefetchPrefix(const void *a, const void *b) {
+    return strcmp(((const struct prefetch_item *)a)->prefix, ((const struct prefetch_item *)b)->prefix);
+}
+
+/**
+    * @brief Find the versions of manifest files already in the cache directory.
+    * @details One pass over the directory, matching entry names to the items sorted by prefix.
+    * Entries named by generation or being written have other name lengths and are skipped.
+    */
+void prefetchKnown(struct prefetch_item *items, int count) {
+    for (int i = 0; i < count; i++) {
+        unsigned char digest[SHA256_LEN];
+        sha256(items[i].path, strlen(items[i].path), digest);
+        for (int j = 0; j < 8; j++) {
+            snprintf(items[i].prefix + 2 * j, 3, "%02x", digest[j]);
+        }
+        items[i].known.size = -1;
+    }
+    qsort(items, count, sizeof(struct prefetch_item), comparePrefetchPrefix);
+    DIR *dir = opendir(cache_dir);
+    if (dir == NULL) {
+        return;
+    }
+    struct dirent *de;
+    while ((de = readdir(dir)) != NULL) {
+        if (strlen(de->d_name) != 33 || de->d_name[16] != '-') {
+            continue;
+        }
+        struct prefetch_item key;
+        memcpy(key.prefix, de->d_name, 16);
+        key.prefix[16] = '\0';
+        struct prefetch_item *item = bsearch(&key, items, count, sizeof(struct prefetch_item), comparePrefetchPrefix);
+        char entry[PATH_MAX];
+        struct cache_stamp stamp;
+        struct block_sig *sigs;
+        int64_t nsigs;
+        snprintf(entry, sizeof(entry), "%s/%s", cache_dir, de->d_name);
+        if (item != NULL && loadSignatures(entry, &stamp, &sigs, &nsigs) == 0) {
+            free(sigs);
+            item->known.size = stamp.size;
+            item->known.mtime_sec = stamp.mtime_sec;
+            item->known.mtime_nsec = stamp.mtime_nsec;
+            item->known.ino = stamp.ino;
+        }
+    }
+    closedir(dir);
+}
+
+/**
+    * @brief Receive the content of a fetched file into a new cache entry.
+    * @details Block signatures are computed as the content arrives, as fetchFile does.
+    * The content and the completion flag that follows it are consumed even if storing fails.
+    * @param entry Set to the name of the entry.
+    * @return 0 if the entry was stored, -1 if not.
+    */
+int prefetchStore(const char *path, const struct stat *statbuf, int64_t length, char *entry) {
+    struct cache_stamp stamp;
+    stampFromStat(&stamp, statbuf, 0);
+    int64_t nsigs = stampBlocks(&stamp);
+    struct block_sig *sigs = malloc((nsigs + 1) * sizeof(struct block_sig));
+    unsigned char *block = malloc(stamp.block_size);
+    char tmp[PATH_MAX];
+    snprintf(tmp, sizeof(tmp), "%s/prefetch.XXXXXX", cache_dir);
+    int local_fd = mkstemp(tmp);
+    int ok = local_fd != -1 && length == stamp.size;
+    int64_t done = 0;
+    for (int64_t received = 0; received < length; ) {
+        size_t n = length - received < stamp.block_size ? length - received : stamp.block_size;
+        receiveResponse((char *)block, n);
+        received += n;
+        ok = ok && orig_write(local_fd, block, n) == (ssize_t)n;
+        if (ok && done < nsigs) {
+            block_sig_compute(block, n, &sigs[done++]);
+        }
+    }
+    int complete;
+    receiveResponse((char *)&complete, sizeof(uint32_t));
+    ok = ok && complete && done == nsigs;
+    free(block);
+    if (local_fd != -1) orig_close(local_fd);
+
+    cacheEntryPath(path, &stamp, entry);
+    if (!ok || rename(tmp, entry) == -1 || saveSignatures(entry, &stamp, sigs, nsigs) == -1) {
+        if (local_fd != -1) orig_unlink(tmp);
+        ok = 0;
+    }
+    free(sigs);
+    return ok ? 0 : -1;
+}
+
+/**
+    * @brief Receive the records of a fetch files response.
+    * @details Content goes to the cache directory, so later opens find the files cached. On a read-only
+    * export the attributes go to the export cache as well, and cached files are made openable without
+    * the server. Older versions of the fetched files are pruned from the cache once, at the end.
+    * @param sibling Whether the files are siblings pushed by the server, counted as such.
+    */
+void receiveFetchRecords(int sibling) {
+    fetch_receiving = 1;
+    int stored = 0, capacity = 64;
+    char **entries = malloc(capacity * sizeof(char *));
+    // Response Format:
+    // | path length | path | res    | errno  | statbuf   | length | content | complete | ... | 0      |
+    // | int(4)      | n    | int(4) | int(4) | stat_size | int(8) | length  | int(4)   | ... | int(4) |
+    // The length is -1 when no content is sent, and then no completion flag follows either.
+    while (1) {
+        int path_len;
+        receiveResponse((char *)&path_len, sizeof(uint32_t));
+        if (path_len <= 0) {
+            break;
+        }
+        char path[PATH_MAX];
+        char reply[2 * sizeof(uint32_t) + sizeof(struct stat)];
+        int64_t length;
+        receiveResponse(path, path_len);
+        path[path_len] = '\0';
+        receiveResponse(reply, sizeof(reply));
+        receiveResponse((char *)&length, sizeof(uint64_t));
+        int res;
+        struct stat statbuf;
+        memcpy(&res, reply, sizeof(uint32_t));
+        memcpy(&statbuf, reply + 2 * sizeof(uint32_t), sizeof(struct stat));
+
+        int cached = 0;
+        if (length >= 0) {
+            // A pushed sibling may be cached already, the file just opened is, and is not counted.
+            int known = 0;
+            if (sibling) {
+                struct cache_stamp stamp, base;
+                struct block_sig *sigs;
+                int64_t nsigs;
+                char entry[PATH_MAX];
+                stampFromStat(&stamp, &statbuf, 0);
+                cacheEntryPath(path, &stamp, entry);
+                known = loadSignatures(entry, &base, &sigs, &nsigs) == 0;
+                if (known) {
+                    free(sigs);
+                    known = sameVersion(&base, &stamp);
+                }
+            }
+            char entry[PATH_MAX];
+            cached = prefetchStore(path, &statbuf, length, entry) == 0;
+            if (sibling) {
+                metrics.sibling_bytes += length;
+                if (cached && !known) siblingPushed(path);
+            } else {
+                metrics.prefetch_bytes += length;
+            }
+            if (cached && !sibling) {
+                metrics.prefetch_fetched++;
+            }
+            if (cached) {
+                if (stored == capacity) {
+                    capacity *= 2;
+                    entries = realloc(entries, capacity * sizeof(char *));
+                }
+                entries[stored++] = strdup(entry);
+            }
+        } else if (res == 0 && S_ISREG(statbuf.st_mode) && cache_dir != NULL && !sibling) {
+            cached = 1;
+            metrics.prefetch_unchanged++;
+        }
+        if (export_readonly) {
+            char key[PATH_MAX + 8];
+            snprintf(key, sizeof(key), "s%s", path);
+            exportStore(key, reply, sizeof(reply));
+            if (cached) {
+                struct cache_stamp stamp;
+                char entry[PATH_MAX], gen_entry[PATH_MAX];
+                stampFromStat(&stamp, &statbuf, 0);
+                cacheEntryPath(path, &stamp, entry);
+                exportEntryPath(path, gen_entry);
+                link(entry, gen_entry);
+            }
+        }
+    }
+    if (stored > 0) {
+        pruneCacheEntries(entries, stored);
+    }
+    for (int i = 0; i < stored; i++) {
+        free(entries[i]);
+    }
+    free(entries);
+    fetch_receiving = 0;
+}
+
+/**
+    * @brief Fetch the attributes and content of many files in one request.
+    * @param items The files, their known versions filled in.
+    * @param count The number of files.
+    */
+void fetchFiles(struct prefetch_item *items, int count) {
+    // Request Format:
+    // | op     | flags  | count  | path length | path | known           | ...
+    // | int(4) | int(4) | int(4) | int(4)      | n    | fetch_known(32) | ...
+    int op = 17, flags = cache_dir != NULL ? FETCH_CONTENT : 0;
+    size_t req_len = 3 * sizeof(uint32_t);
+    for (int i = 0; i < count; i++) {
+        req_len += sizeof(uint32_t) + strlen(items[i].path) + sizeof(struct fetch_known);
+    }
+    char *reqBuf = malloc(req_len);
+    char *p = reqBuf;
+    memcpy(p, &op, sizeof(uint32_t));
+    memcpy(p + sizeof(uint32_t), &flags, sizeof(uint32_t));
+    memcpy(p + 2 * sizeof(uint32_t), &count, sizeof(uint32_t));
+    p += 3 * sizeof(uint32_t);
+    for (int i = 0; i < count; i++) {
+        int path_len = strlen(items[i].path);
+        memcpy(p, &path_len, sizeof(uint32_t));
+        memcpy(p + sizeof(uint32_t), items[i].path, path_len);
+        memcpy(p + sizeof(uint32_t) + path_len, &items[i].known, sizeof(struct fetch_known));
+        p += sizeof(uint32_t) + path_len + sizeof(struct fetch_known);
+    }
+    sendRequest(reqBuf, req_len);
+    free(reqBuf);
+    receiveFetchRecords(0);
+}
+
+/**
+    * @brief Fetch the attributes and content of the files of a directory matching a glob pattern.
+    * @details The client does not know which files will match, so cached versions are not sent
+    * and current files are fetched again.
+    */
+void fetchGlob(const char *dir, const char *pattern) {
+    // Request Format:
+    // | op     | flags  | directory length | directory | pattern length | pattern |
+    // | int(4) | int(4) | int(4)           | n         | int(4)         | n       |
+    int op = 17, flags = FETCH_GLOB | (cache_dir != NULL ? FETCH_CONTENT : 0);
+    int dir_len = strlen(dir), pattern_len = strlen(pattern);
+    size_t req_len = 4 * sizeof(uint32_t) + dir_len + pattern_len;
+    char reqBuf[req_len];
+    char *p = reqBuf;
+    memcpy(p, &op, sizeof(uint32_t));
+    memcpy(p + sizeof(uint32_t), &flags, sizeof(uint32_t));
+    memcpy(p + 2 * sizeof(uint32_t), &dir_len, sizeof(uint32_t));
+    memcpy(p + 3 * sizeof(uint32_t), dir, dir_len);
+    p += 3 * sizeof(uint32_t) + dir_len;
+    memcpy(p, &pattern_len, sizeof(uint32_t));
+    memcpy(p + sizeof(uint32_t), pattern, pattern_len);
+    sendRequest(reqBuf, req_len);
+    receiveFetchRecords(0);
+}
+
+/**
+    * @brief Warm the caches with the files listed in a manifest, one path per line.
+    * @details Duplicate paths, as in a recorded manifest, are fetched once. A line whose last
+    * component is a glob pattern fetches the matching files of its directory.
+    */
+void prefetchManifest(const char *manifest) {
+    FILE *f = fopen(manifest, "r");
+    if (f == NULL) {
+        fprintf(stderr, "mylib: cannot read prefetch manifest %s\n", manifest);
+        return;
+    }
+    uint64_t start = monotonicNs();
+    int count = 0, capacity = 256, globs = 0;
+    struct prefetch_item *items = malloc(capacity * sizeof(struct prefetch_item));
+    char line[PATH_MAX];
+    int fetch = cache_dir != NULL || export_readonly;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        line[strcspn(line, "\n")] = '\0';
+        if (line[0] == '\0') {
+            continue;
+        }
+        char *slash = strrchr(line, '/');
+        char *name = slash != NULL ? slash + 1 : line;
+        if (strpbrk(name, "*?[") != NULL) {
+            if (slash != NULL) *slash = '\0';
+            if (fetch) fetchGlob(slash != NULL ? line : ".", name);
+            globs++;
+            continue;
+        }
+        if (count == capacity) {
+            capacity *= 2;
+            items = realloc(items, capacity * sizeof(struct prefetch_item));
+        }
+        memset(&items[count], 0, sizeof(struct prefetch_item));
+        items[count++].path = strdup(line);
+    }
+    fclose(f);
+
+    qsort(items, count, sizeof(struct prefetch_item), comparePrefetchPath);
+    int unique = 0;
+    for (int i = 0; i < count; i++) {
+        if (unique > 0 && strcmp(items[unique - 1].path, items[i].path) == 0) {
+            free(items[i].path);
+        } else {
+            items[unique++] = items[i];
+        }
+    }
+    if (cache_dir != NULL) {
+        prefetchKnown(items, unique);
+    }
+    // Without a cache directory only the attributes of a read-only export are worth fetching.
+    if (unique > 0 && fetch) {
+        fetchFiles(items, unique);
+    }
+    for (int i = 0; i < unique; i++) {
+        free(items[i].path);
+    }
+    free(items);
+    metrics.prefetch_files += unique;
+    metrics.prefetch_globs += globs;
+    metrics.prefetch_ns += monotonicNs() - start;
+}
+
+/**
+    * @brief Append the path of an opened file to the prefetch record.
+    */
+void prefetchRecord(const char *pathname) {
+    size_t len = strlen(pathname);
+    char line[len + 1];
+    memcpy(line, pathname, len);
+    line[len] = '\n';
+    orig_write(prefetch_record_fd, line, len + 1);
+}
+
+/**
+    * @brief Receive the files pushed by a sibling prefetch.
+    * @details Called before the next request is sent, the response arrives meanwhile.
+    */
+void siblingDrain(void) {
+    sibling_pending = 0;
+    uint64_t start = monotonicNs();
+    receiveFetchRecords(1);
+    fprintf(stderr, "mylib: sibling prefetch received | %.1f ms\n", (monotonicNs() - start) / 1e6);
+}
+
+/**
+    * @brief Count a file opened for reading, and have the server push the small files of its
+    * directory when enough of them were opened.
+    * @details The push is requested once per tracked directory. The response is not waited for:
+    * the server sends it while the program works on the file just opened, and it is received
+    * before the next request. Files larger than SIBLING_MAX_SIZE only send their attributes.
+    */
+void siblingOpened(const char *pathname) {
+    const char *slash = strrchr(pathname, '/');
+    int dir_len = slash == NULL || slash == pathname ? 1 : slash - pathname;
+    char dir[dir_len + 1];
+    memcpy(dir, slash != NULL ? pathname : ".", dir_len);
+    dir[dir_len] = '\0';
+
+    // Directories are tracked in a small table, the least recently used one gives way.
+    struct sibling_dir *sd = NULL, *oldest = &sibling_dirs[0];
+    for (int i = 0; i < SIBLING_DIRS && sd == NULL; i++) {
+        if (sibling_dirs[i].path != NULL && strcmp(sibling_dirs[i].path, dir) == 0) {
+            sd = &sibling_dirs[i];
+        } else if (sibling_dirs[i].last_ns < oldest->last_ns) {
+            oldest = &sibling_dirs[i];
+        }
+    }
+    if (sd == NULL) {
+        sd = oldest;
+        free(sd->path);
+        sd->path = strdup(dir);
+        sd->opens = 0;
+    }
+    sd->last_ns = monotonicNs();
+    if (++sd->opens != sibling_threshold || sibling_pending) {
+        return;
+    }
+
+    // Request Format:
+    // | op     | flags  | limit  | directory length | directory | pattern length | pattern |
+    // | int(4) | int(4) | int(8) | int(4)           | n         | int(4)         | n       |
+    int op = 17, flags = FETCH_GLOB | FETCH_SMALL | FETCH_CONTENT;
+    int64_t limit = SIBLING_MAX_SIZE;
+    int pattern_len = 1;
+    size_t req_len = 4 * sizeof(uint32_t) + sizeof(uint64_t) + dir_len + pattern_len;
+    char reqBuf[req_len];
+    char *p = reqBuf;
+    memcpy(p, &op, sizeof(uint32_t));
+    memcpy(p + sizeof(uint32_t), &flags, sizeof(uint32_t));
+    memcpy(p + 2 * sizeof(uint32_t), &limit, sizeof(uint64_t));
+    p += 2 * sizeof(uint32_t) + sizeof(uint64_t);
+    memcpy(p, &dir_len, sizeof(uint32_t));
+    memcpy(p + sizeof(uint32_t), dir, dir_len);
+    p += sizeof(uint32_t) + dir_len;
+    memcpy(p, &pattern_len, sizeof(uint32_t));
+    memcpy(p + sizeof(uint32_t), "*", pattern_len);
+    sendRequest(reqBuf, req_len);
+    sibling_pending = 1;
+    metrics.sibling_dirs++;
+}
+
+/**
+    * @brief A file being written for an upload batch.
+    * @details The application gets a local memory file descriptor, so writes, seeks and fstat are
+    * local system calls. Its content is copied into the batch when it is closed.
+    */
+struct upload_file {
+    char *path;
+    mode_t mode;
+};
+
+/**
+    * @brief Closed files waiting to be uploaded, already laid out as the upload request.
+    */
+struct upload_batch {
+    char *req;                     // op and count, then one record per file
+    size_t len;
+    size_t capacity;
+    char **paths;
+    int count;
+    struct mem_cache mem;
+};
+
+// whether files created for writing are uploaded in batches
+int upload_enabled;
+
+// files being written for an upload batch, indexed by their local file descriptor
+struct upload_file *upload_files[FD_OFFSET];
+
+struct upload_batch upload_batch;
+
+/**
+    * @brief Open a file created for writing as a local memory file of an upload batch.
+    * @return The local file descriptor, or -1 if the file has to be opened on the server.
+    */
+int uploadOpen(const char *pathname, int flags, mode_t mode) {
+    int fd = memfd_create("rpc-upload", (flags & O_CLOEXEC) ? MFD_CLOEXEC : 0);
+    if (fd == -1 || fd >= FD_OFFSET) {
+        if (fd != -1) orig_close(fd);
+        return -1;
+    }
+    upload_files[fd] = malloc(sizeof(struct upload_file));
+    upload_files[fd]->path = strdup(pathname);
+    upload_files[fd]->mode = mode;
+    return fd;
+}
+
+/**
+    * @brief Send the upload batch and report files the server could not write.
+    * @details The application already closed these files, so failures can only be logged.
+    */
+void uploadFlush(void) {
+    struct upload_batch *ub = &upload_batch;
+    if (ub->count == 0) {
+        return;
+    }
+    // Request Format:
+    // | op     | count  | path length | path | mode   | length | content | ...
+    // | int(4) | int(4) | int(4)      | n    | int(4) | int(8) | length  | ...
+    int op = 18;
+    memcpy(ub->req, &op, sizeof(uint32_t));
+    memcpy(ub->req + sizeof(uint32_t), &ub->count, sizeof(uint32_t));
+    uint64_t start = monotonicNs();
+    sendRequest(ub->req, ub->len);
+
+    // Response Format:
+    // | count  | errno  | ... |
+    // | int(4) | int(4) | ... |
+    int count;
+    receiveResponse((char *)&count, sizeof(uint32_t));
+    int *status = malloc((count + 1) * sizeof(int));
+    receiveResponse((char *)status, count * sizeof(uint32_t));
+    linkSample(ub->len, monotonicNs() - start);
+    for (int i = 0; i < ub->count; i++) {
+        if (i >= count || status[i] != 0) {
+            fprintf(stderr, "mylib: upload failed | path %s | errno %d\n", ub->paths[i], i < count ? status[i] : EIO);
+            metrics.upload_failures++;
+        }
+        free(ub->paths[i]);
+    }
+    free(status);
+    metrics.upload_files += ub->count;
+    metrics.upload_batches++;
+    metrics.upload_bytes += ub->len;
+    memRelease(&ub->mem, ub->mem.bytes);
+    free(ub->req);
+    ub->req = NULL;
+    ub->len = ub->capacity = 0;
+    ub->count = 0;
+}
+
+/**
+    * @brief Send the upload batch when the memory governor needs room.
+    * @return The bytes freed.
+    */
+size_t shrinkUploadBatch(size_t want) {
+    if (fetch_receiving) {
+        return 0;
+    }
+    size_t freed = upload_batch.capacity;
+    uploadFlush();
+    return freed;
+}
+
+/**
+    * @brief Move a file written for an upload batch into the batch.
+    * @details A batch holds each path once, the server writes its files in any order. The batch
+    * is sent first if the path is already in it or if it is full.
+    * @param fd The local file descriptor, left open.
+    */
+void uploadAdd(int fd) {
+    struct upload_batch *ub = &upload_batch;
+    struct upload_file *uf = upload_files[fd];
+    upload_files[fd] = NULL;
+    int64_t size = orig_lseek(fd, 0, SEEK_END);
+    if (size < 0) size = 0;
+    for (int i = 0; i < ub->count; i++) {
+        if (strcmp(ub->paths[i], uf->path) == 0) {
+            uploadFlush();
+            break;
+        }
+    }
+    int path_len = strlen(uf->path);
+    size_t record = sizeof(uint32_t) + path_len + sizeof(uint32_t) + sizeof(uint64_t) + size;
+    if (ub->count == UPLOAD_BATCH_FILES || (ub->count > 0 && ub->len + record > UPLOAD_BATCH_BYTES)) {
+        uploadFlush();
+    }
+    size_t needed = (ub->len > 0 ? ub->len : 2 * sizeof(uint32_t)) + record;
+    if (needed > ub->capacity) {
+        size_t capacity = ub->capacity > 0 ? ub->capacity : 64 * 1024;
+        while (capacity < needed) capacity *= 2;
+        // Without room for a larger batch, the batch is sent and the file starts a new one.
+        if (memCharge(&ub->mem, capacity - ub->capacity) == -1 && ub->count > 0) {
+            uploadFlush();
+            needed = 2 * sizeof(uint32_t) + record;
+            capacity = 64 * 1024;
+            while (capacity < needed) capacity *= 2;
+            memCharge(&ub->mem, capacity);
+        }
+        ub->req = realloc(ub->req, capacity);
+        ub->capacity = capacity;
+    }
+    if (ub->len == 0) {
+        ub->len = 2 * sizeof(uint32_t);
+        ub->paths = realloc(ub->paths, UPLOAD_BATCH_FILES * sizeof(char *));
+    }
+    char *p = ub->req + ub->len;
+    memcpy(p, &path_len, sizeof(uint32_t));
+    memcpy(p + sizeof(uint32_t), uf->path, path_len);
+    p += sizeof(uint32_t) + path_len;
+    memcpy(p, &uf->mode, sizeof(uint32_t));
+    memcpy(p + sizeof(uint32_t), &size, sizeof(uint64_t));
+    p += sizeof(uint32_t) + sizeof(uint64_t);
+    for (int64_t done = 0; done < size; ) {
+        ssize_t n = pread(fd, p + done, size - done, done);
+        if (n <= 0) {
+            memset(p + done, 0, size - done);
+            break;
+        }
+        done += n;
+    }
+    ub->len += record;
+    ub->paths[ub->count++] = uf->path;
+    free(uf);
+}
+
+/**
+    * @brief Read-ahead, write-behind or append buffer of a remote file descriptor.
+    * @details Descriptors of uncached files opened read-only read a whole transfer ahead and serve
+    * small reads from it. Those opened write-only gather small writes and send them as one transfer.
+    * The server file offset runs ahead of the application's by the bytes buffered.
+    * Those opened with O_APPEND gather whole records into batches the server appends atomically.
+    * A delegated write-behind buffer gathers writes of any size and grows up to DELEGATION_MAX_BUFFER.
+    */
+struct stream_buffer {
+    int mode;                      // STREAM_READ_AHEAD, STREAM_WRITE_BEHIND or STREAM_APPEND
+    char *data;
+    size_t size;                   // bytes allocated
+    size_t len;                    // bytes held
+    size_t pos;                    // bytes of a read-ahead already consumed
+    int error;                     // errno of a failed write-behind, reported by the next write or close
+    uint64_t first_ns;             // when the oldest record of an append batch was gathered
+    int delegated;                 // this client holds the write delegation of the file
+    off_t offset;                  // server file offset, kept while delegated
+    char *path;                    // path the delegated file was opened by
+};
+
+struct stream_buffer *streams[MAX_REMOTE_FDS];
+
+// whether small reads and writes of uncached files are buffered
+int buffering_enabled = 1;
+
+// number of write-behind and append buffers holding data
+int write_behind_pending;
+
+// memory of the stream buffers, accounted by the memory governor
+struct mem_cache stream_cache;
+
+// whether write-only opens ask for a write delegation
+int delegation_enabled = 1;
+
+void delegationGranted(int fd, const char *pathname);
+void delegationReturn(int fd, struct stream_buffer *sb);
+
+// whether to ask the server for callbacks, and the control connection it pushes invalidations on
+int callbacks_enabled;
+int callback_fd = -1;
+
+// paths of the server descriptors opened for writing while callbacks are on, and their number
+// together with the files open for an upload batch
+char *callback_written[MAX_REMOTE_FDS];
+int callback_writers;
+
+int serverConnect(void);
+
+/**
+    * @brief Ask the server to call back on changes, and attach a second connection to receive them.
+    */
+void callbackConnect(void) {
+    // Request Format:
+    // | op     |
+    // | int(4) |
+    int op = 21;
+    sendRequest((char *)&op, sizeof(uint32_t));
+
+    // Response Format:
+    // | session | token  | errno  |
+    // | int(4)  | int(8) | int(4) |
+    char resBuf[2 * sizeof(uint32_t) + sizeof(uint64_t)];
+    receiveResponse(resBuf, sizeof(resBuf));
+    int session, error;
+    memcpy(&session, resBuf, sizeof(uint32_t));
+    memcpy(&error, resBuf + sizeof(uint32_t) + sizeof(uint64_t), sizeof(uint32_t));
+    if (session == -1) {
+        fprintf(stderr, "mylib: callbacks refused | errno %d\n", error);
+        return;
+    }
+
+    // Request Format, on the control connection:
+    // | op     | session | token  |
+    // | int(4) | int(4)  | int(8) |
+    int fd = serverConnect();
+    char reqBuf[2 * sizeof(uint32_t) + sizeof(uint64_t)];
+    op = 22;
+    memcpy(reqBuf, &op, sizeof(uint32_t));
+    memcpy(reqBuf + sizeof(uint32_t), resBuf, sizeof(uint32_t) + sizeof(uint64_t));
+    int res = -1;
+    if (send(fd, reqBuf, sizeof(reqBuf), 0) == sizeof(reqBuf)) {
+        // Response Format:
+        // | res    | errno  |
+        // | int(4) | int(4) |
+        char attachBuf[2 * sizeof(uint32_t)];
+        if (recv(fd, attachBuf, sizeof(attachBuf), MSG_WAITALL) == sizeof(attachBuf)) {
+            memcpy(&res, attachBuf, sizeof(uint32_t));
+            memcpy(&error, attachBuf + sizeof(uint32_t), sizeof(uint32_t));
+        }
+    }
+    if (res == -1) {
+        fprintf(stderr, "mylib: callbacks not attached | errno %d\n", error);
+        orig_close(fd);
+        return;
+    }
+    callback_fd = fd;
+    fprintf(stderr, "mylib: callbacks | session %d\n", session);
+}
+
+/**
+    * @brief Drop a cached reply kept under a callback.
+    */
+void exportDrop(const char *key) {
+    for (struct export_entry **p = &export_table[exportBucket(key)]; *p != NULL; p = &(*p)->next) {
+        struct export_entry *e = *p;
+        if (strcmp(e->key, key) == 0) {
+            *p = e->next;
+            memRelease(&export_cache, sizeof(struct export_entry) + strlen(e->key) + 1 + e->len);
+            free(e->key);
+            free(e->data);
+            free(e);
+            return;
+        }
+    }
+}
+
+/**
+    * @brief Forget what is cached about a path that changed, and the attributes of its directory.
+    * @param pathname The path, or an empty string to forget everything.
+    */
+void callbackForget(const char *pathname) {
+    char key[PATH_MAX + 8];
+    if (pathname[0] == '\0') {
+        shrinkExportCache(SIZE_MAX);
+        return;
+    }
+    snprintf(key, sizeof(key), "s%s", pathname);
+    exportDrop(key);
+    snprintf(key, sizeof(key), "c%s", pathname);
+    exportDrop(key);
+    const char *slash = strrchr(pathname, '/');
+    if (slash == NULL) {
+        exportDrop("s.");
+    } else {
+        snprintf(key, sizeof(key), "s%.*s", (int)(slash == pathname ? 1 : slash - pathname), pathname);
+        exportDrop(key);
+    }
+}
+
+/**
+    * @brief Apply the invalidations the server pushed since the last call.
+    * @details A record is a path length and a path. Should the control connection fail, nothing
+    * learned under callbacks can be trusted any more, and callbacks end.
+    */
+void callbackDrain(void) {
+    int saved_errno = errno;
+    while (callback_fd != -1) {
+        uint32_t len;
+        char path[PATH_MAX];
+        ssize_t n = recv(callback_fd, &len, sizeof(len), MSG_DONTWAIT);
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+        if (n > 0 && n < (ssize_t)sizeof(len)) {
+            ssize_t rest = recv(callback_fd, (char *)&len + n, sizeof(len) - n, MSG_WAITALL);
+            n = rest > 0 ? n + rest : rest;
+        }
+        if (n != sizeof(len) || len >= sizeof(path) || recv(callback_fd, path, len, MSG_WAITALL) != (ssize_t)len) {
+            fprintf(stderr, "mylib: callbacks lost, cache dropped\n");
+            orig_close(callback_fd);
+            callback_fd = -1;
+            shrinkExportCache(SIZE_MAX);
+            break;
+        }
+        path[len] = '\0';
+        metrics.callback_invalidations++;
+        callbackForget(path);
+    }
+    errno = saved_errno;
+}
+
+/**
+    * @brief Whether replies kept under callbacks can be used, and new ones kept.
+    * @details Only while this client has nothing open for writing and no upload waiting, as the
+    * server reports its own writes only once it has them.
+    */
+int callbackTrusted(void) {
+    if (callback_fd == -1) {
+        return 0;
+    }
+    callbackDrain();
+    return callback_fd != -1 && callback_writers == 0 && upload_batch.count == 0;
+}
+
+/**
+    * @brief Remember the cache entry a file read from the server was served from.
+    */
+void callbackRememberCached(struct cached_file *cf) {
+    char key[PATH_MAX + 8];
+    snprintf(key, sizeof(key), "c%s", cf->pathname);
+    exportStore(key, cf->entry, strlen(cf->entry));
+}
+
+/**
+    * @brief Open the cached copy of a file the server has not called back, without asking it.
+    * @return A local file descriptor, or -1 if the file has to be opened on the server.
+    */
+int callbackOpenCached(const char *pathname) {
+    char key[PATH_MAX + 8];
+    snprintf(key, sizeof(key), "c%s", pathname);
+    struct export_entry *e = exportLookup(key);
+    if (e == NULL) {
+        return -1;
+    }
+    // Entries are named by version, so one that is still there holds the version remembered.
+    int local_fd = orig_open(e->data, O_RDONLY);
+    if (local_fd == -1) {
+        exportDrop(key);
+        return -1;
+    }
+    fprintf(stderr, "mylib: callback cache hit | path %s\n", pathname);
+    return local_fd;
+}
+
+/**
+    * @brief Count a file opened for writing while callbacks are on, and forget what it changes.
+    * @param fd The server file descriptor, or -1 for a file of an upload batch.
+    */
+void callbackWriting(int fd, const char *pathname) {
+    if (callback_fd == -1) {
+        return;
+    }
+    callbackForget(pathname);
+    if (fd >= 0 && fd < MAX_REMOTE_FDS) {
+        callback_written[fd] = strdup(pathname);
+    }
+    callback_writers++;
+}
+
+/**
+    * @brief Send an open request to the server.
+    * @param pathname The path to the file.
+    * @param flags The flags to open the file.
+    * @param mode The mode to create the file with.
+    * @param delegated Set to whether a write delegation was granted, or NULL to not ask for one.
+    * @return The server file descriptor.
+    */
+int openRequest(const char *pathname, int flags, mode_t mode, int *delegated) {
+    // Define the format of the message.
+    // Extendability: We can add more fields to the message by adding more offsets and updating totalSize.
+    // Request Format:
+    // | op     | pathname length | pathname    | flags  | mode      | delegate |
+    // | int(4) | int(4)          | c_string(n) | int(4) | mode_t(4) | int(4)   |
+    int num_fields = 6;
+    size_t req_length[6] = {4, 4, strlen(pathname), 4, 4, 4};
+    int req_offsets[7] = {0};
+    for (int i = 0; i < 6; i++) { 
+        req_offsets[i + 1] = req_offsets[i] + req_length[i];
+    }
+
+    char reqBuf[req_offsets[num_fields]];
+    int op = 0, path_len = strlen(pathname), delegate = delegated != NULL;
+    memcpy(reqBuf + req_offsets[0], &op, req_length[0]);
+    memcpy(reqBuf + req_offsets[1], &path_len, req_length[1]);
+    memcpy(reqBuf + req_offsets[2], pathname, req_length[2]);
+    memcpy(reqBuf + req_offsets[3], &flags, req_length[3]);
+    memcpy(reqBuf + req_offsets[4], &mode, req_length[4]);
+    memcpy(reqBuf + req_offsets[5], &delegate, req_length[5]);
+    sendRequest(reqBuf, req_offsets[6]);
+
+    // Response Format:
+    // | fd     | errno  | delegated |
+    // | int(4) | int(4) | int(4)    |
+    char resBuf[3 * sizeof(int)];
+    receiveResponse(resBuf, 3 * sizeof(int));
+    int fd;
+    memcpy(&fd, resBuf, sizeof(int));
+    memcpy(&errno, resBuf + sizeof(int), sizeof(int));
+    if (delegated != NULL) memcpy(delegated, resBuf + 2 * sizeof(int), sizeof(int));
+    return fd;
+}
+
+/**
+    * @brief Open a file.
+    * @param pathname The path to the file.
+    * @param flags The flags to open the file.
+    * @param ... The mode to open the file.
+    * @return The file descriptor.
+    */
+int open(const char *pathname, int flags, ...) {
+    fprintf(stderr, "mylib: open called | path %s\n", pathname);
+
+    mode_t mode=0;
+    if (flags & O_CREAT) {
+        va_list a;
+        va_start(a, flags);
+        mode = va_arg(a, mode_t);
+        va_end(a);
+    }
+
+    // Published data never changes: writes are refused here, and names known to be missing and
+    // files cached at this generation are served without asking the server.
+    if (export_readonly) {
+        if ((flags & O_ACCMODE) != O_RDONLY || (flags & O_TRUNC)) {
+            errno = EROFS;
+            return -1;
+        }
+        int missing = exportMissing(pathname);
+        if (missing != 0) {
+            errno = missing;
+            return -1;
+        }
+        int local_fd = exportOpenCached(pathname);
+        if (local_fd != -1) {
+            if (prefetch_record_fd != -1) prefetchRecord(pathname);
+            if (sibling_threshold > 0) {
+                siblingHit(pathname);
+                siblingOpened(pathname);
+            }
+            return local_fd;
+        }
+    }
+
+    // Under callbacks the server tells of any change to what it answered, so until then names
+    // known to be missing and files cached from it are served without asking it.
+    if ((flags & O_ACCMODE) == O_RDONLY && !(flags & (O_CREAT | O_TRUNC)) && callbackTrusted()) {
+        int missing = exportMissing(pathname);
+        if (missing != 0) {
+            errno = missing;
+            return -1;
+        }
+        int local_fd = callbackOpenCached(pathname);
+        if (local_fd != -1) {
+            if (prefetch_record_fd != -1) prefetchRecord(pathname);
+            return local_fd;
+        }
+    }
+
+    // Files created for writing are uploaded in batches. Neither O_EXCL nor O_APPEND is batched,
+    // as they depend on what the server holds.
+    if (upload_enabled && !export_readonly && (flags & O_CREAT) && (flags & O_TRUNC) &&
+        (flags & O_ACCMODE) == O_WRONLY && !(flags & (O_EXCL | O_APPEND))) {
+        int local_fd = uploadOpen(pathname, flags, mode);
+        if (local_fd != -1) {
+            callbackWriting(-1, pathname);
+            fprintf(stderr, "mylib: open returned | upload fd %d\n\n", local_fd);
+            return local_fd;
+        }
+    }
+
+    // Data this process wrote must be on the server before the file is opened again.
+    delegationSync(pathname, 1);
+    flushAllWriteBehind();
+
+    // A cached copy is fetched and checked through the server descriptor, so it must be readable,
+    // and truncation is applied to the copy and written back on close.
+    int server_flags = flags;
+    if (cache_dir != NULL && (flags & O_ACCMODE) != O_RDONLY && !(flags & O_APPEND)) {
+        server_flags = (flags & ~(O_ACCMODE | O_TRUNC)) | O_RDWR;
+    }
+    // An uncached write-only file nobody else has open is delegated to this client.
+    int delegated = 0;
+    int want_delegation = delegation_enabled && buffering_enabled && cache_dir == NULL && !export_readonly &&
+                          (flags & O_ACCMODE) == O_WRONLY && !(flags & O_APPEND);
+    // Decided before the request: an invalidation taken in after it may be about the reply.
+    int trusted = callbackTrusted();
+    int fd = openRequest(pathname, server_flags, mode, want_delegation ? &delegated : NULL);
+    if (fd == -1 && server_flags != flags) {
+        server_flags = flags;
+        fd = openRequest(pathname, flags, mode, NULL);
+    }
+    if (fd != -1 && cache_dir != NULL && !(flags & O_APPEND)) {
+        struct cached_file *cf = cacheOpen(fd, pathname, flags);
+        if (cf != NULL) {
+            cached_files[fd] = cf;
+            if (export_readonly) exportPublish(cf);
+            if (trusted && !cf->writable) callbackRememberCached(cf);
+        } else if (server_flags != flags) {
+            // Not cacheable after all: reopen it the way the application asked.
+            closeRequest(fd);
+            fd = openRequest(pathname, flags, mode, NULL);
+        }
+    }
+    if (fd != -1 && fd < MAX_REMOTE_FDS && cachedFile(fd) == NULL) {
+        // Appends always get a buffer, it keeps each record whole even when nothing is gathered.
+        int stream_mode = 0;
+        if ((flags & O_APPEND) && (flags & O_ACCMODE) != O_RDONLY) {
+            stream_mode = STREAM_APPEND;
+        } else if (buffering_enabled && !(flags & O_APPEND) && (flags & O_ACCMODE) == O_RDONLY) {
+            stream_mode = STREAM_READ_AHEAD;
+        } else if (buffering_enabled && !(flags & O_APPEND) && (flags & O_ACCMODE) == O_WRONLY) {
+            stream_mode = STREAM_WRITE_BEHIND;
+        }
+        if (stream_mode != 0) {
+            streams[fd] = calloc(1, sizeof(struct stream_buffer));
+            streams[fd]->mode = stream_mode;
+        }
+        if (delegated) {
+            delegationGranted(fd, pathname);
+        }
+    } else if (delegated) {
+        // No buffer to hold the writes in, so the delegation is of no use.
+        delegationReturn(fd, NULL);
+    }
+    if (fd == -1 && (export_readonly || trusted) && (errno == ENOENT || errno == ENOTDIR)) {
+        exportRememberMissing(pathname, errno);
+    }
+    if (fd != -1 && fd < MAX_REMOTE_FDS && export_readonly && cachedFile(fd) == NULL) {
+        export_files[fd] = calloc(1, sizeof(struct export_file));
+        export_files[fd]->path = strdup(pathname);
+    }
+    if (fd != -1 && ((flags & O_ACCMODE) != O_RDONLY || (flags & O_TRUNC))) {
+        callbackWriting(fd, pathname);
+    }
+    if (fd != -1 && prefetch_record_fd != -1 && (flags & O_ACCMODE) == O_RDONLY) {
+        prefetchRecord(pathname);
+    }
+    // Only files served from the cache count, their siblings can be pushed into it.
+    if (fd != -1 && sibling_threshold > 0 && cachedFile(fd) != NULL && !cachedFile(fd)->writable) {
+        if (cachedFile(fd)->hit) siblingHit(pathname);
+        siblingOpened(pathname);
+    }
+    if (fd != -1) fd += FD_OFFSET;
+
+    fprintf(stderr, "mylib: open returned | fd %d | errno %d\n\n", fd, errno);
+    return fd;
+}
+
+/** 
+    * @brief Send one read request to the server.
+    * @param fd The server file descriptor.
     * @param buf The buffer to store the data.
     * @param count The number of bytes to read.
     * @return The number of bytes read.
@@ -169,31 +2789,431 @@ ssize_t readHelper(int fd, void *buf, size_t count) {
     memcpy(reqBuf + req_offsets[0], &op, req_length[0]);
     memcpy(reqBuf + req_offsets[1], &fd, req_length[1]);
     memcpy(reqBuf + req_offsets[2], &count, req_length[2]);
+    uint64_t start = monotonicNs();
     sendRequest(reqBuf, req_offsets[3]);
 
 
     // Response Format:
     // | bytes read | errno  | data               |
     // | int(4)     | int(4) | string(bytes read) |
-    size_t res_length[3] = {sizeof(uint32_t), sizeof(uint32_t), count};
-    int res_offsets[4] = {0};
-    for (int i = 0; i < 3; i++) {
+    // The data is received straight into buf.
+    size_t res_length[2] = {sizeof(uint32_t), sizeof(uint32_t)};
+    int res_offsets[3] = {0};
+    for (int i = 0; i < 2; i++) {
         res_offsets[i + 1] = res_offsets[i] + res_length[i];
     }
 
-    char resBuf[res_offsets[3]];
-    receiveResponse(resBuf, res_offsets[3]);
-    int bytes_read;
+    char resBuf[res_offsets[2]];
+    receiveResponse(resBuf, res_offsets[2]);
+    int bytes_read, error;
     memcpy(&bytes_read, resBuf + res_offsets[0], res_length[0]);
-    memcpy(&errno, resBuf + res_offsets[1], res_length[1]);
-    memcpy(buf, resBuf + res_offsets[2], res_length[2]);
+    memcpy(&error, resBuf + res_offsets[1], res_length[1]);
+    if (bytes_read > 0) {
+        receiveResponse(buf, bytes_read);
+    }
+    linkSample(bytes_read > 0 ? bytes_read : 0, monotonicNs() - start);
+    errno = error;
 
-    fprintf(stderr, "mylib: readHelper returned | bytes_read: %d | err %d | data %s\n\n", bytes_read, errno, (char *)buf);
+    fprintf(stderr, "mylib: readHelper returned | bytes_read: %d | err %d\n\n", bytes_read, errno);
     return errno == 0? bytes_read: -1;
 }
 
+/** 
+    * @brief Send one write request to the server.
+    * @param fd The server file descriptor.
+    * @param buf The buffer to store the data.
+    * @param count The number of bytes to write.
+    * @return The number of bytes written.
+*/
+ssize_t writeHelper(int fd, const void *buf, size_t count){
+    fprintf(stderr, "mylib: writeHelper called | fd %d | count %ld\n", fd, count);
+    // Define the format of the message.
+    // Extendability: We can add more fields to the message by adding more offsets and updating totalSize.
+    // Request Format:
+    // | op     | fd     | count  | data  |
+    // | int(4) | int(4) | int(4) | count |
+    // The data is sent straight from buf.
+    int op = 2;
+    size_t req_length[3] = {sizeof(uint32_t), sizeof(uint32_t), sizeof(uint32_t)};
+    int req_offsets[4] = {0};
+    for (int i = 0; i < 3; i++) {
+        req_offsets[i + 1] = req_offsets[i] + req_length[i];
+    }
+    char reqBuf[req_offsets[3]];
+    memcpy(reqBuf + req_offsets[0], &op, req_length[0]);
+    memcpy(reqBuf + req_offsets[1], &fd, req_length[1]);
+    memcpy(reqBuf + req_offsets[2], &count, req_length[2]);
+    uint64_t start = monotonicNs();
+    sendRequest(reqBuf, req_offsets[3]);
+    sendRequest((char *)buf, count);
+
+    // Response Format:
+    // | bytes written | errno  |
+    // | int(4)        | int(4) |
+    size_t res_length[2] = {sizeof(uint32_t), sizeof(uint32_t)};
+    int res_offsets[3] = {0};
+    for (int i = 0; i < 2; i++) {
+        res_offsets[i + 1] = res_offsets[i] + res_length[i];
+    }
+    char resBuf[res_offsets[2]];
+    receiveResponse(resBuf, res_offsets[2]);
+    int bytes_written;
+    memcpy(&bytes_written, resBuf + res_offsets[0], res_length[0]);
+    memcpy(&errno, resBuf + res_offsets[1], res_length[1]);
+    int error = errno;
+    linkSample(count, monotonicNs() - start);
+    errno = error;
+
+    fprintf(stderr, "mylib: writeHelper returned | bytes_written %d | errno %d\n", bytes_written, errno);
+    return errno == 0? bytes_written: -1;
+}
+
+/**
+    * @brief Send an append request to the server.
+    * @details The server appends the data with one write, so it is never interleaved with data
+    * appended by other processes or clients.
+    * @param fd The server file descriptor, opened with O_APPEND.
+    * @param buf The data to append.
+    * @param count The number of bytes to append.
+    * @param offset Set to the file offset the data landed at.
+    * @return The number of bytes appended, or -1 if error.
+    */
+ssize_t appendRequest(int fd, const void *buf, size_t count, off_t *offset) {
+    // Request Format:
+    // | op     | fd     | length | data   |
+    // | int(4) | int(4) | int(8) | length |
+    // The data is sent straight from buf.
+    int op = 15;
+    int64_t length = count;
+    size_t req_length[3] = {sizeof(uint32_t), sizeof(uint32_t), sizeof(uint64_t)};
+    int req_offsets[4] = {0};
+    for (int i = 0; i < 3; i++) {
+        req_offsets[i + 1] = req_offsets[i] + req_length[i];
+    }
+    char reqBuf[req_offsets[3]];
+    memcpy(reqBuf + req_offsets[0], &op, req_length[0]);
+    memcpy(reqBuf + req_offsets[1], &fd, req_length[1]);
+    memcpy(reqBuf + req_offsets[2], &length, req_length[2]);
+    uint64_t start = monotonicNs();
+    sendRequest(reqBuf, req_offsets[3]);
+    sendRequest((char *)buf, count);
+
+    // Response Format:
+    // | bytes written | errno  | offset |
+    // | int(8)        | int(4) | int(8) |
+    char resBuf[2 * sizeof(uint64_t) + sizeof(uint32_t)];
+    receiveResponse(resBuf, sizeof(resBuf));
+    int64_t written, landed;
+    memcpy(&written, resBuf, sizeof(uint64_t));
+    memcpy(&errno, resBuf + sizeof(uint64_t), sizeof(uint32_t));
+    memcpy(&landed, resBuf + sizeof(uint64_t) + sizeof(uint32_t), sizeof(uint64_t));
+    int error = errno;
+    linkSample(count, monotonicNs() - start);
+    errno = error;
+    *offset = landed;
+    metrics.append_batches++;
+    fprintf(stderr, "mylib: appendRequest returned | written %ld | offset %ld | errno %d\n", written, landed, errno);
+    return written;
+}
+
+/**
+    * @brief Find the buffer of a server file descriptor.
+    * @return The buffer, or NULL if the descriptor has none of that mode.
+    */
+struct stream_buffer *streamBuffer(int fd, int mode) {
+    if (fd < 0 || fd >= MAX_REMOTE_FDS || streams[fd] == NULL || streams[fd]->mode != mode) {
+        return NULL;
+    }
+    return streams[fd];
+}
+
+/**
+    * @brief Size an empty stream buffer to the current transfer size.
+    * @return 0 if successful, -1 if there is no buffer and the memory governor refused one.
+    */
+int streamReserve(struct stream_buffer *sb) {
+    size_t size = estimator.transfer_size;
+    if (sb->size == size) {
+        return 0;
+    }
+    if (size > sb->size && memCharge(&stream_cache, size - sb->size) == -1) {
+        return sb->size > 0 ? 0 : -1;
+    }
+    if (size < sb->size) {
+        memRelease(&stream_cache, sb->size - size);
+    }
+    free(sb->data);
+    sb->data = malloc(size);
+    sb->size = size;
+    return 0;
+}
+
+/**
+    * @brief Send the data gathered in a write-behind or append buffer.
+    * @details A failure is kept in the buffer and reported by the next write or close.
+    * An append batch is sent as one request, so its records stay together.
+    */
+void flushWriteBehind(int fd, struct stream_buffer *sb) {
+    size_t sent = 0;
+    if (sb->mode == STREAM_APPEND) {
+        off_t offset;
+        ssize_t n = appendRequest(fd, sb->data, sb->len, &offset);
+        if (n != (ssize_t)sb->len) {
+            sb->error = n == -1 ? errno : EIO;
+        }
+        sent = sb->len;
+    }
+    while (sent < sb->len) {
+        ssize_t n = writeHelper(fd, sb->data + sent, sb->len - sent);
+        if (n <= 0) {
+            sb->error = n == -1 ? errno : EIO;
+            break;
+        }
+        sent += n;
+    }
+    if (sb->offset >= 0) sb->offset += sent;
+    metrics.write_behind_flushes++;
+    sb->len = 0;
+    write_behind_pending--;
+}
+
+/**
+    * @brief Send all write-behind, append and upload data, so other requests see what this process wrote.
+    */
+void flushAllWriteBehind(void) {
+    uploadFlush();
+    // No one else sees a delegated file, its writes wait for close, fsync or a recall.
+    for (int fd = 0; fd < MAX_REMOTE_FDS && write_behind_pending > 0; fd++) {
+        struct stream_buffer *sb = streams[fd];
+        if (sb != NULL && sb->mode != STREAM_READ_AHEAD && sb->len > 0 && !sb->delegated) {
+            flushWriteBehind(fd, sb);
+        }
+    }
+}
+
+/**
+    * @brief Bring the server file offset of a descriptor back in line with the application's.
+    * @details Write-behind data is sent, and unread read-ahead data is given back by seeking back.
+    */
+void streamSync(int fd) {
+    struct stream_buffer *sb = fd >= 0 && fd < MAX_REMOTE_FDS ? streams[fd] : NULL;
+    if (sb == NULL) {
+        return;
+    }
+    if (sb->mode != STREAM_READ_AHEAD && sb->len > 0) {
+        flushWriteBehind(fd, sb);
+    }
+    // The caller moves the server offset, a delegated file learns it again from the next lseek.
+    if (sb->delegated) {
+        sb->offset = -1;
+    }
+    if (sb->mode == STREAM_READ_AHEAD && sb->pos < sb->len) {
+        lseekRequest(fd, -(off_t)(sb->len - sb->pos), SEEK_CUR);
+    }
+    sb->len = sb->pos = 0;
+}
+
+/**
+    * @brief Drop the buffer of a descriptor being closed.
+    * @return The errno of a failed write-behind, or 0.
+    */
+int streamClose(int fd) {
+    struct stream_buffer *sb = fd >= 0 && fd < MAX_REMOTE_FDS ? streams[fd] : NULL;
+    if (sb == NULL) {
+        return 0;
+    }
+    if (sb->mode != STREAM_READ_AHEAD && sb->len > 0) {
+        flushWriteBehind(fd, sb);
+    }
+    int error = sb->error;
+    // Closing the server descriptor ends the delegation there.
+    if (sb->delegated) {
+        delegations_held--;
+        free(sb->path);
+    }
+    memRelease(&stream_cache, sb->size);
+    free(sb->data);
+    free(sb);
+    streams[fd] = NULL;
+    return error;
+}
+
+/**
+    * @brief Free stream buffers when the memory governor needs room.
+    * @return The bytes freed.
+    */
+size_t shrinkStreams(size_t want) {
+    size_t freed = 0;
+    // Write-behind data cannot be sent in the middle of a response.
+    if (fetch_receiving) {
+        return 0;
+    }
+    for (int fd = 0; fd < MAX_REMOTE_FDS && freed < want; fd++) {
+        struct stream_buffer *sb = streams[fd];
+        if (sb == NULL || sb->size == 0) {
+            continue;
+        }
+        streamSync(fd);
+        freed += sb->size;
+        memRelease(&stream_cache, sb->size);
+        free(sb->data);
+        sb->data = NULL;
+        sb->size = 0;
+    }
+    return freed;
+}
+
+/**
+    * @brief Grow the buffer of a delegated file to hold need bytes.
+    * @return 0 if it holds them, -1 if they exceed DELEGATION_MAX_BUFFER or the memory governor refused.
+    */
+int delegationGrow(struct stream_buffer *sb, size_t need) {
+    if (need <= sb->size) {
+        return 0;
+    }
+    if (need > DELEGATION_MAX_BUFFER) {
+        return -1;
+    }
+    size_t size = sb->size > 0 ? sb->size : estimator.transfer_size;
+    while (size < need) size *= 2;
+    if (size > DELEGATION_MAX_BUFFER) size = DELEGATION_MAX_BUFFER;
+    if (memCharge(&stream_cache, size - sb->size) == -1) {
+        return -1;
+    }
+    sb->data = realloc(sb->data, size);
+    sb->size = size;
+    return 0;
+}
+
+/**
+    * @brief Start holding a write delegation for a descriptor just opened.
+    */
+void delegationGranted(int fd, const char *pathname) {
+    struct stream_buffer *sb = streams[fd];
+    sb->delegated = 1;
+    sb->offset = 0;
+    sb->path = strdup(pathname);
+    delegations_held++;
+    metrics.delegations++;
+}
+
+/**
+    * @brief Send the buffered writes of a delegated file and give the delegation back.
+    * @param sb The buffer of the file, or NULL if it has none.
+    */
+void delegationReturn(int fd, struct stream_buffer *sb) {
+    if (sb != NULL && sb->len > 0) {
+        flushWriteBehind(fd, sb);
+    }
+    // Request Format:
+    // | op     | fd     |
+    // | int(4) | int(4) |
+    int op = 19;
+    char reqBuf[2 * sizeof(uint32_t)];
+    memcpy(reqBuf, &op, sizeof(uint32_t));
+    memcpy(reqBuf + sizeof(uint32_t), &fd, sizeof(uint32_t));
+    sendRequest(reqBuf, sizeof(reqBuf));
+
+    // Response Format:
+    // | res    | errno  |
+    // | int(4) | int(4) |
+    char resBuf[2 * sizeof(uint32_t)];
+    receiveResponse(resBuf, sizeof(resBuf));
+    if (sb != NULL) {
+        sb->delegated = 0;
+        free(sb->path);
+        sb->path = NULL;
+        delegations_held--;
+    }
+}
+
+/**
+    * @brief Give every delegation back if the server recalled them.
+    * @details A recall covers all delegations, as the urgent byte does not say which file another
+    * process opened. Later writes to these files are buffered as usual.
+    */
+void delegationCheck(void) {
+    if (delegations_held > 0) {
+        urgentData();
+    }
+    if (!recall_pending) {
+        return;
+    }
+    recall_pending = 0;
+    metrics.delegation_recalls++;
+    fprintf(stderr, "mylib: delegations recalled | held %d\n", delegations_held);
+    for (int fd = 0; fd < MAX_REMOTE_FDS && delegations_held > 0; fd++) {
+        if (streams[fd] != NULL && streams[fd]->delegated) {
+            delegationReturn(fd, streams[fd]);
+        }
+    }
+}
+
+/**
+    * @brief Send the buffered writes of delegated files opened by a path.
+    * @details Another open or stat of the same path by this process must see them. The server
+    * would break its own lease on another open, so the delegation is then given back too.
+    * Paths are compared as strings.
+    * @param give_back Whether the delegations are given back as well.
+    */
+void delegationSync(const char *pathname, int give_back) {
+    delegationCheck();
+    for (int fd = 0; fd < MAX_REMOTE_FDS && delegations_held > 0; fd++) {
+        struct stream_buffer *sb = streams[fd];
+        if (sb == NULL || !sb->delegated || strcmp(sb->path, pathname) != 0) {
+            continue;
+        }
+        if (give_back) {
+            delegationReturn(fd, sb);
+        } else if (sb->len > 0) {
+            flushWriteBehind(fd, sb);
+        }
+    }
+}
+
+/**
+    * @brief Serve a read from the read-ahead buffer, refilling it while the rest of the read is small.
+    * @param fd The server file descriptor.
+    * @param sb The read-ahead buffer.
+    * @param buf The buffer to store the data.
+    * @param count The number of bytes to read.
+    * @param done Set when the read is complete, at the end of the file or on an error.
+    * @return The number of bytes served, or -1 if error.
+    */
+ssize_t readAhead(int fd, struct stream_buffer *sb, char *buf, size_t count, int *done) {
+    size_t total = 0;
+    *done = 0;
+    if (sb->pos < sb->len) {
+        memHit(&stream_cache);
+    }
+    while (total < count) {
+        if (sb->pos == sb->len) {
+            // Reads of a whole transfer or more go straight to the caller's buffer.
+            if (count - total >= estimator.transfer_size || streamReserve(sb) == -1) {
+                break;
+            }
+            ssize_t n = readHelper(fd, sb->data, sb->size);
+            if (n <= 0) {
+                *done = 1;
+                return n == -1 && total == 0 ? -1 : (ssize_t)total;
+            }
+            metrics.readahead_fills++;
+            sb->len = n;
+            sb->pos = 0;
+        }
+        size_t take = count - total < sb->len - sb->pos ? count - total : sb->len - sb->pos;
+        memcpy(buf + total, sb->data + sb->pos, take);
+        sb->pos += take;
+        total += take;
+        metrics.readahead_bytes += take;
+    }
+    *done = total == count;
+    return total;
+}
+
 /** 
     * @brief Read from a file.
+    * @details Reads of uncached files are split into requests of the adaptive transfer size.
     * @param fd The file descriptor.
     * @param buf The buffer to store the data.
     * @param count The number of bytes to read.
@@ -205,9 +3225,30 @@ ssize_t read(int fd, void *buf, size_t count) {
         return orig_read(fd, buf, count);
     }
     fd -= FD_OFFSET;
+    delegationCheck();
+    struct cached_file *cf = cachedFile(fd);
+    if (cf != NULL) {
+        return orig_read(cf->local_fd, buf, count);
+    }
+
+    // Records appended through this descriptor are read back.
+    if (streamBuffer(fd, STREAM_APPEND) != NULL) {
+        streamSync(fd);
+    }
 
-    size_t maxLen = MAX_MSG_LEN - 8;
     int total_bytes_read = 0;
+    struct stream_buffer *sb = streamBuffer(fd, STREAM_READ_AHEAD);
+    if (sb != NULL) {
+        int done;
+        ssize_t bytes_read = readAhead(fd, sb, buf, count, &done);
+        if (done) {
+            fprintf(stderr, "mylib: read returned | bytes_read %ld\n\n", bytes_read);
+            return bytes_read;
+        }
+        total_bytes_read = bytes_read;
+        count -= bytes_read;
+    }
+    size_t maxLen = estimator.transfer_size;
     while (count != 0) {
         size_t bytes_read = count > maxLen? maxLen: count;
         bytes_read = readHelper(fd, buf + total_bytes_read, bytes_read);
@@ -227,49 +3268,262 @@ ssize_t read(int fd, void *buf, size_t count) {
     return total_bytes_read;
 }
 
-/** 
-    * @brief Write smaller than MAX_MSG_LEN bytes to a file.
-    * @param fd The file descriptor.
-    * @param buf The buffer to store the data.
-    * @param count The number of bytes to write.
-    * @return The number of bytes written.
-*/
-ssize_t writeHelper(int fd, const void *buf, size_t count){
-    fprintf(stderr, "mylib: writeHelper called | fd %d | count %ld\n", fd, count);
-    // Define the format of the message.
-    // Extendability: We can add more fields to the message by adding more offsets and updating totalSize.
+/**
+    * @brief Hashes of chunks the server is known to hold in its chunk store.
+    * @details Open addressing over SHA-256 digests, emptied when it fills up.
+    * Writes whose chunks are all known skip the query round trip.
+    */
+struct chunk_set {
+    unsigned char (*hashes)[SHA256_LEN];
+    size_t used;
+    struct mem_cache mem;
+};
+
+struct chunk_set known_chunks;
+
+/**
+    * @brief Find the slot of a chunk hash in the known chunk set.
+    * @return The slot holding the hash, or the empty slot where it would go.
+    */
+size_t chunkSlot(const unsigned char *hash) {
+    static const unsigned char empty[SHA256_LEN];
+    size_t slot;
+    memcpy(&slot, hash, sizeof(slot));
+    slot &= KNOWN_CHUNKS - 1;
+    while (memcmp(known_chunks.hashes[slot], hash, SHA256_LEN) != 0 &&
+           memcmp(known_chunks.hashes[slot], empty, SHA256_LEN) != 0) {
+        slot = (slot + 1) & (KNOWN_CHUNKS - 1);
+    }
+    return slot;
+}
+
+/**
+    * @brief Check whether the server is known to hold a chunk.
+    */
+int chunkKnown(const unsigned char *hash) {
+    if (known_chunks.hashes == NULL) {
+        return 0;
+    }
+    if (memcmp(known_chunks.hashes[chunkSlot(hash)], hash, SHA256_LEN) != 0) {
+        return 0;
+    }
+    memHit(&known_chunks.mem);
+    return 1;
+}
+
+/**
+    * @brief Remember that the server holds a chunk.
+    */
+void addKnownChunk(const unsigned char *hash) {
+    if (known_chunks.hashes == NULL) {
+        if (memCharge(&known_chunks.mem, (size_t)KNOWN_CHUNKS * SHA256_LEN) == -1) {
+            return;
+        }
+        known_chunks.hashes = calloc(KNOWN_CHUNKS, SHA256_LEN);
+    }
+    if (known_chunks.used >= KNOWN_CHUNKS * 3 / 4) {
+        memset(known_chunks.hashes, 0, (size_t)KNOWN_CHUNKS * SHA256_LEN);
+        known_chunks.used = 0;
+    }
+    size_t slot = chunkSlot(hash);
+    if (memcmp(known_chunks.hashes[slot], hash, SHA256_LEN) != 0) {
+        memcpy(known_chunks.hashes[slot], hash, SHA256_LEN);
+        known_chunks.used++;
+    }
+}
+
+/**
+    * @brief Drop the known chunk set when the memory governor needs room.
+    * @return The bytes freed.
+    */
+size_t shrinkKnownChunks(size_t want) {
+    size_t bytes = known_chunks.mem.bytes;
+    free(known_chunks.hashes);
+    known_chunks.hashes = NULL;
+    known_chunks.used = 0;
+    memRelease(&known_chunks.mem, bytes);
+    return bytes;
+}
+
+/**
+    * @brief CPU time used by the calling thread, in nanoseconds.
+    */
+uint64_t threadCpuNs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+    * @brief Ask the server which chunks its chunk store holds.
+    * @param hashes The chunk hashes.
+    * @param count The number of hashes, at most DEDUP_BATCH.
+    * @param have Set to 1 for each chunk the server holds.
+    * @return 0 if successful, -1 if error.
+    */
+int queryChunks(unsigned char (*hashes)[SHA256_LEN], int count, char *have) {
     // Request Format:
-    // | op     | fd     | count  | data  |
-    // | int(4) | int(4) | int(4) | count |
-    int op = 2;
-    size_t req_length[4] = {sizeof(uint32_t), sizeof(uint32_t), sizeof(uint32_t), count};
-    int req_offsets[5] = {0};
-    for (int i = 0; i < 4; i++) {
+    // | op     | count  | hashes              |
+    // | int(4) | int(4) | hash(32) * count    |
+    int op = 12;
+    size_t req_length[3] = {sizeof(uint32_t), sizeof(uint32_t), (size_t)count * SHA256_LEN};
+    int req_offsets[4] = {0};
+    for (int i = 0; i < 3; i++) {
         req_offsets[i + 1] = req_offsets[i] + req_length[i];
     }
-    char reqBuf[req_offsets[4]];
+    char *reqBuf = malloc(req_offsets[3] + 1);
     memcpy(reqBuf + req_offsets[0], &op, req_length[0]);
-    memcpy(reqBuf + req_offsets[1], &fd, req_length[1]);
-    memcpy(reqBuf + req_offsets[2], &count, req_length[2]);
-    memcpy(reqBuf + req_offsets[3], buf, req_length[3]);
-    sendRequest(reqBuf, req_offsets[4]);
+    memcpy(reqBuf + req_offsets[1], &count, req_length[1]);
+    memcpy(reqBuf + req_offsets[2], hashes, req_length[2]);
+    reqBuf[req_offsets[3]] = '\0';
+    sendRequest(reqBuf, req_offsets[3]);
+    free(reqBuf);
 
     // Response Format:
-    // | bytes written | errno  |
-    // | int(4)        | int(4) |
-    size_t res_length[2] = {sizeof(uint32_t), sizeof(uint32_t)};
-    int res_offsets[3] = {0};
-    for (int i = 0; i < 2; i++) {
-        res_offsets[i + 1] = res_offsets[i] + res_length[i];
+    // | count  | errno  | have          |
+    // | int(4) | int(4) | char(1) * count |
+    char resBuf[2 * sizeof(uint32_t) + DEDUP_BATCH + 1];
+    receiveResponse(resBuf, 2 * sizeof(uint32_t));
+    int res_count;
+    memcpy(&res_count, resBuf, sizeof(uint32_t));
+    memcpy(&errno, resBuf + sizeof(uint32_t), sizeof(uint32_t));
+    if (res_count != count) {
+        return -1;
     }
-    char resBuf[res_offsets[2]];
-    receiveResponse(resBuf, res_offsets[2]);
-    int bytes_written;
-    memcpy(&bytes_written, resBuf + res_offsets[0], res_length[0]);
-    memcpy(&errno, resBuf + res_offsets[1], res_length[1]);
+    receiveResponse(have, count);
+    metrics.dedup_queries++;
+    return 0;
+}
+
+/**
+    * @brief Write one batch of chunks, sending data only for chunks the server does not hold.
+    * @param fd The server file descriptor.
+    * @param buf The data.
+    * @param lens The chunk lengths.
+    * @param hashes The chunk hashes.
+    * @param present Set for each chunk the server already holds or receives earlier in this batch.
+    * @param count The number of chunks.
+    * @return The number of bytes written, or -1 if error.
+    */
+ssize_t writeChunks(int fd, const unsigned char *buf, const size_t *lens, unsigned char (*hashes)[SHA256_LEN],
+                    const char *present, int count) {
+    // Request Format:
+    // | op     | fd     | count  | total length | chunks |
+    // | int(4) | int(4) | int(4) | int(8)       | n      |
+    // Chunk Format:
+    // | hash     | length | present | data                        |
+    // | hash(32) | int(4) | char(1) | length, only if not present |
+    int op = 13;
+    int64_t total = 0;
+    for (int i = 0; i < count; i++) {
+        total += lens[i];
+    }
+    char header[3 * sizeof(uint32_t) + sizeof(uint64_t) + 1];
+    memcpy(header, &op, sizeof(uint32_t));
+    memcpy(header + sizeof(uint32_t), &fd, sizeof(uint32_t));
+    memcpy(header + 2 * sizeof(uint32_t), &count, sizeof(uint32_t));
+    memcpy(header + 3 * sizeof(uint32_t), &total, sizeof(uint64_t));
+    header[sizeof(header) - 1] = '\0';
+    sendRequest(header, sizeof(header) - 1);
+    const unsigned char *data = buf;
+    for (int i = 0; i < count; i++) {
+        char chunk[SHA256_LEN + sizeof(uint32_t) + 2];
+        int len = lens[i];
+        memcpy(chunk, hashes[i], SHA256_LEN);
+        memcpy(chunk + SHA256_LEN, &len, sizeof(uint32_t));
+        chunk[SHA256_LEN + sizeof(uint32_t)] = present[i];
+        chunk[SHA256_LEN + sizeof(uint32_t) + 1] = '\0';
+        sendRequest(chunk, sizeof(chunk) - 1);
+        if (!present[i]) {
+            sendRequest((char *)data, len);
+            metrics.dedup_sent_bytes += len;
+        }
+        data += len;
+    }
+
+    // Response Format:
+    // | bytes written | errno  |
+    // | int(8)        | int(4) |
+    char resBuf[sizeof(uint64_t) + sizeof(uint32_t)];
+    receiveResponse(resBuf, sizeof(resBuf));
+    int64_t bytes_written;
+    memcpy(&bytes_written, resBuf, sizeof(uint64_t));
+    memcpy(&errno, resBuf + sizeof(uint64_t), sizeof(uint32_t));
+    return bytes_written;
+}
 
-    fprintf(stderr, "mylib: writeHelper returned | bytes_written %d | errno %d\n", bytes_written, errno);
-    return errno == 0? bytes_written: -1;
+/**
+    * @brief Write a large buffer as content-defined chunks, skipping the data of chunks the server already stores.
+    * @details Chunks are cut with FastCDC so identical content produces identical chunks wherever it sits.
+    * The server is asked which chunks it lacks, unless all of them are already known to be there.
+    * @param fd The server file descriptor.
+    * @param buf The data.
+    * @param count The number of bytes.
+    * @return The number of bytes written, which may be short, or -1 if nothing could be written.
+    */
+ssize_t dedupWrite(int fd, const void *buf, size_t count) {
+    size_t lens[DEDUP_BATCH];
+    unsigned char (*hashes)[SHA256_LEN] = malloc(DEDUP_BATCH * SHA256_LEN);
+    unsigned char (*unknown)[SHA256_LEN] = malloc(DEDUP_BATCH * SHA256_LEN);
+    char present[DEDUP_BATCH], have[DEDUP_BATCH];
+    int unknown_index[DEDUP_BATCH];
+    const unsigned char *data = buf;
+    size_t total = 0;
+    while (total < count) {
+        // Cut and hash one batch of chunks.
+        uint64_t cpu_start = threadCpuNs();
+        int n = 0, nunknown = 0;
+        size_t batch_len = 0;
+        while (n < DEDUP_BATCH && total + batch_len < count) {
+            lens[n] = cdc_chunk_len(data + batch_len, count - total - batch_len);
+            sha256(data + batch_len, lens[n], hashes[n]);
+            present[n] = chunkKnown(hashes[n]);
+            // A chunk repeated within the batch is sent once, the server stores it before the repeats.
+            for (int i = 0; i < n && !present[n]; i++) {
+                if (memcmp(hashes[i], hashes[n], SHA256_LEN) == 0) present[n] = 2;
+            }
+            if (!present[n]) {
+                memcpy(unknown[nunknown], hashes[n], SHA256_LEN);
+                unknown_index[nunknown++] = n;
+            }
+            batch_len += lens[n];
+            n++;
+        }
+        metrics.dedup_cpu_ns += threadCpuNs() - cpu_start;
+
+        if (nunknown > 0 && queryChunks(unknown, nunknown, have) == 0) {
+            for (int i = 0; i < nunknown; i++) {
+                present[unknown_index[i]] = have[i];
+            }
+        }
+        for (int i = 0; i < n; i++) {
+            metrics.dedup_chunks++;
+            metrics.dedup_duplicate_chunks += present[i] != 0;
+            present[i] = present[i] != 0;
+        }
+
+        ssize_t written = writeChunks(fd, data, lens, hashes, present, n);
+        if (written > 0) {
+            total += written;
+            metrics.dedup_bytes += written;
+            for (int i = 0; i < n; i++) {
+                addKnownChunk(hashes[i]);
+            }
+        }
+        if (written != (ssize_t)batch_len) {
+            // The server lost a chunk or the write failed: forget what we think it holds.
+            fprintf(stderr, "mylib: chunked write incomplete | written %ld | errno %d\n", written, errno);
+            if (known_chunks.hashes != NULL) {
+                memset(known_chunks.hashes, 0, (size_t)KNOWN_CHUNKS * SHA256_LEN);
+                known_chunks.used = 0;
+            }
+            break;
+        }
+        data += written;
+    }
+    free(hashes);
+    free(unknown);
+    return total > 0 || count == 0 ? (ssize_t)total : -1;
 }
 
 /** 
@@ -280,18 +3534,117 @@ ssize_t writeHelper(int fd, const void *buf, size_t count){
     * @return The number of bytes written.
 */
 ssize_t write(int fd, const void *buf, size_t count){
-    fprintf(stderr, "mylib: write called | fd %d | count %ld | buf %s | buf_len %ld\n", fd, count, (char *)buf, strlen((char *)buf));
+    fprintf(stderr, "mylib: write called | fd %d | count %ld | buf %.*s\n", fd, count, (int)(count < 64 ? count : 64), (char *)buf);
     if (fd < FD_OFFSET) {
         return orig_write(fd, buf, count);
     }
     fd -= FD_OFFSET;
+    struct cached_file *cf = cachedFile(fd);
+    if (cf != NULL) {
+        off_t offset = orig_lseek(cf->local_fd, 0, SEEK_CUR);
+        ssize_t bytes_written = orig_write(cf->local_fd, buf, count);
+        if (bytes_written > 0) {
+            markDirty(cf, offset, offset + bytes_written);
+        }
+        return bytes_written;
+    }
     // const void * test_buf = "12abcde\0 4385eorud,sir";
     // fd = orig_open("foo", O_RDWR);
     // return orig_write(fd, test_buf, count);
 
+    // A write to an O_APPEND file is one record and lands whole: small records are gathered into a
+    // batch until it fills or its oldest record ages, larger ones are sent alone.
+    struct stream_buffer *ab = streamBuffer(fd, STREAM_APPEND);
+    if (ab != NULL) {
+        if (ab->len > 0 && (ab->len + count > ab->size || monotonicNs() - ab->first_ns > APPEND_MAX_DELAY_NS)) {
+            flushWriteBehind(fd, ab);
+        }
+        if (ab->error != 0) {
+            errno = ab->error;
+            ab->error = 0;
+            fprintf(stderr, "mylib: write failed | append errno %d\n\n", errno);
+            return -1;
+        }
+        metrics.append_records++;
+        metrics.append_bytes += count;
+        if (buffering_enabled && count < estimator.transfer_size &&
+            (ab->len > 0 || streamReserve(ab) == 0) && ab->len + count <= ab->size) {
+            if (ab->len == 0) {
+                write_behind_pending++;
+                ab->first_ns = monotonicNs();
+            }
+            memcpy(ab->data + ab->len, buf, count);
+            ab->len += count;
+            return count;
+        }
+        off_t offset;
+        ssize_t bytes_written = appendRequest(fd, buf, count, &offset);
+        fprintf(stderr, "mylib: write returned | bytes_written %ld | offset %ld\n\n", bytes_written, offset);
+        return bytes_written;
+    }
+
+    // Writes to a delegated file stay in its buffer until it fills, nobody else can see the file.
+    delegationCheck();
+    struct stream_buffer *sb = streamBuffer(fd, STREAM_WRITE_BEHIND);
+    if (sb != NULL && sb->delegated) {
+        if (sb->len > 0 && delegationGrow(sb, sb->len + count) == -1) {
+            flushWriteBehind(fd, sb);
+        }
+        if (sb->error != 0) {
+            errno = sb->error;
+            sb->error = 0;
+            fprintf(stderr, "mylib: write failed | delegated errno %d\n\n", errno);
+            return -1;
+        }
+        if (delegationGrow(sb, sb->len + count) == 0) {
+            if (sb->len == 0) write_behind_pending++;
+            memcpy(sb->data + sb->len, buf, count);
+            sb->len += count;
+            metrics.delegated_writes++;
+            metrics.delegated_bytes += count;
+            return count;
+        }
+    }
+
+    // Small writes are gathered in the write-behind buffer, anything else first sends what it holds.
+    if (sb != NULL && !sb->delegated) {
+        int gather = count < estimator.transfer_size;
+        if (sb->len > 0 && (!gather || sb->len + count > sb->size)) {
+            flushWriteBehind(fd, sb);
+        }
+        if (sb->error != 0) {
+            errno = sb->error;
+            sb->error = 0;
+            fprintf(stderr, "mylib: write failed | write-behind errno %d\n\n", errno);
+            return -1;
+        }
+        if (gather && (sb->len > 0 || streamReserve(sb) == 0) && sb->len + count <= sb->size) {
+            if (sb->len == 0) write_behind_pending++;
+            memcpy(sb->data + sb->len, buf, count);
+            sb->len += count;
+            metrics.write_behind_bytes += count;
+            if (sb->len == sb->size) {
+                flushWriteBehind(fd, sb);
+            }
+            return count;
+        }
+    }
+
     // call helper function from 0-maxLen, maxLen-2*maxLen, 2*maxLen-3*maxLen, ...
-    size_t maxLen = MAX_MSG_LEN - 12;
+    size_t maxLen = estimator.transfer_size;
     int total_bytes_written = 0;
+    if (dedup_enabled && count >= DEDUP_MIN_WRITE) {
+        ssize_t bytes_written = dedupWrite(fd, buf, count);
+        if (bytes_written == -1 && errno != ENOENT) {
+            fprintf(stderr, "mylib: write failed | errno %d\n\n", errno);
+            return -1;
+        }
+        // A chunk missing from the server store is sent the ordinary way.
+        if (bytes_written > 0) {
+            total_bytes_written = bytes_written;
+            count -= bytes_written;
+        }
+    }
     while (count != 0) {
         size_t bytes_written = count > maxLen? maxLen: count;
         bytes_written = writeHelper(fd, buf + total_bytes_written, bytes_written);
@@ -302,21 +3655,19 @@ ssize_t write(int fd, const void *buf, size_t count){
         total_bytes_written += bytes_written;
         count -= bytes_written;
     }
+    if (sb != NULL && sb->offset >= 0) {
+        sb->offset += total_bytes_written;
+    }
     fprintf(stderr, "mylib: write returned | bytes_written %d\n\n", total_bytes_written);
     return total_bytes_written == 0? -1: total_bytes_written;
 }
 
 /** 
-    * @brief Close a file.
-    * @param fd The file descriptor.
+    * @brief Send a close request to the server.
+    * @param fd The server file descriptor.
     * @return 0 if successful, -1 if error.
     */
-int close(int fd) {
-    fprintf(stderr, "mylib: close called | fd %d\n", fd);
-    if (fd < FD_OFFSET) {
-        return orig_close(fd);
-    }
-    fd -= FD_OFFSET;
+int closeRequest(int fd) {
     // Define the format of the message.
     // Extendability: We can add more fields to the message by adding more offsets and updating totalSize.
     // Request Format:
@@ -346,25 +3697,70 @@ int close(int fd) {
     int success;
     memcpy(&success, resBuf + res_offsets[0], res_length[0]);
     memcpy(&errno, resBuf + res_offsets[1], res_length[1]);
+    return success;
+}
+
+/** 
+    * @brief Close a file.
+    * @param fd The file descriptor.
+    * @return 0 if successful, -1 if error.
+    */
+int close(int fd) {
+    fprintf(stderr, "mylib: close called | fd %d\n", fd);
+    if (fd >= 0 && fd < FD_OFFSET && upload_files[fd] != NULL) {
+        if (callback_fd != -1) {
+            callbackForget(upload_files[fd]->path);
+            callback_writers--;
+        }
+        uploadAdd(fd);
+    }
+    if (fd < FD_OFFSET) {
+        return orig_close(fd);
+    }
+    fd -= FD_OFFSET;
+    delegationCheck();
+    // A failed write-back is reported by close, like on other file systems that write back late.
+    int write_back = 0, write_back_errno = 0;
+    if (cachedFile(fd) != NULL) {
+        write_back = cacheClose(fd);
+        write_back_errno = errno;
+    }
+    int write_behind_errno = streamClose(fd);
+    if (fd < MAX_REMOTE_FDS && export_files[fd] != NULL) {
+        free(export_files[fd]->path);
+        free(export_files[fd]);
+        export_files[fd] = NULL;
+    }
+    if (write_behind_errno != 0) {
+        write_back = -1;
+        write_back_errno = write_behind_errno;
+    }
+    int success = closeRequest(fd);
+    // What was learned about the file while it was written is stale, and the server may not have
+    // reported the writes yet.
+    if (fd < MAX_REMOTE_FDS && callback_written[fd] != NULL) {
+        callbackForget(callback_written[fd]);
+        free(callback_written[fd]);
+        callback_written[fd] = NULL;
+        callback_writers--;
+    }
+    if (write_back == -1) {
+        success = -1;
+        errno = write_back_errno;
+    }
 
     fprintf(stderr, "mylib: close returned | success: %d | errno: %d\n\n", success, errno);
     return success;
 }
 
 /** 
-    * @brief Change the file offset.
-    * @param fd The file descriptor.
+    * @brief Send an lseek request to the server.
+    * @param fd The server file descriptor.
     * @param offset The offset to change.
     * @param whence The position to change.
     * @return The new offset.
     */
-ssize_t lseek(int fd, off_t offset, int whence)
-{
-    fprintf(stderr, "mylib: called | fd %d | offset %ld | whence %d\n", fd, offset, whence);
-    if (fd < FD_OFFSET) {
-        return orig_lseek(fd, offset, whence);
-    }
-    fd -= FD_OFFSET;
+off_t lseekRequest(int fd, off_t offset, int whence) {
     // Request Format:
     // | op     | fd     | offset | whence |
     // | int(4) | int(4) | int(8) | int(4) |
@@ -394,10 +3790,322 @@ ssize_t lseek(int fd, off_t offset, int whence)
     off_t new_offset;
     memcpy(&new_offset, resBuf + res_offsets[0], res_length[0]);
     memcpy(&errno, resBuf + res_offsets[1], res_length[1]);
+    return new_offset;
+}
+
+/** 
+    * @brief Change the file offset.
+    * @param fd The file descriptor.
+    * @param offset The offset to change.
+    * @param whence The position to change.
+    * @return The new offset.
+    */
+ssize_t lseek(int fd, off_t offset, int whence)
+{
+    fprintf(stderr, "mylib: called | fd %d | offset %ld | whence %d\n", fd, offset, whence);
+    if (fd < FD_OFFSET) {
+        return orig_lseek(fd, offset, whence);
+    }
+    fd -= FD_OFFSET;
+    struct cached_file *cf = cachedFile(fd);
+    if (cf != NULL) {
+        return orig_lseek(cf->local_fd, offset, whence);
+    }
+    off_t new_offset;
+    delegationCheck();
+    struct stream_buffer *sb = fd < MAX_REMOTE_FDS ? streams[fd] : NULL;
+    if (sb != NULL && sb->delegated && sb->offset >= 0 && whence == SEEK_CUR && offset == 0) {
+        // The offset of a delegated file is known here.
+        new_offset = sb->offset + sb->len;
+    } else if (sb != NULL && sb->mode != STREAM_APPEND && whence == SEEK_CUR && offset == 0) {
+        // Asking for the offset does not disturb the buffer: the application's offset is the
+        // server's minus unread read-ahead data, or plus unsent write-behind data.
+        new_offset = lseekRequest(fd, 0, SEEK_CUR);
+        if (new_offset != -1 && sb->delegated) {
+            sb->offset = new_offset;
+        }
+        if (new_offset != -1) {
+            new_offset += sb->mode == STREAM_READ_AHEAD ? -(off_t)(sb->len - sb->pos) : (off_t)sb->len;
+        }
+    } else {
+        if (sb != NULL && sb->mode == STREAM_READ_AHEAD) {
+            // Unread data is dropped, so a relative seek starts from the application's offset.
+            if (whence == SEEK_CUR) offset -= sb->len - sb->pos;
+            sb->len = sb->pos = 0;
+        }
+        streamSync(fd);
+        new_offset = lseekRequest(fd, offset, whence);
+        if (new_offset != -1 && sb != NULL) {
+            sb->offset = new_offset;
+        }
+        if (new_offset != -1 && fd < MAX_REMOTE_FDS && export_files[fd] != NULL) {
+            export_files[fd]->dir_off = new_offset;
+            export_files[fd]->server_behind = 0;
+        }
+    }
     fprintf(stderr, "mylib: lseek returned | new_offset: %ld | errno: %d\n\n", new_offset, errno);
     return new_offset;
 }
 
+/**
+    * @brief Send a copy range request to the server.
+    * @param in_fd The server file descriptor to copy from.
+    * @param in_off The offset to copy from, or -1 to use and advance the file offset.
+    * @param out_fd The server file descriptor to copy to.
+    * @param out_off The offset to copy to, or -1 to use and advance the file offset.
+    * @param len The number of bytes to copy.
+    * @return The number of bytes copied, or -1 if error.
+    */
+ssize_t copyRangeRequest(int in_fd, int64_t in_off, int out_fd, int64_t out_off, size_t len) {
+    // Request Format:
+    // | op     | in fd  | in offset | out fd | out offset | length |
+    // | int(4) | int(4) | int(8)    | int(4) | int(8)     | int(8) |
+    int op = 14;
+    int64_t length = len;
+    size_t req_length[6] = {sizeof(uint32_t), sizeof(uint32_t), sizeof(uint64_t), sizeof(uint32_t), sizeof(uint64_t), sizeof(uint64_t)};
+    int req_offsets[7] = {0};
+    for (int i = 0; i < 6; i++) {
+        req_offsets[i + 1] = req_offsets[i] + req_length[i];
+    }
+    char reqBuf[req_offsets[6]];
+    memcpy(reqBuf + req_offsets[0], &op, req_length[0]);
+    memcpy(reqBuf + req_offsets[1], &in_fd, req_length[1]);
+    memcpy(reqBuf + req_offsets[2], &in_off, req_length[2]);
+    memcpy(reqBuf + req_offsets[3], &out_fd, req_length[3]);
+    memcpy(reqBuf + req_offsets[4], &out_off, req_length[4]);
+    memcpy(reqBuf + req_offsets[5], &length, req_length[5]);
+    sendRequest(reqBuf, req_offsets[6]);
+
+    // Response Format:
+    // | bytes copied | errno  |
+    // | int(8)       | int(4) |
+    char resBuf[sizeof(uint64_t) + sizeof(uint32_t)];
+    receiveResponse(resBuf, sizeof(resBuf));
+    int64_t copied;
+    memcpy(&copied, resBuf, sizeof(uint64_t));
+    memcpy(&errno, resBuf + sizeof(uint64_t), sizeof(uint32_t));
+    return copied;
+}
+
+/**
+    * @brief Copy between two descriptors by reading and writing through a buffer.
+    * @details An explicit offset is served by seeking there and back, so the file offset is left
+    * unchanged like the system calls do. A short read ends the copy, as it does for a pipe.
+    * @return The number of bytes copied, or -1 if error.
+    */
+ssize_t copyThroughBuffer(int fd_in, off64_t *off_in, int fd_out, off64_t *off_out, size_t len) {
+    char data[64 * 1024];
+    off_t in_saved = 0, out_saved = 0;
+    if (off_in != NULL && ((in_saved = lseek(fd_in, 0, SEEK_CUR)) == -1 || lseek(fd_in, *off_in, SEEK_SET) == -1)) {
+        return -1;
+    }
+    if (off_out != NULL && ((out_saved = lseek(fd_out, 0, SEEK_CUR)) == -1 || lseek(fd_out, *off_out, SEEK_SET) == -1)) {
+        int error = errno;
+        if (off_in != NULL) lseek(fd_in, in_saved, SEEK_SET);
+        errno = error;
+        return -1;
+    }
+    size_t total = 0;
+    int error = 0;
+    while (total < len) {
+        size_t want = len - total < sizeof(data) ? len - total : sizeof(data);
+        ssize_t n = read(fd_in, data, want);
+        if (n <= 0) {
+            if (n == -1) error = errno;
+            break;
+        }
+        ssize_t done = 0;
+        while (done < n) {
+            ssize_t w = write(fd_out, data + done, n - done);
+            if (w <= 0) {
+                error = errno;
+                break;
+            }
+            done += w;
+        }
+        total += done;
+        if (done < n || (size_t)n < want) {
+            break;
+        }
+    }
+    if (off_in != NULL) {
+        lseek(fd_in, in_saved, SEEK_SET);
+        *off_in += total;
+    }
+    if (off_out != NULL) {
+        lseek(fd_out, out_saved, SEEK_SET);
+        *off_out += total;
+    }
+    if (total == 0 && error != 0) {
+        errno = error;
+        return -1;
+    }
+    return total;
+}
+
+/**
+    * @brief Copy between two descriptors, at least one of them remote.
+    * @details A copy between two remote files is made by the server, so the data does not cross
+    * the network. When both files are cached, the cached copies are copied locally and the
+    * destination is written back on close. Any other mix goes through a buffer.
+    * @param fd_in The file descriptor to copy from.
+    * @param off_in The offset to copy from and advance, or NULL to use the file offset.
+    * @param fd_out The file descriptor to copy to.
+    * @param off_out The offset to copy to and advance, or NULL to use the file offset.
+    * @param len The number of bytes to copy.
+    * @return The number of bytes copied, or -1 if error.
+    */
+ssize_t copyBetween(int fd_in, off64_t *off_in, int fd_out, off64_t *off_out, size_t len) {
+    if (len > SSIZE_MAX) {
+        len = SSIZE_MAX;
+    }
+    if (fd_in >= FD_OFFSET && fd_out >= FD_OFFSET) {
+        struct cached_file *cf_in = cachedFile(fd_in - FD_OFFSET);
+        struct cached_file *cf_out = cachedFile(fd_out - FD_OFFSET);
+        if (cf_in == NULL && cf_out == NULL) {
+            streamSync(fd_in - FD_OFFSET);
+            streamSync(fd_out - FD_OFFSET);
+            ssize_t copied = copyRangeRequest(fd_in - FD_OFFSET, off_in != NULL ? *off_in : -1,
+                                              fd_out - FD_OFFSET, off_out != NULL ? *off_out : -1, len);
+            if (copied > 0 && off_in != NULL) *off_in += copied;
+            if (copied > 0 && off_out != NULL) *off_out += copied;
+            return copied;
+        }
+        if (cf_in != NULL && cf_out != NULL) {
+            off_t start = off_out != NULL ? *off_out : orig_lseek(cf_out->local_fd, 0, SEEK_CUR);
+            ssize_t copied = orig_copy_file_range(cf_in->local_fd, off_in, cf_out->local_fd, off_out, len, 0);
+            if (copied > 0) {
+                markDirty(cf_out, start, start + copied);
+            }
+            return copied;
+        }
+    }
+    return copyThroughBuffer(fd_in, off_in, fd_out, off_out, len);
+}
+
+/**
+    * @brief Copy a range of bytes between two files.
+    * @param fd_in The file descriptor to copy from.
+    * @param off_in The offset to copy from, or NULL to use the file offset.
+    * @param fd_out The file descriptor to copy to.
+    * @param off_out The offset to copy to, or NULL to use the file offset.
+    * @param len The number of bytes to copy.
+    * @param flags Must be 0.
+    * @return The number of bytes copied, or -1 if error.
+    */
+ssize_t copy_file_range(int fd_in, off64_t *off_in, int fd_out, off64_t *off_out, size_t len, unsigned int flags) {
+    fprintf(stderr, "mylib: copy_file_range called | fd_in %d | fd_out %d | len %zu\n", fd_in, fd_out, len);
+    if (fd_in < FD_OFFSET && fd_out < FD_OFFSET) {
+        return orig_copy_file_range(fd_in, off_in, fd_out, off_out, len, flags);
+    }
+    if (flags != 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    ssize_t copied = copyBetween(fd_in, off_in, fd_out, off_out, len);
+    fprintf(stderr, "mylib: copy_file_range returned | copied %ld | errno %d\n\n", copied, errno);
+    return copied;
+}
+
+/**
+    * @brief Copy bytes from one file to another.
+    * @param out_fd The file descriptor to copy to, at its file offset.
+    * @param in_fd The file descriptor to copy from.
+    * @param offset The offset to copy from, or NULL to use the file offset.
+    * @param count The number of bytes to copy.
+    * @return The number of bytes copied, or -1 if error.
+    */
+ssize_t sendfile(int out_fd, int in_fd, off_t *offset, size_t count) {
+    fprintf(stderr, "mylib: sendfile called | out_fd %d | in_fd %d | count %zu\n", out_fd, in_fd, count);
+    if (in_fd < FD_OFFSET && out_fd < FD_OFFSET) {
+        return orig_sendfile(out_fd, in_fd, offset, count);
+    }
+    ssize_t copied = copyBetween(in_fd, offset, out_fd, NULL, count);
+    fprintf(stderr, "mylib: sendfile returned | copied %ld | errno %d\n\n", copied, errno);
+    return copied;
+}
+
+/**
+    * @brief Move bytes between a pipe and a file.
+    * @details Two remote files are also accepted and copied by the server, since a remote
+    * descriptor cannot be a pipe.
+    * @param fd_in The file descriptor to move from.
+    * @param off_in The offset to move from, or NULL to use the file offset.
+    * @param fd_out The file descriptor to move to.
+    * @param off_out The offset to move to, or NULL to use the file offset.
+    * @param len The number of bytes to move.
+    * @param flags The splice flags, which are only hints for remote files.
+    * @return The number of bytes moved, or -1 if error.
+    */
+ssize_t splice(int fd_in, off64_t *off_in, int fd_out, off64_t *off_out, size_t len, unsigned int flags) {
+    fprintf(stderr, "mylib: splice called | fd_in %d | fd_out %d | len %zu\n", fd_in, fd_out, len);
+    if (fd_in < FD_OFFSET && fd_out < FD_OFFSET) {
+        return orig_splice(fd_in, off_in, fd_out, off_out, len, flags);
+    }
+    ssize_t copied = copyBetween(fd_in, off_in, fd_out, off_out, len);
+    fprintf(stderr, "mylib: splice returned | copied %ld | errno %d\n\n", copied, errno);
+    return copied;
+}
+
+/**
+    * @brief Send buffered writes of a remote file and have the server flush the file to disk.
+    * @details A cached copy is written back on close, so only the local copy is flushed.
+    * @param fd The file descriptor.
+    * @return 0 if successful, -1 if error.
+    */
+int fsync(int fd) {
+    fprintf(stderr, "mylib: fsync called | fd %d\n", fd);
+    if (fd < FD_OFFSET) {
+        return orig_fsync(fd);
+    }
+    fd -= FD_OFFSET;
+    delegationCheck();
+    struct cached_file *cf = cachedFile(fd);
+    if (cf != NULL) {
+        return orig_fsync(cf->local_fd);
+    }
+    // The delegation is kept, only the buffered writes are sent.
+    struct stream_buffer *sb = fd < MAX_REMOTE_FDS ? streams[fd] : NULL;
+    if (sb != NULL && sb->mode != STREAM_READ_AHEAD && sb->len > 0) {
+        flushWriteBehind(fd, sb);
+    }
+    if (sb != NULL && sb->error != 0) {
+        errno = sb->error;
+        sb->error = 0;
+        return -1;
+    }
+
+    // Request Format:
+    // | op     | fd     |
+    // | int(4) | int(4) |
+    int op = 20;
+    char reqBuf[2 * sizeof(uint32_t)];
+    memcpy(reqBuf, &op, sizeof(uint32_t));
+    memcpy(reqBuf + sizeof(uint32_t), &fd, sizeof(uint32_t));
+    sendRequest(reqBuf, sizeof(reqBuf));
+
+    // Response Format:
+    // | res    | errno  |
+    // | int(4) | int(4) |
+    char resBuf[2 * sizeof(uint32_t)];
+    receiveResponse(resBuf, sizeof(resBuf));
+    int res;
+    memcpy(&res, resBuf, sizeof(uint32_t));
+    memcpy(&errno, resBuf + sizeof(uint32_t), sizeof(uint32_t));
+    fprintf(stderr, "mylib: fsync returned | res %d | errno %d\n\n", res, errno);
+    return res;
+}
+
+/**
+    * @brief Flush a file to disk, as fsync does for remote files.
+    */
+int fdatasync(int fd) {
+    if (fd < FD_OFFSET) {
+        return orig_fdatasync(fd);
+    }
+    return fsync(fd);
+}
+
 /** 
     * @brief Get file status.
     * @param pathname The path to the file.
@@ -406,6 +4114,21 @@ ssize_t lseek(int fd, off_t offset, int whence)
     */
 int stat(const char *restrict pathname, struct stat *restrict statbuf) {
     fprintf(stderr, "mylib: stat called | path %s | %ld\n", pathname, sizeof(struct stat));
+    int success;
+    char key[PATH_MAX + 8];
+    int trusted = callbackTrusted();
+    if (export_readonly || trusted) {
+        snprintf(key, sizeof(key), "s%s", pathname);
+        struct export_entry *e = exportLookup(key);
+        if (e != NULL) {
+            memcpy(&success, e->data, sizeof(uint32_t));
+            memcpy(&errno, e->data + sizeof(uint32_t), sizeof(uint32_t));
+            memcpy(statbuf, e->data + 2 * sizeof(uint32_t), sizeof(struct stat));
+            return success;
+        }
+    }
+    delegationSync(pathname, 0);
+    flushAllWriteBehind();
     // Request Format:
     // | op     | pathname length | pathname    | statbuf
     // | int(4) | int(4)          | c_string(n) | stat_size
@@ -423,18 +4146,23 @@ int stat(const char *restrict pathname, struct stat *restrict statbuf) {
     sendRequest(reqBuf, req_offsets[4]);
 
     // Response Format:
-    // | res    | errno  |
-    // | int(4) | int(4) |
-    size_t res_length[2] = {sizeof(uint32_t), sizeof(uint32_t)};
-    int res_offsets[3] = {0};
-    for (int i = 0; i < 2; i++) {
+    // | res    | errno  | statbuf   |
+    // | int(4) | int(4) | stat_size |
+    size_t res_length[3] = {sizeof(uint32_t), sizeof(uint32_t), sizeof(struct stat)};
+    int res_offsets[4] = {0};
+    for (int i = 0; i < 3; i++) {
         res_offsets[i + 1] = res_offsets[i] + res_length[i];
     }
-    char resBuf[res_offsets[2]];
-    receiveResponse(resBuf, res_offsets[2]);
-    int success;
+    char resBuf[res_offsets[3]];
+    receiveResponse(resBuf, res_offsets[3]);
     memcpy(&success, resBuf + res_offsets[0], res_length[0]);
     memcpy(&errno, resBuf + res_offsets[1], res_length[1]);
+    memcpy(statbuf, resBuf + res_offsets[2], res_length[2]);
+    if (export_readonly || trusted) {
+        int error = errno;
+        exportStore(key, resBuf, res_offsets[3]);
+        errno = error;
+    }
 
     fprintf(stderr, "mylib: stat returned | success: %d | errno: %d\n\n", success, errno);
     return success;
@@ -447,6 +4175,11 @@ int stat(const char *restrict pathname, struct stat *restrict statbuf) {
     */
 int unlink(const char *pathname){
     fprintf(stderr, "mylib: unlink called | path %s\n", pathname);
+    if (export_readonly) {
+        errno = EROFS;
+        return -1;
+    }
+    flushAllWriteBehind();
     // Request Format:
     // | op     | pathname length | pathname    |
     // | int(4) | int(4)          | c_string(n) |
@@ -475,11 +4208,34 @@ int unlink(const char *pathname){
     int success;
     memcpy(&success, resBuf + res_offsets[0], res_length[0]);
     memcpy(&errno, resBuf + res_offsets[1], res_length[1]);
+    if (callback_fd != -1) {
+        int error = errno;
+        callbackForget(pathname);
+        errno = error;
+    }
     
     fprintf(stderr, "mylib: unlink returned | success %d | errno %d\n\n", success, errno);
     return success;
 }
 
+/**
+    * @brief Directory offset after a listing, the offset of the entry following its last one.
+    * @param buf The listing, struct dirent records.
+    * @param len The length of the listing.
+    * @param off The directory offset the listing started at.
+    */
+off_t direntsEnd(const char *buf, size_t len, off_t off) {
+    for (size_t pos = 0; pos + offsetof(struct dirent, d_name) <= len; ) {
+        const struct dirent *d = (const struct dirent *)(buf + pos);
+        if (d->d_reclen == 0) {
+            break;
+        }
+        off = d->d_off;
+        pos += d->d_reclen;
+    }
+    return off;
+}
+
 /** 
     * @brief Get directory entries.
     * @param fd The file descriptor.
@@ -494,6 +4250,24 @@ ssize_t getdirentries(int fd, char *buf, size_t nbyte, off_t *restrict basep) {
         return orig_getdirentries(fd, buf, nbyte, basep);
     }
     fd -= FD_OFFSET;
+    struct export_file *ef = export_readonly && fd < MAX_REMOTE_FDS ? export_files[fd] : NULL;
+    char key[PATH_MAX + 64];
+    if (ef != NULL) {
+        snprintf(key, sizeof(key), "d%ld:%zu:%s", (long)ef->dir_off, nbyte, ef->path);
+        struct export_entry *e = exportLookup(key);
+        if (e != NULL) {
+            memcpy(buf, e->data, e->len);
+            *basep = ef->dir_off;
+            ef->dir_off = direntsEnd(buf, e->len, ef->dir_off);
+            ef->server_behind = 1;
+            errno = 0;
+            return e->len;
+        }
+        if (ef->server_behind) {
+            lseekRequest(fd, ef->dir_off, SEEK_SET);
+            ef->server_behind = 0;
+        }
+    }
     // Define the format of the message.
     // Extendability: We can add more fields to the message by adding more offsets and updating totalSize.
     // Request Format:
@@ -533,6 +4307,12 @@ ssize_t getdirentries(int fd, char *buf, size_t nbyte, off_t *restrict basep) {
     }
     receiveResponse(buf, bytes_read);
     buf[bytes_read] = '\0';
+    if (ef != NULL) {
+        exportStore(key, buf, bytes_read);
+        *basep = ef->dir_off;
+        ef->dir_off = direntsEnd(buf, bytes_read, ef->dir_off);
+        errno = 0;
+    }
 
     fprintf(stderr, "mylib: getdirentries returned | bytes_read %d | errno %d | data %s\n\n", bytes_read, errno, buf);
     return bytes_read;
@@ -568,6 +4348,18 @@ void deserialize_dirtree(struct dirtreenode *node, char *buf, int* offset) {
     */
 struct dirtreenode *getdirtree(const char *path){
     // fprintf(stderr, "mylib: getdirtree called | path %s\n", path);
+    char key[PATH_MAX + 8];
+    if (export_readonly) {
+        snprintf(key, sizeof(key), "t%s", path);
+        struct export_entry *e = exportLookup(key);
+        if (e != NULL) {
+            struct dirtreenode *root = (struct dirtreenode *)malloc(sizeof(struct dirtreenode));
+            int offset = 0;
+            deserialize_dirtree(root, e->data, &offset);
+            return root;
+        }
+    }
+    flushAllWriteBehind();
 
     // Request Format:
     // | op     | pathname length | pathname    |
@@ -598,6 +4390,9 @@ struct dirtreenode *getdirtree(const char *path){
     char resBuf[ret_data_length + 1];
     receiveResponse(resBuf, ret_data_length);
     resBuf[ret_data_length] = '\0';
+    if (export_readonly) {
+        exportStore(key, resBuf, ret_data_length);
+    }
 
     struct dirtreenode *root = (struct dirtreenode *)malloc(sizeof(struct dirtreenode));
     int offset = 0;
@@ -620,7 +4415,12 @@ void freedirtree(struct dirtreenode *dt){
     * @brief Connect to the server.
     * @return 0 if successful, -1 if error.
     */
-int connectServer() {
+/**
+    * @brief Open a connection to the server.
+    * @return The socket file descriptor.
+    */
+int serverConnect(void) {
+    int fd;
     char *serverip;
     char *serverport;
     unsigned short port;
@@ -645,8 +4445,8 @@ int connectServer() {
     port = (unsigned short)atoi(serverport);
     
     // Create socket
-    sockfd = socket(AF_INET, SOCK_STREAM, 0);    // TCP/IP socket
-    if (sockfd<0) err(1, 0);            // in case of error
+    fd = socket(AF_INET, SOCK_STREAM, 0);    // TCP/IP socket
+    if (fd<0) err(1, 0);            // in case of error
     
     // setup address structure to point to server
     memset(&srv, 0, sizeof(srv));            // clear it first
@@ -655,12 +4455,98 @@ int connectServer() {
     srv.sin_port = htons(port);            // server port
 
     // actually connect to the server
-    rv = connect(sockfd, (struct sockaddr*)&srv, sizeof(struct sockaddr));
+    rv = connect(fd, (struct sockaddr*)&srv, sizeof(struct sockaddr));
     if (rv<0) err(1,0);
 
+    // Requests are sent in pieces, header first, which Nagle's algorithm would hold back.
+    int nodelay = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+    return fd;
+}
+
+int connectServer() {
+    sockfd = serverConnect();
     return 0;
 }
 
+/**
+    * @brief Print the client metrics.
+    * @details RPC_METRICS=1 prints them to stderr, any other value names a file they are appended to.
+    */
+void printMetrics(void) {
+    char *target = getenv("RPC_METRICS");
+    if (target == NULL) {
+        return;
+    }
+    FILE *out = strcmp(target, "1") == 0 ? stderr : fopen(target, "a");
+    if (out == NULL) {
+        return;
+    }
+    if (metrics.dedup_bytes > 0) {
+        fprintf(out, "mylib metrics | dedup | written %lu | sent %lu | ratio %.2f | chunks %lu | duplicate %lu | queries %lu | cpu %.1f ms/GB\n",
+                metrics.dedup_bytes, metrics.dedup_sent_bytes,
+                (double)metrics.dedup_bytes / metrics.dedup_sent_bytes,
+                metrics.dedup_chunks, metrics.dedup_duplicate_chunks, metrics.dedup_queries,
+                metrics.dedup_cpu_ns / 1e6 / (metrics.dedup_bytes / 1e9));
+    }
+    if (estimator.round_trips > 0) {
+        fprintf(out, "mylib metrics | transfer | rtt %.1f us | bandwidth %.1f MB/s | bdp %.0f | transfer size %zu | resizes %lu | round trips %lu | bandwidth samples %lu\n",
+                estimator.min_rtt_ns / 1e3, estimator.max_bw / 1e6, estimator.max_bw * estimator.min_rtt_ns / 1e9,
+                estimator.transfer_size, estimator.resizes, estimator.round_trips, estimator.bw_samples);
+    }
+    if (metrics.readahead_fills > 0 || metrics.write_behind_flushes > 0) {
+        fprintf(out, "mylib metrics | streams | read-ahead fills %lu | read-ahead bytes %lu | write-behind flushes %lu | write-behind bytes %lu\n",
+                metrics.readahead_fills, metrics.readahead_bytes, metrics.write_behind_flushes, metrics.write_behind_bytes);
+    }
+    if (metrics.delegations > 0) {
+        fprintf(out, "mylib metrics | delegation | granted %lu | recalls %lu | local writes %lu | local bytes %lu\n",
+                metrics.delegations, metrics.delegation_recalls, metrics.delegated_writes, metrics.delegated_bytes);
+    }
+    if (metrics.append_records > 0) {
+        fprintf(out, "mylib metrics | append | records %lu | batches %lu | bytes %lu | records per batch %.1f\n",
+                metrics.append_records, metrics.append_batches, metrics.append_bytes,
+                metrics.append_batches > 0 ? (double)metrics.append_records / metrics.append_batches : 0.0);
+    }
+    if (metrics.sibling_dirs > 0) {
+        fprintf(out, "mylib metrics | siblings | directories %lu | pushed %lu | hits %lu | hit rate %.1f%% | bytes %lu\n",
+                metrics.sibling_dirs, metrics.sibling_pushed, metrics.sibling_hits,
+                metrics.sibling_pushed > 0 ? 100.0 * metrics.sibling_hits / metrics.sibling_pushed : 0.0,
+                metrics.sibling_bytes);
+    }
+    if (metrics.upload_batches > 0) {
+        fprintf(out, "mylib metrics | upload | files %lu | batches %lu | bytes %lu | failures %lu\n",
+                metrics.upload_files, metrics.upload_batches, metrics.upload_bytes, metrics.upload_failures);
+    }
+    if (export_readonly) {
+        fprintf(out, "mylib metrics | export | read only | generation %ld | hits %lu | misses %lu\n",
+                export_generation, metrics.export_hits, metrics.export_misses);
+    }
+    if (callbacks_enabled && !export_readonly) {
+        fprintf(out, "mylib metrics | callbacks | %s | hits %lu | misses %lu | invalidations %lu\n",
+                callback_fd != -1 ? "attached" : "off", metrics.export_hits, metrics.export_misses,
+                metrics.callback_invalidations);
+    }
+    if (metrics.prefetch_files > 0 || metrics.prefetch_globs > 0) {
+        fprintf(out, "mylib metrics | prefetch | files %lu | globs %lu | fetched %lu | unchanged %lu | bytes %lu | time %.1f ms\n",
+                metrics.prefetch_files, metrics.prefetch_globs, metrics.prefetch_fetched, metrics.prefetch_unchanged,
+                metrics.prefetch_bytes, metrics.prefetch_ns / 1e6);
+    }
+    if (governor.peak > 0 || governor.refused > 0) {
+        fprintf(out, "mylib metrics | memory | budget %zu | limit %zu | used %zu | peak %zu | evictions %lu | evicted %lu | refused %lu | pressure events %lu\n",
+                governor.budget, governor.limit, governor.used, governor.peak, governor.evictions,
+                governor.evicted_bytes, governor.refused, governor.pressure_events);
+        for (int i = 0; i < governor.ncaches; i++) {
+            struct mem_cache *mc = governor.caches[i];
+            fprintf(out, "mylib metrics | cache %s | bytes %zu | hits %lu | evictions %lu | evicted %lu\n",
+                    mc->name, mc->bytes, mc->total_hits, mc->evictions, mc->evicted_bytes);
+        }
+    }
+    if (out != stderr) {
+        fclose(out);
+    }
+}
+
 /**
     * @brief Init function to set the function pointers to the original functions.
     * Automatically called when program is started.
@@ -677,5 +4563,85 @@ void _init(void) {
     orig_getdirentries = dlsym(RTLD_NEXT, "getdirentries");
     orig_getdirtree = dlsym(RTLD_NEXT, "getdirtree");
     orig_freedirtree = dlsym(RTLD_NEXT, "freedirtree");
+    orig_copy_file_range = dlsym(RTLD_NEXT, "copy_file_range");
+    orig_sendfile = dlsym(RTLD_NEXT, "sendfile");
+    orig_splice = dlsym(RTLD_NEXT, "splice");
+    orig_fsync = dlsym(RTLD_NEXT, "fsync");
+    orig_fdatasync = dlsym(RTLD_NEXT, "fdatasync");
+
+    cache_dir = getenv("RPC_CACHE_DIR");
+    if (cache_dir != NULL && mkdir(cache_dir, 0700) == -1 && errno != EEXIST) {
+        fprintf(stderr, "mylib: cannot use cache directory %s, caching disabled\n", cache_dir);
+        cache_dir = NULL;
+    }
+    char *delta = getenv("RPC_DELTA");
+    if (delta != NULL && strcmp(delta, "0") == 0) {
+        delta_enabled = 0;
+    }
+    char *dedup = getenv("RPC_DEDUP");
+    dedup_enabled = dedup != NULL && strcmp(dedup, "1") == 0;
+
+    memInit();
+    known_chunks.mem.name = "known chunks";
+    known_chunks.mem.shrink = shrinkKnownChunks;
+    memRegister(&known_chunks.mem);
+    stream_cache.name = "stream buffers";
+    stream_cache.shrink = shrinkStreams;
+    memRegister(&stream_cache);
+    export_cache.name = "export";
+    export_cache.shrink = shrinkExportCache;
+    memRegister(&export_cache);
+    upload_batch.mem.name = "upload batch";
+    upload_batch.mem.shrink = shrinkUploadBatch;
+    memRegister(&upload_batch.mem);
+    sibling_cache.name = "sibling files";
+    sibling_cache.shrink = shrinkSiblingFiles;
+    memRegister(&sibling_cache);
+    char *upload = getenv("RPC_UPLOAD_BATCH");
+    upload_enabled = upload != NULL && strcmp(upload, "1") == 0;
+    char *buffering = getenv("RPC_BUFFERING");
+    buffering_enabled = buffering == NULL || strcmp(buffering, "0") != 0;
+    char *delegation = getenv("RPC_DELEGATION");
+    delegation_enabled = delegation == NULL || strcmp(delegation, "0") != 0;
     connectServer();
+    exportRequest();
+    // A read-only export does not change, there is nothing to call back.
+    char *callbacks = getenv("RPC_CALLBACKS");
+    callbacks_enabled = callbacks != NULL && strcmp(callbacks, "1") == 0;
+    if (callbacks_enabled && !export_readonly) {
+        callbackConnect();
+    }
+    char *record = getenv("RPC_PREFETCH_RECORD");
+    if (record != NULL) {
+        prefetch_record_fd = orig_open(record, O_WRONLY | O_APPEND | O_CREAT, 0644);
+    }
+    // Pushed siblings go to the cache directory, on a read-only export their attributes are kept too.
+    char *siblings = getenv("RPC_SIBLING_PREFETCH");
+    if (siblings != NULL && cache_dir != NULL) {
+        sibling_threshold = atoi(siblings);
+    }
+    char *manifest = getenv("RPC_PREFETCH");
+    if (manifest != NULL) {
+        prefetchManifest(manifest);
+    }
+}
+
+/**
+    * @brief Fini function, automatically called when the program exits.
+    */
+void _fini(void) {
+    // Files still open are uploaded as they are, as the kernel would have kept what was written.
+    for (int fd = 0; fd < FD_OFFSET; fd++) {
+        if (upload_files[fd] != NULL) {
+            uploadAdd(fd);
+        }
+    }
+    uploadFlush();
+    // Buffered writes of files the program did not close, notably of delegated files.
+    for (int fd = 0; fd < MAX_REMOTE_FDS && write_behind_pending > 0; fd++) {
+        if (streams[fd] != NULL && streams[fd]->mode != STREAM_READ_AHEAD && streams[fd]->len > 0) {
+            flushWriteBehind(fd, streams[fd]);
+        }
+    }
+    printMetrics();
 }
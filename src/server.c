@@ -13,12 +13,37 @@
     * 8. getdirentries
     * 9. getdirtree
     * 10. freedirtree
+    * 11. fstat
+    * 12. block signatures of a file, for delta write-back
+    * 13. apply a delta write-back
+    * 14. query the content-addressed chunk store
+    * 15. write a buffer given as chunks, some of which are taken from the chunk store
+    * 16. copy a byte range between two open files on the server
+    * 17. append a batch of records to a file opened with O_APPEND
+    * 18. describe the export: whether it is read-only, and its generation
+    * 19. fetch the attributes and content of many files, or of the small files of a directory, in one streamed response
+    * 20. create and write many files from one request, in parallel, with one durability barrier
+    * 21. give back a write delegation
+    * 22. fsync
+    * 23. start callbacks for the session
+    * 24. attach a control connection to a session with callbacks
+    * A client opening a file write-only may ask for a write delegation: a write lease on the file,
+    * granted only if no one else has it open. The client then buffers its writes. When another
+    * process opens the file, the lease breaks and the client is told with a byte of urgent data.
+    * A client may ask for callbacks: the session then watches every file it opens or stats, and the
+    * directory holding it, and pushes the path on a second connection of the client when the file
+    * or the names in the directory change. The client keeps what it learned until told otherwise.
+    * With RPC_EXPORT_READONLY=1 the export is published data that does not change: requests that would
+    * modify it fail with EROFS and clients cache what they read without revalidating it. Republishing
+    * bumps the generation, the number stored in the file GENERATION_FILE of the export root.
     * The server sends the response back to the client after processing the request.
     * The server is multi-threaded and can handle multiple clients concurrently.
     * The server is implemented using the socket programming interface, TCP/IP protocol, andC programming language.
     * @author Jacqueline Tsai yunhsuat@andrew.cmu.edu
  */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <arpa/inet.h>
@@ -27,435 +52,3666 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/socket.h>
 #include <string.h>
 #include <unistd.h>
 #include <err.h>
 #include <sys/dir.h>
+#include <sys/sendfile.h>
+#include <fnmatch.h>
+#include <pthread.h>
+#include <signal.h>
+#include <limits.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/random.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <semaphore.h>
+#include <sys/resource.h>
+#include <time.h>
 #include "dirtree.h"
+#include "checksum.h"
 
 // Define the maximum message length
 #define MAX_MSG_LEN 4096
 
-// socket file descriptor for the connection to the server
-int sockfd, sessfd;
+// Flag of the apply delta request: every copy instruction reads from an offset at or after
+// the one it writes to, so the delta can be applied to the file in place
+#define DELTA_INPLACE 1
+
+// Flags of the fetch files request: send file content, not only attributes, select the
+// files by a directory and a glob pattern instead of a list, and send content only for files
+// no larger than a limit
+#define FETCH_CONTENT 1
+#define FETCH_GLOB 2
+#define FETCH_SMALL 4
+
+// Define the number of threads writing the files of an upload batch, and the bytes of file
+// content received ahead of them
+#define UPLOAD_WORKERS 4
+#define UPLOAD_QUEUE_BYTES (64 * 1024 * 1024)
+
+// Define the seconds a client has to give its delegations back before the server lets other
+// openers go ahead
+#define RECALL_TIMEOUT_SEC 1
+
+// Define the largest number of file descriptors of the process that can hold a write delegation
+#define MAX_LEASE_FDS (1 << 20)
+
+// Define the milliseconds a handler waits for the rest of a request, or for room to send a
+// response, before it takes the client for gone
+#define SESSION_IO_TIMEOUT_MS 30000
+
+// Define the number of events an event loop takes from epoll at once
+#define MAX_EVENTS 256
+
+// Define the size of the first block of the arena of a session, and of the largest block it keeps
+// from one request to the next
+#define ARENA_BLOCK (16 * 1024)
+#define ARENA_KEEP (1024 * 1024)
+
+// Define the number of handler threads per CPU, by default. Handlers block in file system calls.
+#define HANDLER_THREADS_PER_CPU 4
+
+// Define the size of the submission queue of an io_uring event loop, and the registered buffers
+// it reads files into, taken from the buffer pool. Larger reads are left to the handler threads.
+#define URING_ENTRIES 256
+#define URING_READ_BUFFERS 16
+#define URING_READ_BUFFER_SIZE (1024 * 1024)
+
+// Define the largest file descriptor an io_uring event loop registers, by its number
+#define URING_MAX_FILES (1 << 16)
+
+// Define the number of buckets of the open file cache, and the number of idle descriptors it
+// keeps open by default
+#define OPEN_CACHE_BUCKETS 4096
+#define OPEN_CACHE_IDLE 1024
+
+// Events of a file, and of the directory holding it, that end a callback of the client
+#define CALLBACK_FILE_EVENTS (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_DELETE_SELF | IN_MOVE_SELF)
+#define CALLBACK_DIR_EVENTS (IN_ATTRIB | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF)
+
+// File of the export root holding the generation of a read-only export
+#define GENERATION_FILE ".rpc-generation"
 
 /**
-    * @brief Handle the open system call.
-    * @param buf The buffer containing the request.
-    * @param retBuf The buffer to store the response.
-    * @return The size of the response.
+    * @brief A path the client was promised to hear about, by inotify watch descriptor.
     */
-size_t handle_open(const char *buf, char* retBuf) {
-    fprintf(stderr, "enter func: handle_open\n");
-    // Request Format:
-    // | pathname length | pathname    | flags  | mode      |
-    // | int(4)          | c_string(n) | int(4) | mode_t(4) |
-    size_t req_length[4] = {sizeof(uint32_t), 0, sizeof(uint32_t), sizeof(uint32_t)};
-    int req_offsets[5] = {0};
-    memcpy(&req_length[1], buf + req_offsets[0], req_length[0]);
-    for (int i = 0; i < 4; i++) { 
-        req_offsets[i + 1] = req_offsets[i] + req_length[i];
-    }
+struct callback_watch {
+    char *path;
+    int armed;                     // the client learned the path since it was last told of a change
+};
 
-    char *pathname = malloc(req_length[1] + 1);
-    memcpy(pathname, buf + req_offsets[1], req_length[1]);
+/**
+    * @brief A path whose change the client is told of without an inotify event.
+    */
+struct callback_break {
+    struct callback_break *next;
+    char path[];
+};
+
+/**
+    * @brief Callbacks of a session: the inotify instance, its watches indexed by watch descriptor,
+    * breaks queued for the callback thread and the pipe waking it, and the control connection.
+    * @details Once the control connection is attached, the callback thread owns the state and frees
+    * it after the session ends.
+    */
+struct callbacks {
+    int id;
+    uint64_t token;
+    int inotify;
+    struct callback_watch *watches;
+    int watch_cap;
+    struct callback_break *breaks;
+    int wake[2];
+    int ctl;
+    int attached;                  // claimed by a control connection, under callbacks_waiting_lock
+    int stop;                      // the session ended
+    pthread_mutex_t lock;
+    struct callbacks *next;        // in callbacks_waiting
+};
+
+/**
+    * @brief An open file description of a regular file opened read-only, shared by the sessions
+    * opening the file with the same flags.
+    */
+struct open_file {
+    dev_t dev;
+    ino_t ino;
     int flags;
-    memcpy(&flags, buf + req_offsets[2], req_length[2]);
-    mode_t mode;
-    memcpy(&mode, buf + req_offsets[3], req_length[3]);
+    int fd;
+    int refs;                      // handles of sessions on it, 0 while it is idle
+    struct open_file *next;        // in its bucket
+    struct open_file *lru_prev;    // idle ones, least recently used first
+    struct open_file *lru_next;
+};
 
-    int fd = open(pathname, flags, mode);
+/**
+    * @brief A file the client opened, by the handle the client knows it as.
+    */
+struct session_file {
+    int fd;                        // server file descriptor, -1 if the handle is free
+    int delegated;                 // the client holds the write delegation of the file
+    int registered;                // in the file table of the io_uring of the session loop
+    struct open_file *shared;      // cached description the handle shares, NULL if it has its own
+    off_t offset;                  // file offset of the handle, kept here when it is shared
+};
 
-    // Response Format:
-    // | fd     | errno  |
-    // | int(4) | int(4) |
-    memcpy(retBuf, &fd, sizeof(int));
-    memcpy(retBuf + sizeof(int), &errno, sizeof(int));
-    if (fd == -1) {
-        perror("open error");
+/**
+    * @brief An event loop thread, with the sessions whose requests the handler threads finished.
+    */
+struct event_loop {
+    int epoll_fd;
+    int listener;                  // listening socket the loop accepts from
+    int cpu;                       // the loop and its handler threads run on, -1 if not pinned
+    struct handler_pool *pool;     // handler threads the requests of its sessions go to
+    unsigned int accepted;         // sessions the loop accepted for itself, when sharded
+    struct uring *ring;            // with the io_uring engine, which the loop then waits on instead
+    int wake;                      // eventfd the handler threads post completions on
+    uint64_t wake_count;           // read from wake by the io_uring engine
+    struct session *done;          // lock-free stack of completed sessions, pushed by any thread
+};
+
+/**
+    * @brief A block of an arena, allocated from the front.
+    */
+struct arena_block {
+    struct arena_block *next;
+    size_t size;
+    size_t used;
+    char data[];
+};
+
+/**
+    * @brief Memory of the request a session is handling, given back at once when its response is out.
+    */
+struct arena {
+    struct arena_block *blocks;    // the block allocated from first
+};
+
+/**
+    * @brief State of one client connection, owned by the event loop that accepted it.
+    * @details Clients name files by handles, indexes into files, so the sessions sharing the
+    * process cannot reach each other's descriptors, and handles stay small.
+    * A client waits for each response before it sends the next request, and the session socket is
+    * armed in epoll one shot at a time, so a session has at most one request with the handlers.
+    * Its requests, and the operations on each of its files, run in the order the client sent them.
+    */
+struct session {
+    int sock;
+    struct event_loop *loop;       // the event loop owning the session
+    int worker;                    // handler thread whose queue the requests go to first
+    char *in;                      // the request being handled, a buffer of the pool while there is one
+    size_t in_len;
+    char *out;                     // the response, likewise
+    size_t out_len;
+    size_t out_sent;               // bytes of the response the socket took
+    int read_buffer;               // registered buffer of a read the io_uring engine runs, or -1
+    char read_header[2 * sizeof(uint32_t)];  // the response to that read, sent ahead of the buffer
+    struct iovec read_iov[2];
+    struct msghdr read_msg;
+    int read_pending;              // operations of that read not completed yet
+    int read_fd;
+    int read_handle;
+    int read_count;
+    int read_res;
+    int read_sent;
+    int registered;                // the socket is in the file table of the io_uring of the loop
+    int accepted;                  // just accepted, for the event loop to start receiving from
+    struct session *next;          // in a handler queue, or in the completions of the event loop
+    struct arena arena;            // what handlers allocate for the request
+    struct session_file *files;
+    int nfiles;
+    int delegations;
+    volatile sig_atomic_t recall_sent;  // the client was told to give its delegations back
+    volatile int64_t recall_deadline;   // when the delegations are taken back anyway, in ns
+    struct callbacks *callbacks;
+    struct callbacks *attach;      // callbacks this connection becomes the control connection of
+};
+
+// listening socket, shared by the event loops unless they are sharded
+int sockfd;
+
+// event loops, and the loop the next accepted session goes to
+struct event_loop *loops;
+int loop_count;
+unsigned int next_loop;
+
+// whether each event loop is a shard of its own, with its listener, CPU and handler threads
+int sharded;
+
+/**
+    * @brief The requests queued for one handler thread, oldest first.
+    */
+struct handler_queue {
+    pthread_mutex_t lock;
+    struct session *head;
+    struct session *tail;
+};
+
+/**
+    * @brief Handler threads with their queues, shared by the event loops or one per shard.
+    */
+struct handler_pool {
+    struct handler_queue *queues;
+    int count;
+    sem_t work;                    // requests queued in all of the queues
+};
+
+/**
+    * @brief A handler thread, by its queue in its pool.
+    */
+struct handler {
+    struct handler_pool *pool;
+    int index;
+    int cpu;                       // the thread runs on, -1 if not pinned
+};
+
+// number of handler threads
+int handler_count;
+
+// session whose request the thread handles, and its socket
+__thread struct session *session;
+__thread int sessfd;
+
+// number of bytes of the current request, after the op, that the event loop has already received
+__thread size_t req_avail;
+
+// directory of the content-addressed chunk store
+char *chunk_store;
+
+// whether the export is published read-only data
+int export_readonly;
+
+// session holding a write delegation on each server file descriptor, read by the lease signal handlers
+struct session *volatile *lease_sessions;
+int lease_capacity;
+
+// sessions that started callbacks and wait for their control connection
+struct callbacks *callbacks_waiting;
+int callback_ids;
+pthread_mutex_t callbacks_waiting_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// read-only files open for sessions, by inode and flags, the idle ones from least to most recently
+// used, and the number of idle ones kept open
+struct open_file *open_cache[OPEN_CACHE_BUCKETS];
+struct open_file *open_cache_lru;
+struct open_file *open_cache_mru;
+int open_cache_idle;
+int open_cache_budget = OPEN_CACHE_IDLE;
+pthread_mutex_t open_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+    * @brief A size class of the I/O buffer pool, carved out of slabs.
+    */
+struct buffer_class {
+    size_t size;
+    pthread_mutex_t lock;
+    void *free;                    // buffers given back, linked through their first word
+    unsigned long hits;            // buffers taken from a thread cache or the free list
+    unsigned long misses;          // buffers that needed a new slab
+    unsigned long in_use;
+    unsigned long high_water;      // most buffers in use at once
+};
+
+// Define the size of a slab of the buffer pool, one huge page, and the number of buffers of each
+// class a thread keeps for itself
+#define BUFFER_SLAB (2 * 1024 * 1024)
+#define BUFFER_CACHE 8
+#define BUFFER_CLASSES 4
+
+// I/O buffer pool: receive and response frames, file data, and io_uring registered buffers
+struct buffer_class buffer_classes[BUFFER_CLASSES] = {
+    {8 * 1024, PTHREAD_MUTEX_INITIALIZER},
+    {64 * 1024, PTHREAD_MUTEX_INITIALIZER},
+    {1024 * 1024, PTHREAD_MUTEX_INITIALIZER},
+    {BUFFER_SLAB, PTHREAD_MUTEX_INITIALIZER},
+};
+
+// whether slabs are allocated from huge pages
+int buffer_huge_pages;
+
+// buffers of each class the thread gave back and takes first
+__thread void *buffer_cache[BUFFER_CLASSES][BUFFER_CACHE];
+__thread int buffer_cached[BUFFER_CLASSES];
+
+/**
+    * @brief Size class of the buffer pool for a size.
+    * @return The class, or -1 if the size is larger than the largest class.
+    */
+int bufferClass(size_t size) {
+    for (int c = 0; c < BUFFER_CLASSES; c++) {
+        if (size <= buffer_classes[c].size) {
+            return c;
+        }
     }
-    fprintf(stderr, "handle_open | req | pathname %s | flag %d | mode %d\n", pathname, flags, mode);
-    fprintf(stderr, "handle_open | ret | fd %d | errno %d | retBuf %s |\n", fd, errno, retBuf);
-    return 2 * sizeof(int);
+    return -1;
 }
 
 /**
-    * @brief Handle the read system call.
-    * @param buf The buffer containing the request.
-    * @param retBuf The buffer to store the response.
-    * @return The size of the response.
+    * @brief Carve a new slab into free buffers of a class. Called with the class locked.
+    * @return 0 if successful, -1 if no memory is left.
     */
-size_t handle_read(const char *buf, char* retBuf) {
-    fprintf(stderr, "enter func: handle_read\n");
-    // Define the format of the message.
-    // Extendability: We can add more fields to the message by adding more offsets and updating totalSize.
-    // Request Format:
-    // | fd     | count  |
-    // | int(4) | int(4) |
-    size_t req_length[2] = {4, 4};
-    int req_offsets[3] = {0};
-    for (int i = 0; i < 2; i++) {
-        req_offsets[i + 1] = req_offsets[i] + req_length[i];
+int bufferSlab(struct buffer_class *bc) {
+    // Of a huge page when asked for and the system has one to give
+    char *slab = MAP_FAILED;
+    if (buffer_huge_pages) {
+        slab = mmap(NULL, BUFFER_SLAB, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
     }
-
-    int fd, count;
-    memcpy(&fd, buf + req_offsets[0], req_length[0]);
-    memcpy(&count, buf + req_offsets[1], req_length[1]);
-
-    // Response Format:
-    // | bytes read | errno  | data          |
-    // | int(4)     | int(4) | string(count) |
-    size_t res_length[3] = {sizeof(uint32_t), sizeof(uint32_t), count};
-    int res_offsets[4] = {0};
-    for (int i = 0; i < 3; i++) {
-        res_offsets[i + 1] = res_offsets[i] + res_length[i];
+    if (slab == MAP_FAILED) {
+        slab = mmap(NULL, BUFFER_SLAB, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
     }
+    if (slab == MAP_FAILED) {
+        return -1;
+    }
+    for (size_t off = BUFFER_SLAB; off >= bc->size; off -= bc->size) {
+        *(void **)(slab + off - bc->size) = bc->free;
+        bc->free = slab + off - bc->size;
+    }
+    return 0;
+}
 
-    char *data = (char*)malloc(count);
-    int bytes_read = read(fd, data, count);
+/**
+    * @brief Take a page-aligned buffer from the pool, first from the cache of the thread.
+    * @param size The number of bytes needed.
+    * @return The buffer, NULL if the size is larger than the largest class or no memory is left.
+    */
+void *bufferGet(size_t size) {
+    int c = bufferClass(size);
+    if (c == -1) {
+        return NULL;
+    }
+    struct buffer_class *bc = &buffer_classes[c];
+    void *buf;
+    if (buffer_cached[c] > 0) {
+        buf = buffer_cache[c][--buffer_cached[c]];
+        __atomic_add_fetch(&bc->hits, 1, __ATOMIC_RELAXED);
+    } else {
+        pthread_mutex_lock(&bc->lock);
+        if (bc->free != NULL) {
+            __atomic_add_fetch(&bc->hits, 1, __ATOMIC_RELAXED);
+        } else if (bufferSlab(bc) == 0) {
+            __atomic_add_fetch(&bc->misses, 1, __ATOMIC_RELAXED);
+        } else {
+            pthread_mutex_unlock(&bc->lock);
+            return NULL;
+        }
+        buf = bc->free;
+        bc->free = *(void **)buf;
+        pthread_mutex_unlock(&bc->lock);
+    }
+    unsigned long used = __atomic_add_fetch(&bc->in_use, 1, __ATOMIC_RELAXED);
+    unsigned long high = __atomic_load_n(&bc->high_water, __ATOMIC_RELAXED);
+    while (used > high && !__atomic_compare_exchange_n(&bc->high_water, &high, used, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+    return buf;
+}
 
-    memcpy(retBuf + res_offsets[0], &bytes_read, res_length[0]);
-    memcpy(retBuf + res_offsets[1], &errno, res_length[1]);
-    memcpy(retBuf + res_offsets[2], data, res_length[2]);
+/**
+    * @brief Give a buffer back to the pool, to the cache of the thread while it has room.
+    * @param buf The buffer, or NULL.
+    * @param size The size it was taken with.
+    */
+void bufferPut(void *buf, size_t size) {
+    if (buf == NULL) {
+        return;
+    }
+    int c = bufferClass(size);
+    struct buffer_class *bc = &buffer_classes[c];
+    __atomic_sub_fetch(&bc->in_use, 1, __ATOMIC_RELAXED);
+    if (buffer_cached[c] < BUFFER_CACHE) {
+        buffer_cache[c][buffer_cached[c]++] = buf;
+        return;
+    }
+    pthread_mutex_lock(&bc->lock);
+    *(void **)buf = bc->free;
+    bc->free = buf;
+    pthread_mutex_unlock(&bc->lock);
+}
 
-    if (bytes_read == -1) {
-        perror("read error");
+/**
+    * @brief Log the counters of the buffer pool.
+    */
+void bufferStats(void) {
+    fprintf(stderr, "buffer pool");
+    for (int c = 0; c < BUFFER_CLASSES; c++) {
+        struct buffer_class *bc = &buffer_classes[c];
+        fprintf(stderr, " | %zu | hits %lu | misses %lu | in use %lu | high water %lu", bc->size,
+                __atomic_load_n(&bc->hits, __ATOMIC_RELAXED), __atomic_load_n(&bc->misses, __ATOMIC_RELAXED),
+                __atomic_load_n(&bc->in_use, __ATOMIC_RELAXED), __atomic_load_n(&bc->high_water, __ATOMIC_RELAXED));
     }
-    fprintf(stderr, "handle_read | req | fd: %d | count: %d\n", fd, count);
-    fprintf(stderr, "handle_read | res | bytes_read: %d | errno: %d | data: %s\n", bytes_read, errno, data);
-    free(data);
-    return res_offsets[3];
+    fprintf(stderr, "\n");
 }
 
-/** 
-    * @brief Handle the write system call.
-    * @param buf The buffer containing the request.
-    * @param retBuf The buffer to store the response.
-    * @return The size of the response.
+/**
+    * @brief Give a session its request and response buffers, for the request it is about to receive.
+    * @return 0 if successful, -1 if no memory is left.
     */
-size_t handle_write(const char *buf, char* retBuf) {
-    fprintf(stderr, "enter func: handle_write\n");
-    // Request Format:
-    // | fd     | count  | data  |
-    // | int(4) | int(4) | count |
-    size_t req_length[3] = {sizeof(uint32_t), sizeof(uint32_t), 0};
-    int req_offsets[4] = {0};
-    for (int i = 0; i < 3; i++) {
-        req_offsets[i + 1] = req_offsets[i] + req_length[i];
+int sessionBuffers(struct session *s) {
+    if (s->in == NULL) {
+        s->in = bufferGet(MAX_MSG_LEN + 1);
+        s->out = bufferGet(MAX_MSG_LEN + 1);
     }
+    return s->in != NULL && s->out != NULL ? 0 : -1;
+}
 
-    int fd, count;
-    memcpy(&fd, buf + req_offsets[0], req_length[0]);
-    memcpy(&count, buf + req_offsets[1], req_length[1]);
-    char *data = (char*)malloc(count);
-    memcpy(data, buf + req_offsets[2], count);
+/**
+    * @brief Give the buffers of a session back to the pool, once it is done with a request.
+    */
+void sessionBuffersPut(struct session *s) {
+    bufferPut(s->in, MAX_MSG_LEN + 1);
+    bufferPut(s->out, MAX_MSG_LEN + 1);
+    s->in = s->out = NULL;
+}
 
+/**
+    * @brief An io_uring instance of an event loop, driven through the raw system calls.
+    */
+struct uring {
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned sq_local_tail;        // past the last prepared entry, published at submission
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+    char *buffers[URING_READ_BUFFERS];  // registered buffers
+    int free_buffers[URING_READ_BUFFERS];
+    int nfree;
+    int nfiles;                    // slots of the registered file table, indexed by descriptor
+};
 
-    // Response Format:
-    // | bytes written | errno  |
-    // | int(4)        | int(4) |
-    size_t res_length[2] = {sizeof(uint32_t), sizeof(uint32_t)};
-    int res_offsets[3] = {0};
-    for (int i = 0; i < 2; i++) {
-        res_offsets[i + 1] = res_offsets[i] + res_length[i];
+// Operation an io_uring completion belongs to, in the low bits of its user data
+#define URING_RECV 0
+#define URING_SEND 1
+#define URING_READ 2
+#define URING_ACCEPT 3
+#define URING_WAKE 4
+#define URING_TAG_MASK 7
+
+/**
+    * @brief Set up an io_uring with its registered read buffers and a sparse file table.
+    * @return The ring, NULL if the kernel does not support it.
+    */
+struct uring *uringCreate(int max_files) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    int fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+    if (fd == -1) {
+        return NULL;
+    }
+    struct uring *r = calloc(1, sizeof(struct uring));
+    r->fd = fd;
+    size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        sq_size = cq_size = sq_size > cq_size ? sq_size : cq_size;
     }
+    char *sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    char *cq = sq;
+    if (sq != MAP_FAILED && !(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        cq = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    }
+    r->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sq == MAP_FAILED || cq == MAP_FAILED || r->sqes == MAP_FAILED) {
+        close(fd);
+        free(r);
+        return NULL;
+    }
+    r->sq_head = (unsigned *)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    r->sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+    r->sq_entries = p.sq_entries;
+    r->sq_array = (unsigned *)(sq + p.sq_off.array);
+    r->sq_local_tail = *r->sq_tail;
+    r->cq_head = (unsigned *)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    r->cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
 
-    ssize_t bytes_written = write(fd, data, count);
-    
-    memcpy(retBuf + res_offsets[0], &bytes_written, res_length[0]);
-    memcpy(retBuf + res_offsets[1], &errno, res_length[1]);
-    if (bytes_written == -1) {
-        perror("write error");
+    // Files are read into buffers pinned once, and sent from there.
+    struct iovec iov[URING_READ_BUFFERS];
+    int nbuffers = 0;
+    while (nbuffers < URING_READ_BUFFERS && (r->buffers[nbuffers] = bufferGet(URING_READ_BUFFER_SIZE)) != NULL) {
+        iov[nbuffers].iov_base = r->buffers[nbuffers];
+        iov[nbuffers].iov_len = URING_READ_BUFFER_SIZE;
+        nbuffers++;
+    }
+    if (nbuffers > 0 && syscall(__NR_io_uring_register, fd, IORING_REGISTER_BUFFERS, iov, nbuffers) == 0) {
+        for (int i = 0; i < nbuffers; i++) {
+            r->free_buffers[r->nfree++] = i;
+        }
+    } else {
+        for (int i = 0; i < nbuffers; i++) {
+            bufferPut(r->buffers[i], URING_READ_BUFFER_SIZE);
+        }
     }
 
-    fprintf(stderr, "handle_write | req | fd %d | count %d | data %s\n", fd, count, data);
-    fprintf(stderr, "handle_write | res | bytes_written %ld | errno %d\n", bytes_written, errno);
-    return res_offsets[2];
+    // Sockets and files are registered in the slot of their descriptor, which is unique in the
+    // process, so the kernel need not look them up at every operation.
+    struct io_uring_rsrc_register files;
+    memset(&files, 0, sizeof(files));
+    files.nr = max_files;
+    files.flags = IORING_RSRC_REGISTER_SPARSE;
+    if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_FILES2, &files, sizeof(files)) == 0) {
+        r->nfiles = max_files;
+    }
+    return r;
 }
 
 /**
-    * @brief Handle the close system call.
-    * @param buf The buffer containing the request.
-    * @param retBuf The buffer to store the response.
-    * @return The size of the response.
+    * @brief Put a descriptor in its slot of the registered file table, or empty the slot with -1.
+    * @return 0 if successful, -1 if the descriptor is not registered.
     */
-size_t handle_close(const char *buf, char* retBuf) {
-    fprintf(stderr, "enter func: handle_close\n");
-    // Request Format:
-    // | fd     |
-    // | int(4) |
-    size_t req_length[1] = {sizeof(uint32_t)};
-    int req_offsets[2] = {0};
-    for (int i = 0; i < 1; i++) {
-        req_offsets[i + 1] = req_offsets[i] + req_length[i];
+int uringRegister(struct uring *r, int slot, int fd) {
+    if (slot < 0 || slot >= r->nfiles) {
+        return -1;
     }
+    struct io_uring_files_update update;
+    memset(&update, 0, sizeof(update));
+    update.offset = slot;
+    update.fds = (uint64_t)(uintptr_t)&fd;
+    return syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_FILES_UPDATE, &update, 1) == 1 ? 0 : -1;
+}
 
-    int fd;
-    memcpy(&fd, buf + req_offsets[0], req_length[0]);
+/**
+    * @brief Submit the prepared entries, and wait for a completion if asked to.
+    */
+void uringSubmit(struct uring *r, int wait) {
+    unsigned pending = r->sq_local_tail - *r->sq_tail;
+    __atomic_store_n(r->sq_tail, r->sq_local_tail, __ATOMIC_RELEASE);
+    int rv;
+    do {
+        rv = syscall(__NR_io_uring_enter, r->fd, pending, wait ? 1 : 0, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        pending = 0;
+    } while (rv == -1 && errno == EINTR && wait);
+}
 
-    // | success | errno  |
-    // | int(4)  | int(4) |
-    size_t res_length[2] = {sizeof(uint32_t), sizeof(uint32_t)};
-    int res_offsets[3] = {0};
-    for (int i = 0; i < 2; i++) {
-        res_offsets[i + 1] = res_offsets[i] + res_length[i];
+/**
+    * @brief Prepare the next submission queue entry, submitted with the others by uringSubmit.
+    */
+struct io_uring_sqe *uringSqe(struct uring *r, int op, int fd, int fixed, uint64_t user_data) {
+    if (r->sq_local_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) == r->sq_entries) {
+        uringSubmit(r, 0);
     }
-    int success = close(fd);
-    memcpy(retBuf + res_offsets[0], &success, res_length[0]);
-    memcpy(retBuf + res_offsets[1], &errno, res_length[1]);
-    if (success != 0) {
-        perror("close error");
+    unsigned index = r->sq_local_tail & r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = op;
+    sqe->user_data = user_data;
+    sqe->fd = fd;
+    if (fixed) {
+        sqe->flags |= IOSQE_FIXED_FILE;
     }
-    fprintf(stderr, "handle_close | req | fd %d\n", fd);
-    fprintf(stderr, "handle_close | res | success %d | errno %d\n", success, errno);
-    return res_offsets[2];
+    r->sq_array[index] = index;
+    r->sq_local_tail++;
+    return sqe;
 }
 
 /**
-    * @brief Handle the lseek system call.
-    * @param buf The buffer containing the request.
-    * @param retBuf The buffer to store the response.
-    * @return The size of the response.
+    * @brief Receive the next request of a session with the io_uring engine.
+    * @details The receive holds the buffers of the session until a request arrives, so unlike with
+    * epoll they stay with the session from one request to the next.
+    * @return 0 if successful, -1 if no buffers are left for the session.
     */
-size_t handle_lseek(const char *buf, char* retBuf) {
-    fprintf(stderr, "enter func: handle_lseek\n");
-    // Request Format:
-    // | fd     | offset | whence |
-    // | int(4) | int(8) | int(4) |
-    size_t req_length[3] = {sizeof(uint32_t), sizeof(uint64_t), sizeof(uint32_t)};
-    int req_offsets[4] = {0};
-    for (int i = 0; i < 3; i++) {
-        req_offsets[i + 1] = req_offsets[i] + req_length[i];
+int uringRecv(struct session *s) {
+    if (sessionBuffers(s) == -1) {
+        fprintf(stderr, "server out of buffers\n");
+        return -1;
     }
+    struct io_uring_sqe *sqe = uringSqe(s->loop->ring, IORING_OP_RECV, s->sock, s->registered, (uint64_t)(uintptr_t)s | URING_RECV);
+    sqe->addr = (uint64_t)(uintptr_t)s->in;
+    sqe->len = MAX_MSG_LEN;
+    return 0;
+}
 
-    int fd;
-    off_t offset;
-    int whence;
-    memcpy(&fd, buf + req_offsets[0], req_length[0]);
-    memcpy(&offset, buf + req_offsets[1], req_length[1]);
-    memcpy(&whence, buf + req_offsets[2], req_length[2]);
+/**
+    * @brief Send the rest of the response of a session with the io_uring engine.
+    */
+void uringSend(struct session *s) {
+    struct io_uring_sqe *sqe;
+    if (s->read_buffer == -1) {
+        sqe = uringSqe(s->loop->ring, IORING_OP_SEND, s->sock, s->registered, (uint64_t)(uintptr_t)s | URING_SEND);
+        sqe->addr = (uint64_t)(uintptr_t)(s->out + s->out_sent);
+        sqe->len = s->out_len - s->out_sent;
+    } else {
+        // The response of a read run by the loop: its header, then the registered buffer.
+        size_t header = sizeof(s->read_header);
+        struct iovec *iov = s->read_iov;
+        int n = 0;
+        if (s->out_sent < header) {
+            iov[n].iov_base = s->read_header + s->out_sent;
+            iov[n++].iov_len = header - s->out_sent;
+        }
+        size_t data_sent = s->out_sent > header ? s->out_sent - header : 0;
+        iov[n].iov_base = s->loop->ring->buffers[s->read_buffer] + data_sent;
+        iov[n++].iov_len = s->out_len - header - data_sent;
+        memset(&s->read_msg, 0, sizeof(s->read_msg));
+        s->read_msg.msg_iov = iov;
+        s->read_msg.msg_iovlen = n;
+        sqe = uringSqe(s->loop->ring, IORING_OP_SENDMSG, s->sock, s->registered, (uint64_t)(uintptr_t)s | URING_SEND);
+        sqe->addr = (uint64_t)(uintptr_t)&s->read_msg;
+        sqe->len = 1;
+    }
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+}
 
-    // Response Format:
-    // | new offset | errno  |
-    // | int(8)     | int(4) |
-    size_t res_length[2] = {sizeof(uint64_t), sizeof(uint32_t)};
-    int res_offsets[3] = {0};
+/**
+    * @brief Wait until the session socket can be read or written.
+    * @param events POLLIN or POLLOUT.
+    * @return 0 if it can, -1 if the client went away or did not make progress in time.
+    */
+int sessionWait(short events) {
+    struct pollfd pfd = {sessfd, events, 0};
+    int rv;
+    do {
+        rv = poll(&pfd, 1, SESSION_IO_TIMEOUT_MS);
+    } while (rv == -1 && errno == EINTR);
+    return rv == 1 && !(pfd.revents & (POLLERR | POLLNVAL)) ? 0 : -1;
+}
+
+/**
+    * @brief Read the next bytes of the current request payload.
+    * @details Requests larger than MAX_MSG_LEN are not received in one piece by the event loop.
+    * Bytes the event loop already has in buf are copied first, the rest is received from the session.
+    * @param buf The buffer containing the request.
+    * @param pos The offset of the next unread payload byte, advanced by n.
+    * @param dst The buffer to store the bytes, or NULL to discard them.
+    * @param n The number of bytes to read.
+    * @return 0 if successful, -1 if the client went away.
+    */
+int recvPayload(const char *buf, size_t *pos, void *dst, size_t n) {
+    char scratch[MAX_MSG_LEN];
+    size_t done = 0;
+    if (*pos < req_avail) {
+        done = req_avail - *pos < n ? req_avail - *pos : n;
+        if (dst != NULL) memcpy(dst, buf + *pos, done);
+    }
+    while (done < n) {
+        size_t want = n - done;
+        char *p = scratch;
+        if (dst != NULL) p = (char *)dst + done;
+        else if (want > sizeof(scratch)) want = sizeof(scratch);
+        ssize_t rv = recv(sessfd, p, want, 0);
+        if (rv == -1 && (errno == EAGAIN || errno == EINTR) && sessionWait(POLLIN) == 0) {
+            continue;
+        }
+        if (rv <= 0) {
+            fprintf(stderr, "server recv payload failed\n");
+            return -1;
+        }
+        done += rv;
+    }
+    *pos += n;
+    return 0;
+}
+
+/**
+    * @brief Send a response that does not fit in the MAX_MSG_LEN response buffer.
+    * @param buf The data to send.
+    * @param len The number of bytes.
+    * @return 0 if successful, -1 if error.
+    */
+int sendResponse(const void *buf, size_t len) {
+    size_t sent = 0;
+    while (sent < len) {
+        ssize_t rv = send(sessfd, (const char *)buf + sent, len - sent, MSG_NOSIGNAL);
+        if (rv == -1 && (errno == EAGAIN || errno == EINTR) && sessionWait(POLLOUT) == 0) {
+            continue;
+        }
+        if (rv <= 0) {
+            fprintf(stderr, "server send failed\n");
+            return -1;
+        }
+        sent += rv;
+    }
+    return 0;
+}
+
+/**
+    * @brief Allocate memory for the request being handled, from the arena of the session.
+    * @details The memory lives until the response is sent and is not freed by the handler.
+    * @param n The number of bytes.
+    * @return The memory, aligned for any type.
+    */
+void *requestAlloc(size_t n) {
+    struct arena *a = &session->arena;
+    n = (n + 15) & ~(size_t)15;
+    struct arena_block *b = a->blocks;
+    if (b == NULL || b->size - b->used < n) {
+        size_t size = b != NULL ? 2 * b->size : ARENA_BLOCK;
+        if (size < n) size = n;
+        b = malloc(sizeof(struct arena_block) + size);
+        b->next = a->blocks;
+        b->size = size;
+        b->used = 0;
+        a->blocks = b;
+    }
+    void *p = b->data + b->used;
+    b->used += n;
+    return p;
+}
+
+/**
+    * @brief Give back all memory of the request, once its response is sent.
+    * @details The largest block up to ARENA_KEEP is kept for the next request, so a session in a
+    * steady state of requests does not call malloc.
+    * @param keep Whether to keep a block, not when the session ends.
+    */
+void arenaReset(struct arena *a, int keep) {
+    struct arena_block *kept = NULL;
+    struct arena_block *b = a->blocks;
+    while (b != NULL) {
+        struct arena_block *next = b->next;
+        if (keep && b->size <= ARENA_KEEP && (kept == NULL || b->size > kept->size)) {
+            free(kept);
+            kept = b;
+        } else {
+            free(b);
+        }
+        b = next;
+    }
+    if (kept != NULL) {
+        kept->next = NULL;
+        kept->used = 0;
+    }
+    a->blocks = kept;
+}
+
+/**
+    * @brief Server file descriptor of a handle of the session.
+    * @return The descriptor, or -1 for a handle the session does not hold, which fails with EBADF.
+    */
+int sessionFile(int handle) {
+    if (handle < 0 || handle >= session->nfiles) {
+        return -1;
+    }
+    return session->files[handle].fd;
+}
+
+/**
+    * @brief Bucket of the open file cache of a file and open flags.
+    */
+struct open_file **openCacheBucket(dev_t dev, ino_t ino, int flags) {
+    uint64_t h = ((uint64_t)dev * 31 + (uint64_t)ino) * 31 + (uint64_t)flags;
+    return &open_cache[h % OPEN_CACHE_BUCKETS];
+}
+
+/**
+    * @brief Close an idle description of the open file cache. Called with the cache locked.
+    */
+void openCacheEvict(struct open_file *of) {
+    struct open_file **p = openCacheBucket(of->dev, of->ino, of->flags);
+    while (*p != of) {
+        p = &(*p)->next;
+    }
+    *p = of->next;
+    if (of->lru_prev != NULL) of->lru_prev->lru_next = of->lru_next;
+    else open_cache_lru = of->lru_next;
+    if (of->lru_next != NULL) of->lru_next->lru_prev = of->lru_prev;
+    else open_cache_mru = of->lru_prev;
+    open_cache_idle--;
+    close(of->fd);
+    free(of);
+}
+
+/**
+    * @brief Take a handle on the cached description of a file, if there is one. Called with the
+    * cache locked.
+    */
+struct open_file *openCacheTake(dev_t dev, ino_t ino, int flags) {
+    struct open_file *of = *openCacheBucket(dev, ino, flags);
+    while (of != NULL && !(of->dev == dev && of->ino == ino && of->flags == flags)) {
+        of = of->next;
+    }
+    if (of != NULL && of->refs++ == 0) {
+        if (of->lru_prev != NULL) of->lru_prev->lru_next = of->lru_next;
+        else open_cache_lru = of->lru_next;
+        if (of->lru_next != NULL) of->lru_next->lru_prev = of->lru_prev;
+        else open_cache_mru = of->lru_prev;
+        open_cache_idle--;
+    }
+    return of;
+}
+
+/**
+    * @brief Open a file, from the open file cache if it is a regular file opened read-only.
+    * @details A description some session already has open, or one kept idle, is taken with a lookup
+    * instead of an open. Sessions sharing it keep their own file offsets, see sessionRead.
+    * @param shared Set to the cached description, or NULL if the file was opened for the session alone.
+    * @return The file descriptor, or -1 with errno set.
+    */
+int openCached(const char *pathname, int flags, mode_t mode, struct open_file **shared) {
+    *shared = NULL;
+    struct stat st;
+    if (open_cache_budget <= 0 || (flags & ~(O_CLOEXEC | O_LARGEFILE | O_NOCTTY)) != O_RDONLY ||
+        stat(pathname, &st) == -1 || !S_ISREG(st.st_mode)) {
+        return open(pathname, flags, mode);
+    }
+    pthread_mutex_lock(&open_cache_lock);
+    struct open_file *of = openCacheTake(st.st_dev, st.st_ino, flags);
+    pthread_mutex_unlock(&open_cache_lock);
+    if (of != NULL) {
+        *shared = of;
+        return of->fd;
+    }
+
+    // Not cached: open it, and cache it unless the path now names another file.
+    int fd = open(pathname, flags, mode);
+    struct stat opened;
+    if (fd == -1 || fstat(fd, &opened) == -1 || opened.st_dev != st.st_dev || opened.st_ino != st.st_ino) {
+        return fd;
+    }
+    pthread_mutex_lock(&open_cache_lock);
+    of = openCacheTake(st.st_dev, st.st_ino, flags);
+    if (of != NULL) {
+        // Another session opened it meanwhile.
+        pthread_mutex_unlock(&open_cache_lock);
+        close(fd);
+        *shared = of;
+        return of->fd;
+    }
+    struct open_file **bucket = openCacheBucket(st.st_dev, st.st_ino, flags);
+    of = calloc(1, sizeof(struct open_file));
+    of->dev = st.st_dev;
+    of->ino = st.st_ino;
+    of->flags = flags;
+    of->fd = fd;
+    of->refs = 1;
+    of->next = *bucket;
+    *bucket = of;
+    pthread_mutex_unlock(&open_cache_lock);
+    *shared = of;
+    return fd;
+}
+
+/**
+    * @brief Give back a handle on a cached description. Once no session has it, it stays open
+    * idle, until more than the budget of descriptors are idle and it is the least recently used.
+    */
+void openCacheRelease(struct open_file *of) {
+    pthread_mutex_lock(&open_cache_lock);
+    if (--of->refs == 0) {
+        of->lru_next = NULL;
+        of->lru_prev = open_cache_mru;
+        if (open_cache_mru != NULL) open_cache_mru->lru_next = of;
+        else open_cache_lru = of;
+        open_cache_mru = of;
+        open_cache_idle++;
+        while (open_cache_idle > open_cache_budget) {
+            openCacheEvict(open_cache_lru);
+        }
+    }
+    pthread_mutex_unlock(&open_cache_lock);
+}
+
+/**
+    * @brief Close the idle cached descriptions of a file about to be opened for writing.
+    * @details A write delegation is only granted when no other description of the file is open.
+    */
+void openCacheDrop(const char *pathname) {
+    struct stat st;
+    if (open_cache_idle == 0 || stat(pathname, &st) == -1) {
+        return;
+    }
+    pthread_mutex_lock(&open_cache_lock);
+    struct open_file *of = open_cache_lru;
+    while (of != NULL) {
+        struct open_file *next = of->lru_next;
+        if (of->dev == st.st_dev && of->ino == st.st_ino) {
+            openCacheEvict(of);
+        }
+        of = next;
+    }
+    pthread_mutex_unlock(&open_cache_lock);
+}
+
+/**
+    * @brief Read from a handle of the session at its file offset, and advance it.
+    * @details A handle on a cached description keeps its offset itself, as other sessions share
+    * the one of the description.
+    */
+ssize_t sessionRead(int handle, void *data, size_t count) {
+    int fd = sessionFile(handle);
+    if (fd == -1 || session->files[handle].shared == NULL) {
+        return read(fd, data, count);
+    }
+    ssize_t n = pread(fd, data, count, session->files[handle].offset);
+    if (n > 0) {
+        session->files[handle].offset += n;
+    }
+    return n;
+}
+
+/**
+    * @brief Move the file offset of a handle of the session, as lseek does.
+    */
+off_t sessionSeek(int handle, off_t offset, int whence) {
+    int fd = sessionFile(handle);
+    if (fd == -1 || session->files[handle].shared == NULL) {
+        return lseek(fd, offset, whence);
+    }
+    off_t base;
+    struct stat st;
+    if (whence == SEEK_SET) {
+        base = 0;
+    } else if (whence == SEEK_CUR) {
+        base = session->files[handle].offset;
+    } else if (whence == SEEK_END) {
+        if (fstat(fd, &st) == -1) return -1;
+        base = st.st_size;
+    } else {
+        // SEEK_DATA and SEEK_HOLE look from the offset given, not the one of the description.
+        off_t found = lseek(fd, offset, whence);
+        if (found != -1) session->files[handle].offset = found;
+        return found;
+    }
+    if (base + offset < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    session->files[handle].offset = base + offset;
+    return base + offset;
+}
+
+/**
+    * @brief Give a file just opened a handle of the session, the lowest free one.
+    * @param shared The cached description the file is, or NULL.
+    */
+int sessionAdd(int fd, struct open_file *shared) {
+    int handle = 0;
+    while (handle < session->nfiles && session->files[handle].fd != -1) {
+        handle++;
+    }
+    if (handle == session->nfiles) {
+        int n = session->nfiles > 0 ? 2 * session->nfiles : 16;
+        session->files = realloc(session->files, n * sizeof(struct session_file));
+        for (int i = session->nfiles; i < n; i++) {
+            session->files[i].fd = -1;
+            session->files[i].delegated = 0;
+            session->files[i].registered = 0;
+            session->files[i].shared = NULL;
+        }
+        session->nfiles = n;
+    }
+    session->files[handle].fd = fd;
+    session->files[handle].shared = shared;
+    session->files[handle].offset = 0;
+    return handle;
+}
+
+/**
+    * @brief Tell the client to give its write delegations back.
+    * @details Sent as one byte of urgent data, which reaches the client without disturbing the
+    * responses. One recall covers every delegation, so it is sent once until they are all back.
+    * A second urgent byte sent before the client read past the first would turn the first into
+    * response data, see sessionRequest.
+    * Called from the lease break signal handler, so only async-signal-safe calls are made.
+    */
+void recallDelegations(struct session *s) {
+    if (!s->recall_sent) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        s->recall_deadline = (now.tv_sec + RECALL_TIMEOUT_SEC) * 1000000000LL + now.tv_nsec;
+        s->recall_sent = 1;
+        send(s->sock, "R", 1, MSG_OOB | MSG_NOSIGNAL);
+        alarm(RECALL_TIMEOUT_SEC);
+    }
+}
+
+/**
+    * @brief Find the session whose lease on a file broke, and recall its delegations.
+    */
+void leaseBroken(int sig, siginfo_t *info, void *context) {
+    int fd = info->si_fd;
+    struct session *s = fd >= 0 && fd < lease_capacity ? lease_sessions[fd] : NULL;
+    if (s != NULL) {
+        recallDelegations(s);
+    }
+}
+
+/**
+    * @brief Drop the leases of clients that did not answer a recall in time.
+    * @details A client only handles a recall when the program makes a call, so an idle one would
+    * hold up the other opener for the whole lease break time of the system. The client still
+    * buffers, and sends its writes after the other opener had its go.
+    * The alarm is shared by all sessions, so it is set again while some recall is still running.
+    */
+void recallExpired(int sig) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    // The alarm has a resolution of a second, recalls due before the next one are taken back now.
+    int64_t limit = (now.tv_sec + 1) * 1000000000LL + now.tv_nsec - 1000000;
+    int pending = 0;
+    for (int fd = 0; fd < lease_capacity; fd++) {
+        struct session *s = lease_sessions[fd];
+        if (s == NULL || !s->recall_sent) {
+            continue;
+        }
+        if (s->recall_deadline <= limit) {
+            fcntl(fd, F_SETLEASE, F_UNLCK);
+        } else {
+            pending = 1;
+        }
+    }
+    if (pending) {
+        alarm(1);
+    }
+}
+
+/**
+    * @brief Try to grant a write delegation on a file just opened for the client.
+    * @details A write lease is only granted if no other open file description of the file exists,
+    * here or in any other process, so the client is the only writer and reader.
+    * @return 1 if granted, 0 if not.
+    */
+int grantDelegation(int handle) {
+    int fd = sessionFile(handle);
+    if (fd < 0 || fd >= lease_capacity || export_readonly) {
+        return 0;
+    }
+    // The signal names the descriptor, which leads to the session.
+    lease_sessions[fd] = session;
+    if (fcntl(fd, F_SETSIG, SIGIO) == -1 || fcntl(fd, F_SETLEASE, F_WRLCK) == -1) {
+        lease_sessions[fd] = NULL;
+        return 0;
+    }
+    session->files[handle].delegated = 1;
+    session->delegations++;
+    return 1;
+}
+
+/**
+    * @brief End the write delegation of a handle, if it has one.
+    */
+void endDelegation(int handle) {
+    int fd = sessionFile(handle);
+    if (fd == -1 || !session->files[handle].delegated) {
+        return;
+    }
+    fcntl(fd, F_SETLEASE, F_UNLCK);
+    lease_sessions[fd] = NULL;
+    session->files[handle].delegated = 0;
+    session->delegations--;
+}
+
+/**
+    * @brief Close a handle of the session. A cached description is given back to the cache instead.
+    */
+int sessionClose(int handle) {
+    int fd = sessionFile(handle);
+    endDelegation(handle);
+    if (fd != -1) {
+        if (session->files[handle].registered) {
+            uringRegister(session->loop->ring, fd, -1);
+            session->files[handle].registered = 0;
+        }
+        session->files[handle].fd = -1;
+        if (session->files[handle].shared != NULL) {
+            openCacheRelease(session->files[handle].shared);
+            session->files[handle].shared = NULL;
+            return 0;
+        }
+    }
+    return close(fd);
+}
+
+/**
+    * @brief Give back the delegations of a file the client is opening again.
+    * @details Opening it here would break our own lease and wait for the lease break time,
+    * as the client cannot answer a recall while it waits for the open.
+    */
+void endDelegationsOf(const char *pathname) {
+    struct stat st, held;
+    if (session->delegations == 0 || stat(pathname, &st) == -1) {
+        return;
+    }
+    for (int handle = 0; handle < session->nfiles; handle++) {
+        if (session->files[handle].delegated && fstat(session->files[handle].fd, &held) == 0 &&
+            held.st_ino == st.st_ino && held.st_dev == st.st_dev) {
+            endDelegation(handle);
+            // The client still buffers for it, and learns of the loss as from a recall.
+            recallDelegations(session);
+        }
+    }
+}
+
+/**
+    * @brief Split a path into the directory holding it and its name there.
+    * @return 1 if the directory and the name give back the path as written, 0 for forms like
+    * "./a" or "a/" that a change in the directory would not be reported under.
+    */
+int splitPath(const char *pathname, char *dir, const char **name) {
+    const char *slash = strrchr(pathname, '/');
+    if (slash == NULL) {
+        strcpy(dir, ".");
+        *name = pathname;
+        return strcmp(pathname, ".") != 0 && strcmp(pathname, "..") != 0 && pathname[0] != '\0';
+    }
+    size_t len = slash - pathname;
+    if (len == 0) len = 1;
+    memcpy(dir, pathname, len);
+    dir[len] = '\0';
+    *name = slash + 1;
+    return (slash == pathname || slash[-1] != '/') && strcmp(dir, ".") != 0 &&
+           strcmp(*name, ".") != 0 && strcmp(*name, "..") != 0 && (*name)[0] != '\0';
+}
+
+/**
+    * @brief Watch a path for the client, under the callbacks lock.
+    * @return The watch descriptor, or -1 if the path cannot be watched under this name, including
+    * when its inode is already watched under another one, as through a hard link.
+    */
+int callbackAdd(struct callbacks *cb, const char *path, uint32_t mask) {
+    int wd = inotify_add_watch(cb->inotify, path, mask | IN_MASK_ADD);
+    if (wd == -1) {
+        return -1;
+    }
+    if (wd >= cb->watch_cap) {
+        int cap = cb->watch_cap > 0 ? cb->watch_cap : 1024;
+        while (cap <= wd) cap *= 2;
+        cb->watches = realloc(cb->watches, cap * sizeof(struct callback_watch));
+        memset(cb->watches + cb->watch_cap, 0, (cap - cb->watch_cap) * sizeof(struct callback_watch));
+        cb->watch_cap = cap;
+    }
+    struct callback_watch *w = &cb->watches[wd];
+    if (w->path == NULL) {
+        w->path = strdup(path);
+    } else if (strcmp(w->path, path) != 0) {
+        errno = EEXIST;
+        return -1;
+    }
+    w->armed = 1;
+    return wd;
+}
+
+/**
+    * @brief Promise the client to tell it when a path changes, before the server looks at it.
+    * @details The file is watched for writes and attribute changes, the directory holding it for
+    * names created, removed or renamed, so a name that does not exist yet is covered too. A path
+    * that cannot be watched is reported as changed at once, and the client does not keep it.
+    * Watching first means any change after the server looked is reported.
+    */
+void callbackWatch(const char *pathname) {
+    struct callbacks *cb = session->callbacks;
+    if (cb == NULL) {
+        return;
+    }
+    char dir[PATH_MAX];
+    const char *name;
+    int ok = strlen(pathname) < sizeof(dir) && splitPath(pathname, dir, &name);
+    pthread_mutex_lock(&cb->lock);
+    if (ok && callbackAdd(cb, pathname, CALLBACK_FILE_EVENTS) == -1 && errno != ENOENT) {
+        ok = 0;
+    }
+    if (ok && callbackAdd(cb, dir, CALLBACK_DIR_EVENTS) == -1) {
+        ok = 0;
+    }
+    if (!ok) {
+        struct callback_break *b = malloc(sizeof(struct callback_break) + strlen(pathname) + 1);
+        strcpy(b->path, pathname);
+        b->next = cb->breaks;
+        cb->breaks = b;
+    }
+    pthread_mutex_unlock(&cb->lock);
+    if (!ok) {
+        write(cb->wake[1], "w", 1);
+    }
+}
+
+/**
+    * @brief Add a path to the invalidations to send.
+    */
+void callbackQueue(char **msg, size_t *len, size_t *cap, const char *path) {
+    uint32_t path_len = strlen(path);
+    if (*len + sizeof(uint32_t) + path_len > *cap) {
+        *cap = (*len + sizeof(uint32_t) + path_len) * 2;
+        *msg = realloc(*msg, *cap);
+    }
+    memcpy(*msg + *len, &path_len, sizeof(uint32_t));
+    memcpy(*msg + *len + sizeof(uint32_t), path, path_len);
+    *len += sizeof(uint32_t) + path_len;
+}
+
+/**
+    * @brief Turn inotify events into invalidations, under the callbacks lock.
+    * @details A change to a watched file is sent once, until the client learns the file again.
+    * A change of a name in a watched directory is sent for the name and for the directory.
+    */
+void callbackEvents(struct callbacks *cb, const char *events, ssize_t n, char **msg, size_t *len, size_t *cap) {
+    char path[PATH_MAX + NAME_MAX + 2];
+    for (ssize_t pos = 0; pos < n; ) {
+        const struct inotify_event *ev = (const struct inotify_event *)(events + pos);
+        pos += sizeof(struct inotify_event) + ev->len;
+        if (ev->mask & IN_Q_OVERFLOW) {
+            // Events were lost, so everything the client holds may be stale.
+            callbackQueue(msg, len, cap, "");
+            continue;
+        }
+        if (ev->wd < 0 || ev->wd >= cb->watch_cap || cb->watches[ev->wd].path == NULL) {
+            continue;
+        }
+        struct callback_watch *w = &cb->watches[ev->wd];
+        if (ev->len > 0) {
+            if (strcmp(w->path, ".") == 0) snprintf(path, sizeof(path), "%s", ev->name);
+            else if (strcmp(w->path, "/") == 0) snprintf(path, sizeof(path), "/%s", ev->name);
+            else snprintf(path, sizeof(path), "%s/%s", w->path, ev->name);
+            callbackQueue(msg, len, cap, path);
+            callbackQueue(msg, len, cap, w->path);
+        } else if (w->armed && !(ev->mask & IN_IGNORED)) {
+            callbackQueue(msg, len, cap, w->path);
+            w->armed = 0;
+        }
+        if (ev->mask & IN_IGNORED) {
+            free(w->path);
+            w->path = NULL;
+        }
+    }
+}
+
+/**
+    * @brief Free the callbacks of a session.
+    */
+void callbackFree(struct callbacks *cb) {
+    close(cb->inotify);
+    close(cb->wake[0]);
+    close(cb->wake[1]);
+    if (cb->ctl != -1) close(cb->ctl);
+    for (int wd = 0; wd < cb->watch_cap; wd++) {
+        free(cb->watches[wd].path);
+    }
+    free(cb->watches);
+    while (cb->breaks != NULL) {
+        struct callback_break *b = cb->breaks;
+        cb->breaks = b->next;
+        free(b);
+    }
+    pthread_mutex_destroy(&cb->lock);
+    free(cb);
+}
+
+/**
+    * @brief Thread of a session with callbacks, sending invalidations on the control connection.
+    * @details Only this thread sends on it, and it does not hold the callbacks lock while it does,
+    * so a client slow to read its invalidations never holds up the requests of the session.
+    * It runs until the session ends. Should the control connection fail, invalidations are dropped
+    * from then on, and the client, which sees the failure, trusts nothing it kept.
+    */
+void *callbackThread(void *arg) {
+    struct callbacks *cb = arg;
+    char events[64 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+    char *msg = NULL;
+    size_t cap = 0;
+    int broken = 0;
+    while (1) {
+        struct pollfd fds[2] = {{cb->inotify, POLLIN, 0}, {cb->wake[0], POLLIN, 0}};
+        if (poll(fds, 2, -1) == -1 && errno != EINTR) {
+            break;
+        }
+        size_t len = 0;
+        pthread_mutex_lock(&cb->lock);
+        int stop = cb->stop;
+        ssize_t n;
+        while ((n = read(cb->inotify, events, sizeof(events))) > 0) {
+            callbackEvents(cb, events, n, &msg, &len, &cap);
+        }
+        char drain[64];
+        while (read(cb->wake[0], drain, sizeof(drain)) > 0);
+        while (cb->breaks != NULL) {
+            struct callback_break *b = cb->breaks;
+            cb->breaks = b->next;
+            callbackQueue(&msg, &len, &cap, b->path);
+            free(b);
+        }
+        pthread_mutex_unlock(&cb->lock);
+        if (stop) {
+            break;
+        }
+        size_t sent = 0;
+        while (!broken && sent < len) {
+            ssize_t rv = send(cb->ctl, msg + sent, len - sent, MSG_NOSIGNAL);
+            if (rv <= 0) {
+                fprintf(stderr, "server callback send failed\n");
+                broken = 1;
+                break;
+            }
+            sent += rv;
+        }
+    }
+    free(msg);
+    callbackFree(cb);
+    return NULL;
+}
+
+/**
+    * @brief End the callbacks of a session that ends.
+    */
+void callbackEnd(struct callbacks *cb) {
+    pthread_mutex_lock(&callbacks_waiting_lock);
+    int attached = cb->attached;
+    if (!attached) {
+        for (struct callbacks **p = &callbacks_waiting; *p != NULL; p = &(*p)->next) {
+            if (*p == cb) {
+                *p = cb->next;
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&callbacks_waiting_lock);
+    if (!attached) {
+        callbackFree(cb);
+        return;
+    }
+    // The callback thread frees it.
+    pthread_mutex_lock(&cb->lock);
+    cb->stop = 1;
+    pthread_mutex_unlock(&cb->lock);
+    write(cb->wake[1], "s", 1);
+}
+
+/**
+    * @brief Handle the open system call.
+    * @param buf The buffer containing the request.
+    * @param retBuf The buffer to store the response.
+    * @return The size of the response.
+    */
+size_t handle_open(const char *buf, char* retBuf) {
+    fprintf(stderr, "enter func: handle_open\n");
+    // Request Format:
+    // | pathname length | pathname    | flags  | mode      | delegate |
+    // | int(4)          | c_string(n) | int(4) | mode_t(4) | int(4)   |
+    size_t req_length[5] = {sizeof(uint32_t), 0, sizeof(uint32_t), sizeof(uint32_t), sizeof(uint32_t)};
+    int req_offsets[6] = {0};
+    memcpy(&req_length[1], buf + req_offsets[0], req_length[0]);
+    for (int i = 0; i < 5; i++) { 
+        req_offsets[i + 1] = req_offsets[i] + req_length[i];
+    }
+
+    char *pathname = requestAlloc(req_length[1] + 1);
+    memcpy(pathname, buf + req_offsets[1], req_length[1]);
+    pathname[req_length[1]] = '\0';
+    int flags;
+    memcpy(&flags, buf + req_offsets[2], req_length[2]);
+    mode_t mode;
+    memcpy(&mode, buf + req_offsets[3], req_length[3]);
+    int delegate;
+    memcpy(&delegate, buf + req_offsets[4], req_length[4]);
+
+    endDelegationsOf(pathname);
+    callbackWatch(pathname);
+    int fd;
+    struct open_file *shared = NULL;
+    if (export_readonly && ((flags & O_ACCMODE) != O_RDONLY || (flags & O_TRUNC))) {
+        fd = -1;
+        errno = EROFS;
+    } else if (export_readonly && (flags & O_CREAT)) {
+        // Opening an existing file is fine, creating one is not.
+        fd = openCached(pathname, flags & ~(O_CREAT | O_EXCL), mode, &shared);
+        if (fd == -1 && errno == ENOENT) errno = EROFS;
+    } else {
+        if (delegate && (flags & O_ACCMODE) == O_WRONLY) {
+            openCacheDrop(pathname);
+        }
+        fd = openCached(pathname, flags, mode, &shared);
+    }
+
+    // Response Format:
+    // | fd     | errno  | delegated |
+    // | int(4) | int(4) | int(4)    |
+    // The fd is the handle of the file in the session.
+    int error = errno;
+    int handle = fd == -1 ? -1 : sessionAdd(fd, shared);
+    int delegated = handle != -1 && delegate && (flags & O_ACCMODE) == O_WRONLY && grantDelegation(handle);
+    memcpy(retBuf, &handle, sizeof(int));
+    memcpy(retBuf + sizeof(int), &error, sizeof(int));
+    memcpy(retBuf + 2 * sizeof(int), &delegated, sizeof(int));
+    if (fd == -1) {
+        perror("open error");
+    }
+    fprintf(stderr, "handle_open | req | pathname %s | flag %d | mode %d\n", pathname, flags, mode);
+    fprintf(stderr, "handle_open | ret | fd %d | handle %d | errno %d | delegated %d\n", fd, handle, error, delegated);
+    return 3 * sizeof(int);
+}
+
+/**
+    * @brief Handle the read system call.
+    * @param buf The buffer containing the request.
+    * @param retBuf The buffer to store the response.
+    * @return The size of the response.
+    */
+size_t handle_read(const char *buf, char* retBuf) {
+    fprintf(stderr, "enter func: handle_read\n");
+    // Define the format of the message.
+    // Extendability: We can add more fields to the message by adding more offsets and updating totalSize.
+    // Request Format:
+    // | fd     | count  |
+    // | int(4) | int(4) |
+    size_t req_length[2] = {4, 4};
+    int req_offsets[3] = {0};
+    for (int i = 0; i < 2; i++) {
+        req_offsets[i + 1] = req_offsets[i] + req_length[i];
+    }
+
+    int handle, fd, count;
+    memcpy(&handle, buf + req_offsets[0], req_length[0]);
+    fd = sessionFile(handle);
+    memcpy(&count, buf + req_offsets[1], req_length[1]);
+
+    // Response Format:
+    // | bytes read | errno  | data               |
+    // | int(4)     | int(4) | string(bytes read) |
+    // The file is read straight into the response frame, after the header, which is filled in once
+    // the read returns. Frames larger than the response buffer are taken from the pool, or the
+    // arena when larger than the largest class, and sent from there.
+    if (count < 0) count = 0;
+    size_t res_length[3] = {sizeof(uint32_t), sizeof(uint32_t), count};
+    int res_offsets[4] = {0};
+    for (int i = 0; i < 3; i++) {
+        res_offsets[i + 1] = res_offsets[i] + res_length[i];
+    }
+    char *frame = retBuf;
+    char *pooled = NULL;
+    if ((size_t)res_offsets[3] > MAX_MSG_LEN) {
+        pooled = bufferGet(res_offsets[3]);
+        frame = pooled != NULL ? pooled : (char*)requestAlloc(res_offsets[3]);
+    }
+    errno = 0;
+    int bytes_read = sessionRead(handle, frame + res_offsets[2], count);
+    memcpy(frame + res_offsets[0], &bytes_read, res_length[0]);
+    memcpy(frame + res_offsets[1], &errno, res_length[1]);
+
+    if (bytes_read == -1) {
+        perror("read error");
+    }
+    fprintf(stderr, "handle_read | req | fd: %d | count: %d\n", fd, count);
+    fprintf(stderr, "handle_read | res | bytes_read: %d | errno: %d\n", bytes_read, errno);
+    size_t retLen = res_offsets[2] + (bytes_read > 0 ? bytes_read : 0);
+    if (frame != retBuf) {
+        sendResponse(frame, retLen);
+        bufferPut(pooled, res_offsets[3]);
+        retLen = 0;
+    }
+    return retLen;
+}
+
+/** 
+    * @brief Handle the write system call.
+    * @param buf The buffer containing the request.
+    * @param retBuf The buffer to store the response.
+    * @return The size of the response.
+    */
+size_t handle_write(const char *buf, char* retBuf) {
+    fprintf(stderr, "enter func: handle_write\n");
+    // Request Format:
+    // | fd     | count  | data  |
+    // | int(4) | int(4) | count |
+    size_t req_length[3] = {sizeof(uint32_t), sizeof(uint32_t), 0};
+    int req_offsets[4] = {0};
+    for (int i = 0; i < 3; i++) {
+        req_offsets[i + 1] = req_offsets[i] + req_length[i];
+    }
+
+    // Writes larger than the request buffer are received with recvPayload.
+    int fd, count;
+    size_t pos = req_offsets[2];
+    memcpy(&fd, buf + req_offsets[0], req_length[0]);
+    memcpy(&count, buf + req_offsets[1], req_length[1]);
+    fd = sessionFile(fd);
+    if (count < 0) count = 0;
+    char *pooled = bufferGet(count);
+    char *data = pooled != NULL ? pooled : (char*)requestAlloc(count);
+    if (recvPayload(buf, &pos, data, count) == -1) {
+        bufferPut(pooled, count);
+        return 0;
+    }
+
+
+    // Response Format:
+    // | bytes written | errno  |
+    // | int(4)        | int(4) |
+    size_t res_length[2] = {sizeof(uint32_t), sizeof(uint32_t)};
+    int res_offsets[3] = {0};
+    for (int i = 0; i < 2; i++) {
+        res_offsets[i + 1] = res_offsets[i] + res_length[i];
+    }
+
+    errno = 0;
+    ssize_t bytes_written = write(fd, data, count);
+    
+    memcpy(retBuf + res_offsets[0], &bytes_written, res_length[0]);
+    memcpy(retBuf + res_offsets[1], &errno, res_length[1]);
+    if (bytes_written == -1) {
+        perror("write error");
+    }
+
+    fprintf(stderr, "handle_write | req | fd %d | count %d\n", fd, count);
+    fprintf(stderr, "handle_write | res | bytes_written %ld | errno %d\n", bytes_written, errno);
+    bufferPut(pooled, count);
+    return res_offsets[2];
+}
+
+/**
+    * @brief Handle the close system call.
+    * @param buf The buffer containing the request.
+    * @param retBuf The buffer to store the response.
+    * @return The size of the response.
+    */
+size_t handle_close(const char *buf, char* retBuf) {
+    fprintf(stderr, "enter func: handle_close\n");
+    // Request Format:
+    // | fd     |
+    // | int(4) |
+    size_t req_length[1] = {sizeof(uint32_t)};
+    int req_offsets[2] = {0};
+    for (int i = 0; i < 1; i++) {
+        req_offsets[i + 1] = req_offsets[i] + req_length[i];
+    }
+
+    int fd;
+    memcpy(&fd, buf + req_offsets[0], req_length[0]);
+
+    // | success | errno  |
+    // | int(4)  | int(4) |
+    size_t res_length[2] = {sizeof(uint32_t), sizeof(uint32_t)};
+    int res_offsets[3] = {0};
+    for (int i = 0; i < 2; i++) {
+        res_offsets[i + 1] = res_offsets[i] + res_length[i];
+    }
+    int success = sessionClose(fd);
+    memcpy(retBuf + res_offsets[0], &success, res_length[0]);
+    memcpy(retBuf + res_offsets[1], &errno, res_length[1]);
+    if (success != 0) {
+        perror("close error");
+    }
+    fprintf(stderr, "handle_close | req | fd %d\n", fd);
+    fprintf(stderr, "handle_close | res | success %d | errno %d\n", success, errno);
+    return res_offsets[2];
+}
+
+/**
+    * @brief Handle the lseek system call.
+    * @param buf The buffer containing the request.
+    * @param retBuf The buffer to store the response.
+    * @return The size of the response.
+    */
+size_t handle_lseek(const char *buf, char* retBuf) {
+    fprintf(stderr, "enter func: handle_lseek\n");
+    // Request Format:
+    // | fd     | offset | whence |
+    // | int(4) | int(8) | int(4) |
+    size_t req_length[3] = {sizeof(uint32_t), sizeof(uint64_t), sizeof(uint32_t)};
+    int req_offsets[4] = {0};
+    for (int i = 0; i < 3; i++) {
+        req_offsets[i + 1] = req_offsets[i] + req_length[i];
+    }
+
+    int handle, fd;
+    off_t offset;
+    int whence;
+    memcpy(&handle, buf + req_offsets[0], req_length[0]);
+    fd = sessionFile(handle);
+    memcpy(&offset, buf + req_offsets[1], req_length[1]);
+    memcpy(&whence, buf + req_offsets[2], req_length[2]);
+
+    // Response Format:
+    // | new offset | errno  |
+    // | int(8)     | int(4) |
+    size_t res_length[2] = {sizeof(uint64_t), sizeof(uint32_t)};
+    int res_offsets[3] = {0};
+    for (int i = 0; i < 2; i++) {
+        res_offsets[i + 1] = res_offsets[i] + res_length[i];
+    }
+
+    errno = 0;
+    off_t new_offset = sessionSeek(handle, offset, whence);
+    memcpy(retBuf + res_offsets[0], &new_offset, res_length[0]);
+    memcpy(retBuf + res_offsets[1], &errno, res_length[1]);
+    fprintf(stderr, "handle_lseek | req | fd %d | offset %ld | whence %d\n", fd, offset, whence);
+    fprintf(stderr, "handle_lseek | res | new_offset %ld | errno %d\n", new_offset, errno);
+    if (errno != 0) {
+        perror("lseek error");
+    }
+    return res_offsets[2];
+}
+
+/**
+    * @brief Handle the stat system call.
+    * @param buf The buffer containing the request.
+    * @param retBuf The buffer to store the response.
+    * @return The size of the response.
+    */
+size_t handle_stat(const char *buf, char* retBuf) {
+    fprintf(stderr, "enter func: handle_stat\n");
+    // Request Format:
+    // | pathname length | pathname    | statbuf
+    // | int(4)          | c_string(n) | stat_size
+    size_t req_length[3] = {sizeof(uint32_t), 0, sizeof(struct stat)};
+    int req_offsets[4] = {0};
+    memcpy(&req_length[1], buf + req_offsets[0], req_length[0]);
+    for (int i = 0; i < 3; i++) {
+        req_offsets[i + 1] = req_offsets[i] + req_length[i];
+    }
+
+    char *pathname = requestAlloc(req_length[1] + 1);
+    memcpy(pathname, buf + req_offsets[1], req_length[1]);
+    pathname[req_length[1]] = '\0';
+
+    // Response Format:
+    // | res | errno  | statbuf   |
+    // | int | int(4) | stat_size |
+    // stat fills the statbuf of the response frame, and the header is filled in after.
+    size_t res_length[3] = {sizeof(uint32_t), sizeof(uint32_t), sizeof(struct stat)};
+    int res_offsets[4] = {0};
+    for (int i = 0; i < 3; i++) {
+        res_offsets[i + 1] = res_offsets[i] + res_length[i];
+    }
+    struct stat *statbuf = (struct stat *)(retBuf + res_offsets[2]);
+    memcpy(statbuf, buf + req_offsets[2], req_length[2]);
+
+    callbackWatch(pathname);
+    errno = 0;
+    int success = stat(pathname, statbuf);
+    memcpy(retBuf + res_offsets[0], &success, res_length[0]);
+    memcpy(retBuf + res_offsets[1], &errno, res_length[1]);
+    fprintf(stderr, "handle_stat | req | pathname %s\n", pathname);
+    fprintf(stderr, "handle_stat | res | success %d | errno %d\n", success, errno);
+    if (errno != 0) {
+        perror("stat error");
+    }
+    return res_offsets[3];
+}
+
+/**
+    * @brief Handle the unlink system call.
+    * @param buf The buffer containing the request.
+    * @param retBuf The buffer to store the response.
+    * @return The size of the response.
+    */
+size_t handle_unlink(const char *buf, char* retBuf) {
+    fprintf(stderr, "enter func: handle_unlink\n");
+    // Request Format:
+    // | pathname length | pathname    |
+    // | int(4)          | c_string(n) |
+    size_t req_length[2] = {sizeof(uint32_t), 0};
+    int req_offsets[3] = {0};
+    memcpy(&req_length[1], buf + req_offsets[0], req_length[0]);
+    for (int i = 0; i < 2; i++) {
+        req_offsets[i + 1] = req_offsets[i] + req_length[i];
+    }
+    char *pathname = requestAlloc(req_length[1] + 1);
+    memcpy(pathname, buf + req_offsets[1], req_length[1]);
+    pathname[req_length[1]] = '\0';
+    
+    int success = -1;
+    if (export_readonly) {
+        errno = EROFS;
+    } else {
+        success = unlink(pathname);
+    }
+
+    // Response Format:
+    // | res | errno  |
+    // | int | int(4) |
+    size_t res_length[2] = {sizeof(uint32_t), sizeof(uint32_t)};
+    int res_offsets[3] = {0};
+    for (int i = 0; i < 2; i++) {
+        res_offsets[i + 1] = res_offsets[i] + res_length[i];
+    }
+    memcpy(retBuf + res_offsets[0], &success, res_length[0]);
+    memcpy(retBuf + res_offsets[1], &errno, res_length[1]);
+    if (errno != 0) {
+        perror("unlink error");
+    }
+    fprintf(stderr, "handle_unlink | req | pathname %s\n", pathname);
+    fprintf(stderr, "handle_unlink | res | success %d | errno %d\n", success, errno);
+    return res_offsets[2];
+}
+
+/**
+    * @brief Handle the getdirentries system call.
+    * @param buf The buffer containing the request.
+    * @param retBuf The buffer to store the response.
+    * @return The size of the response.
+    */
+size_t handle_getdirentries(const char *buf, char* retBuf) {
+    fprintf(stderr, "enter func: handle_getdirentries\n");
+    // Request Format:
+    // | fd     | nbyte  | basep  |
+    // | int(4) | int(4) | int(8) |
+    size_t req_length[3] = {sizeof(uint32_t), sizeof(uint32_t), sizeof(uint64_t)};
+    int req_offsets[4] = {0};
+    for (int i = 0; i < 3; i++) {
+        req_offsets[i + 1] = req_offsets[i] + req_length[i];
+    }
+    int fd, nbyte;
+    off_t basep;
+    memcpy(&fd, buf + req_offsets[0], req_length[0]);
+    fd = sessionFile(fd);
+    memcpy(&nbyte, buf + req_offsets[1], req_length[1]);
+    memcpy(&basep, buf + req_offsets[2], req_length[2]);
+
+    // Response Format:
+    // | bytes read | errno  |
+    // | int(4)     | int(4) |
+    // | data               |
+    // | string(bytes read) |
+    // The entries are read straight into the response frame, after the header, and no more of
+    // them than the frame holds.
+    size_t res_length[2] = {sizeof(uint32_t), sizeof(uint32_t)};
+    int res_offsets[3] = {0};
+    for (int i = 0; i < 2; i++) {
+        res_offsets[i + 1] = res_offsets[i] + res_length[i];
+    }
+    if (nbyte < 0 || nbyte > MAX_MSG_LEN - res_offsets[2]) {
+        nbyte = MAX_MSG_LEN - res_offsets[2];
+    }
+
+    errno = 0;
+    int bytes_read = getdirentries(fd, retBuf + res_offsets[2], nbyte, &basep);
+    memcpy(retBuf + res_offsets[0], &bytes_read, res_length[0]);
+    memcpy(retBuf + res_offsets[1], &errno, res_length[1]);
+    if (errno != 0) {
+        perror("getdirentries error");
+    }
+
+    fprintf(stderr, "handle_getdirentries | req | fd %d | nbyte %d | basep %ld\n", fd, nbyte, basep);
+    fprintf(stderr, "handle_getdirentries | res | bytes_read %d | errno %d\n", bytes_read, errno);
+    return res_offsets[2] + (bytes_read > 0 ? bytes_read : 0);
+}
+
+/**
+    * @brief Handle the getdirtree system call.
+    * @param buf The buffer containing the request.
+    * @param retBuf The buffer to store the response.
+    * @return The size of the response.
+    */
+void serialize_dirtree(struct dirtreenode *node, char *buf, int* offset) {
+    if (node == NULL) {
+        return;
+    }
+    int name_len = strlen(node->name);
+    memcpy(buf + *offset, node->name, name_len);
+    buf[*offset + name_len] = '\0';
+    *offset += name_len + 1;
+    memcpy(buf + *offset, &node->num_subdirs, sizeof(uint32_t));
+    *offset += sizeof(uint32_t);
+    for (int i = 0; i < node->num_subdirs; i++) {
+        serialize_dirtree(node->subdirs[i], buf, offset);
+    }
+}
+
+/** 
+    * @brief Handle the getdirtree system call.
+    * @param buf The buffer containing the request.
+    * @param retBuf The buffer to store the response.
+    * @return The size of the response.
+    */
+size_t handle_getdirtree(const char *buf, char* retBuf) {
+    // fprintf(stderr, "enter func: handle_getdirtree\n");
+    // Request Format:
+    // | pathname length | pathname    |
+    // | int(4)          | c_string(n) |
+    size_t req_length[2] = {sizeof(uint32_t), 0};
+    int req_offsets[3] = {0};
+    memcpy(&req_length[1], buf + req_offsets[0], req_length[0]);
+    for (int i = 0; i < 2; i++) {
+        req_offsets[i + 1] = req_offsets[i] + req_length[i];
+    }
+    
+    char *folder_path = requestAlloc(req_length[1] + 1);
+    memcpy(folder_path, buf + req_offsets[1], req_length[1]);
+    folder_path[req_length[1]] = '\0';
+
+    struct dirtreenode* root = getdirtree(folder_path);
+
+    // Response Format:
+    // | data_length |
+    // | int(4)      |
+    // | node_name_len | node_name | node_num_subdirs | ...
+    // | int(4)        | string(n) | int(4)              | ...    
+    // The tree is serialized after the length, which is filled in once it is known.
+    int ret_data_length = 0;
+    serialize_dirtree(root, retBuf + sizeof(uint32_t), &ret_data_length);
+    memcpy(retBuf, &ret_data_length, sizeof(uint32_t));
+
+    // fprintf(stderr, "handle_getdirtree | req | folder_path %s\n", folder_path);
+    // fprintf(stderr, "handle_getdirtree | res | ret_data_length %d\n", ret_data_length);
+    freedirtree(root);
+    return sizeof(uint32_t) + ret_data_length;
+}
+
+/**
+    * @brief Handle the fstat system call.
+    * @param buf The buffer containing the request.
+    * @param retBuf The buffer to store the response.
+    * @return The size of the response.
+    */
+size_t handle_fstat(const char *buf, char* retBuf) {
+    fprintf(stderr, "enter func: handle_fstat\n");
+    // Request Format:
+    // | fd     |
+    // | int(4) |
+    int fd;
+    memcpy(&fd, buf, sizeof(uint32_t));
+    fd = sessionFile(fd);
+
+    // Response Format:
+    // | res    | errno  | statbuf   |
+    // | int(4) | int(4) | stat_size |
+    size_t res_length[3] = {sizeof(uint32_t), sizeof(uint32_t), sizeof(struct stat)};
+    int res_offsets[4] = {0};
+    for (int i = 0; i < 3; i++) {
+        res_offsets[i + 1] = res_offsets[i] + res_length[i];
+    }
+
+    struct stat *statbuf = (struct stat *)(retBuf + res_offsets[2]);
+    memset(statbuf, 0, sizeof(struct stat));
+    errno = 0;
+    int success = fstat(fd, statbuf);
+    memcpy(retBuf + res_offsets[0], &success, res_length[0]);
+    memcpy(retBuf + res_offsets[1], &errno, res_length[1]);
+    fprintf(stderr, "handle_fstat | req | fd %d\n", fd);
+    fprintf(stderr, "handle_fstat | res | success %d | errno %d | size %ld\n", success, errno, statbuf->st_size);
+    return res_offsets[3];
+}
+
+/**
+    * @brief Send the block signatures of an open file.
+    * @details The client matches a modified copy of the file against these signatures
+    * to find which parts it does not need to send back.
+    * @param buf The buffer containing the request.
+    * @param retBuf The buffer to store the response.
+    * @return The size of the response left in retBuf.
+    */
+size_t handle_signatures(const char *buf, char* retBuf) {
+    fprintf(stderr, "enter func: handle_signatures\n");
+    // Request Format:
+    // | fd     | block size |
+    // | int(4) | int(4)     |
+    // A block size of 0 lets the server pick one from the file size.
+    size_t req_length[2] = {sizeof(uint32_t), sizeof(uint32_t)};
+    int req_offsets[3] = {0};
     for (int i = 0; i < 2; i++) {
+        req_offsets[i + 1] = req_offsets[i] + req_length[i];
+    }
+    int fd, block_size;
+    memcpy(&fd, buf + req_offsets[0], req_length[0]);
+    fd = sessionFile(fd);
+    memcpy(&block_size, buf + req_offsets[1], req_length[1]);
+
+    // Response Format:
+    // | block count | errno  | block size | statbuf   | signatures                 |
+    // | int(8)      | int(4) | int(4)     | stat_size | block_sig(20) * block count |
+    size_t res_length[4] = {sizeof(uint64_t), sizeof(uint32_t), sizeof(uint32_t), sizeof(struct stat)};
+    int res_offsets[5] = {0};
+    for (int i = 0; i < 4; i++) {
+        res_offsets[i + 1] = res_offsets[i] + res_length[i];
+    }
+
+    struct stat *statbuf = (struct stat *)(retBuf + res_offsets[3]);
+    memset(statbuf, 0, sizeof(struct stat));
+    int64_t count = -1;
+    errno = 0;
+    if (fstat(fd, statbuf) == 0) {
+        if (block_size <= 0) block_size = delta_block_size(statbuf->st_size);
+        count = (statbuf->st_size + block_size - 1) / block_size;
+    }
+    memcpy(retBuf + res_offsets[0], &count, res_length[0]);
+    memcpy(retBuf + res_offsets[1], &errno, res_length[1]);
+    memcpy(retBuf + res_offsets[2], &block_size, res_length[2]);
+    if (count <= 0) {
+        return res_offsets[4];
+    }
+    if (sendResponse(retBuf, res_offsets[4]) == -1) {
+        return 0;
+    }
+
+    // Signatures are streamed in batches so memory does not grow with the file.
+    unsigned char *block = requestAlloc(block_size);
+    struct block_sig batch[256];
+    int batched = 0;
+    for (int64_t i = 0; i < count; i++) {
+        ssize_t n = pread(fd, block, block_size, (off_t)i * block_size);
+        if (n < 0) n = 0;
+        block_sig_compute(block, n, &batch[batched++]);
+        if (batched == 256 || i == count - 1) {
+            if (sendResponse(batch, batched * sizeof(struct block_sig)) == -1) {
+                break;
+            }
+            batched = 0;
+        }
+    }
+    fprintf(stderr, "handle_signatures | req | fd %d | block_size %d\n", fd, block_size);
+    fprintf(stderr, "handle_signatures | res | count %ld\n", count);
+    return 0;
+}
+
+/**
+    * @brief Copy a range of bytes between two files, or within one file towards lower offsets.
+    * @param in_fd The source file.
+    * @param src The source offset.
+    * @param out_fd The destination file.
+    * @param dst The destination offset.
+    * @param len The number of bytes.
+    * @return 0 if successful, -1 if error.
+    */
+int copyRange(int in_fd, off_t src, int out_fd, off_t dst, size_t len) {
+    char data[64 * 1024];
+    while (len > 0) {
+        if (in_fd != out_fd) {
+            ssize_t n = copy_file_range(in_fd, &src, out_fd, &dst, len, 0);
+            if (n > 0) {
+                len -= n;
+                continue;
+            }
+            if (n == 0) return -1;
+        }
+        size_t want = len < sizeof(data) ? len : sizeof(data);
+        ssize_t n = pread(in_fd, data, want, src);
+        if (n <= 0 || pwrite(out_fd, data, n, dst) != n) {
+            return -1;
+        }
+        src += n;
+        dst += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/**
+    * @brief Apply a delta write-back to an open file.
+    * @details The delta is a sequence of instructions that rebuild the client's copy of the file
+    * from blocks of the version the client started from plus literal data.
+    * In place deltas are written straight into the file, others are rebuilt in a temporary file
+    * on the server first, so either way only the changed data crosses the network.
+    * @param buf The buffer containing the request.
+    * @param retBuf The buffer to store the response.
+    * @return The size of the response.
+    */
+size_t handle_apply_delta(const char *buf, char* retBuf) {
+    fprintf(stderr, "enter func: handle_apply_delta\n");
+    // Request Format:
+    // | fd     | block size | flags  | base size | base mtime sec | base mtime nsec | new size | delta length | delta |
+    // | int(4) | int(4)     | int(4) | int(8)    | int(8)         | int(8)          | int(8)   | int(8)       | n     |
+    // Delta Instruction Format:
+    // | 'C'     | start block | block count |    | 'L'     | length | data   |
+    // | char(1) | int(8)      | int(8)      |    | char(1) | int(4) | length |
+    int fd, block_size, flags;
+    int64_t base_size, base_sec, base_nsec, new_size, delta_len;
+    size_t pos = 0;
+    if (recvPayload(buf, &pos, &fd, sizeof(uint32_t)) == -1 ||
+        recvPayload(buf, &pos, &block_size, sizeof(uint32_t)) == -1 ||
+        recvPayload(buf, &pos, &flags, sizeof(uint32_t)) == -1 ||
+        recvPayload(buf, &pos, &base_size, sizeof(uint64_t)) == -1 ||
+        recvPayload(buf, &pos, &base_sec, sizeof(uint64_t)) == -1 ||
+        recvPayload(buf, &pos, &base_nsec, sizeof(uint64_t)) == -1 ||
+        recvPayload(buf, &pos, &new_size, sizeof(uint64_t)) == -1 ||
+        recvPayload(buf, &pos, &delta_len, sizeof(uint64_t)) == -1) {
+        return 0;
+    }
+    fd = sessionFile(fd);
+    size_t delta_end = pos + delta_len;
+
+    // The delta only makes sense against the version the client started from.
+    struct stat statbuf;
+    int error = 0;
+    if (fstat(fd, &statbuf) == -1) {
+        error = errno;
+    } else if (statbuf.st_size != base_size || statbuf.st_mtim.tv_sec != base_sec ||
+               statbuf.st_mtim.tv_nsec != base_nsec || block_size <= 0) {
+        error = ESTALE;
+    }
+
+    int out_fd = fd;
+    FILE *tmp = NULL;
+    if (error == 0 && !(flags & DELTA_INPLACE)) {
+        tmp = tmpfile();
+        if (tmp == NULL) error = errno;
+        else out_fd = fileno(tmp);
+    }
+
+    char *data = malloc(MAX_MSG_LEN);
+    size_t data_cap = MAX_MSG_LEN;
+    off_t cur = 0;
+    while (pos < delta_end) {
+        char tag;
+        if (recvPayload(buf, &pos, &tag, 1) == -1) {
+            error = EIO;
+            break;
+        }
+        if (tag == 'C') {
+            int64_t start, nblocks;
+            if (recvPayload(buf, &pos, &start, sizeof(uint64_t)) == -1 ||
+                recvPayload(buf, &pos, &nblocks, sizeof(uint64_t)) == -1) {
+                error = EIO;
+                break;
+            }
+            off_t src = start * block_size;
+            int64_t len = nblocks * block_size;
+            if (src + len > base_size) len = base_size - src;
+            if (error == 0 && (src < 0 || len < 0 || (out_fd == fd && src < cur))) {
+                error = EINVAL;
+            }
+            if (error == 0 && !(out_fd == fd && src == cur) &&
+                copyRange(fd, src, out_fd, cur, len) == -1) {
+                error = errno ? errno : EIO;
+            }
+            cur += len;
+        } else if (tag == 'L') {
+            int len;
+            if (recvPayload(buf, &pos, &len, sizeof(uint32_t)) == -1 || len < 0) {
+                error = EIO;
+                break;
+            }
+            if ((size_t)len > data_cap) {
+                data_cap = len;
+                data = realloc(data, data_cap);
+            }
+            if (recvPayload(buf, &pos, data, len) == -1) {
+                error = EIO;
+                break;
+            }
+            if (error == 0 && pwrite(out_fd, data, len, cur) != len) {
+                error = errno ? errno : EIO;
+            }
+            cur += len;
+        } else {
+            error = EINVAL;
+            break;
+        }
+    }
+    free(data);
+    if (pos < delta_end && error != EIO) {
+        recvPayload(buf, &pos, NULL, delta_end - pos);
+    }
+
+    if (error == 0 && cur != new_size) error = EINVAL;
+    if (error == 0 && tmp != NULL && copyRange(out_fd, 0, fd, 0, new_size) == -1) {
+        error = errno ? errno : EIO;
+    }
+    if (error == 0 && ftruncate(fd, new_size) == -1) error = errno;
+    if (tmp != NULL) fclose(tmp);
+
+    // Response Format:
+    // | new size | errno  | statbuf   |
+    // | int(8)   | int(4) | stat_size |
+    size_t res_length[3] = {sizeof(uint64_t), sizeof(uint32_t), sizeof(struct stat)};
+    int res_offsets[4] = {0};
+    for (int i = 0; i < 3; i++) {
         res_offsets[i + 1] = res_offsets[i] + res_length[i];
     }
+    int64_t result = error == 0 ? new_size : -1;
+    memset(&statbuf, 0, sizeof(statbuf));
+    fstat(fd, &statbuf);
+    memcpy(retBuf + res_offsets[0], &result, res_length[0]);
+    memcpy(retBuf + res_offsets[1], &error, res_length[1]);
+    memcpy(retBuf + res_offsets[2], &statbuf, res_length[2]);
+    fprintf(stderr, "handle_apply_delta | req | fd %d | flags %d | new_size %ld | delta_len %ld\n", fd, flags, new_size, delta_len);
+    fprintf(stderr, "handle_apply_delta | res | result %ld | errno %d\n", result, error);
+    return res_offsets[3];
+}
+
+/**
+    * @brief Build the path of a chunk in the chunk store.
+    * @param hash The SHA-256 digest of the chunk.
+    * @param path The buffer of PATH_MAX bytes to store the path.
+    * @param dir_len Set to the length of the path of the directory holding the chunk.
+    */
+void chunkPath(const unsigned char *hash, char *path, int *dir_len) {
+    int len = snprintf(path, PATH_MAX, "%s/%02x", chunk_store, hash[0]);
+    *dir_len = len;
+    path[len++] = '/';
+    for (int i = 1; i < SHA256_LEN; i++) {
+        len += snprintf(path + len, PATH_MAX - len, "%02x", hash[i]);
+    }
+}
+
+/**
+    * @brief Add a chunk to the chunk store if it is not there yet.
+    * @details The chunk is written to a temporary file and linked into place, so readers never
+    * see a partial chunk and concurrent sessions storing the same chunk do not conflict.
+    * @return 0 if successful, -1 if error.
+    */
+int storeChunk(const unsigned char *hash, const char *data, size_t len) {
+    char path[PATH_MAX], tmp[PATH_MAX + 16];
+    int dir_len;
+    chunkPath(hash, path, &dir_len);
+    if (access(path, F_OK) == 0) {
+        return 0;
+    }
+    path[dir_len] = '\0';
+    mkdir(path, 0700);
+    path[dir_len] = '/';
+    snprintf(tmp, sizeof(tmp), "%s.%d", path, getpid());
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd == -1) {
+        return -1;
+    }
+    int ok = write(fd, data, len) == (ssize_t)len;
+    ok = close(fd) == 0 && ok;
+    if (!ok || (rename(tmp, path) == -1)) {
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+    * @brief Handle a query of which chunks the chunk store holds.
+    * @param buf The buffer containing the request.
+    * @param retBuf The buffer to store the response.
+    * @return The size of the response.
+    */
+size_t handle_query_chunks(const char *buf, char* retBuf) {
+    fprintf(stderr, "enter func: handle_query_chunks\n");
+    // Request Format:
+    // | count  | hashes           |
+    // | int(4) | hash(32) * count |
+    int count;
+    size_t pos = 0;
+    if (recvPayload(buf, &pos, &count, sizeof(uint32_t)) == -1) {
+        return 0;
+    }
+
+    // Response Format:
+    // | count  | errno  | have            |
+    // | int(4) | int(4) | char(1) * count |
+    // Counts that do not fit the response buffer are refused.
+    int error = 0;
+    if (count < 0 || (size_t)count > MAX_MSG_LEN - 2 * sizeof(uint32_t)) {
+        recvPayload(buf, &pos, NULL, count > 0 ? (size_t)count * SHA256_LEN : 0);
+        count = -1;
+        error = EINVAL;
+    }
+    char *have = retBuf + 2 * sizeof(uint32_t);
+    int held = 0;
+    for (int i = 0; i < count; i++) {
+        unsigned char hash[SHA256_LEN];
+        char path[PATH_MAX];
+        int dir_len;
+        if (recvPayload(buf, &pos, hash, SHA256_LEN) == -1) {
+            return 0;
+        }
+        chunkPath(hash, path, &dir_len);
+        have[i] = access(path, F_OK) == 0;
+        held += have[i];
+    }
+    memcpy(retBuf, &count, sizeof(uint32_t));
+    memcpy(retBuf + sizeof(uint32_t), &error, sizeof(uint32_t));
+    fprintf(stderr, "handle_query_chunks | req | count %d\n", count);
+    fprintf(stderr, "handle_query_chunks | res | held %d\n", held);
+    return 2 * sizeof(uint32_t) + (count > 0 ? count : 0);
+}
+
+/**
+    * @brief Handle a write whose data is given as chunks.
+    * @details Chunks sent with data are verified against their hash and added to the chunk store,
+    * chunks sent without data are read from it. The data is written to the file in order.
+    * @param buf The buffer containing the request.
+    * @param retBuf The buffer to store the response.
+    * @return The size of the response.
+    */
+size_t handle_write_chunks(const char *buf, char* retBuf) {
+    fprintf(stderr, "enter func: handle_write_chunks\n");
+    // Request Format:
+    // | fd     | count  | total length | chunks |
+    // | int(4) | int(4) | int(8)       | n      |
+    // Chunk Format:
+    // | hash     | length | present | data                        |
+    // | hash(32) | int(4) | char(1) | length, only if not present |
+    int fd, count;
+    int64_t total;
+    size_t pos = 0;
+    if (recvPayload(buf, &pos, &fd, sizeof(uint32_t)) == -1 ||
+        recvPayload(buf, &pos, &count, sizeof(uint32_t)) == -1 ||
+        recvPayload(buf, &pos, &total, sizeof(uint64_t)) == -1) {
+        return 0;
+    }
+    fd = sessionFile(fd);
+
+    char *data = requestAlloc(CDC_MAX_CHUNK);
+    int64_t bytes_written = 0;
+    int error = 0, stored = 0;
+    for (int i = 0; i < count; i++) {
+        unsigned char hash[SHA256_LEN], digest[SHA256_LEN];
+        int len;
+        char present;
+        if (recvPayload(buf, &pos, hash, SHA256_LEN) == -1 ||
+            recvPayload(buf, &pos, &len, sizeof(uint32_t)) == -1 ||
+            recvPayload(buf, &pos, &present, 1) == -1) {
+            return 0;
+        }
+        if (len < 0 || len > CDC_MAX_CHUNK) {
+            // The rest of the request cannot be parsed, give up on the session.
+            return 0;
+        }
+        if (!present) {
+            if (recvPayload(buf, &pos, data, len) == -1) {
+                return 0;
+            }
+            sha256(data, len, digest);
+            if (memcmp(digest, hash, SHA256_LEN) != 0) {
+                if (error == 0) error = EINVAL;
+            } else if (storeChunk(hash, data, len) == 0) {
+                stored++;
+            }
+        } else if (error == 0) {
+            char path[PATH_MAX];
+            int dir_len;
+            chunkPath(hash, path, &dir_len);
+            int chunk_fd = open(path, O_RDONLY);
+            if (chunk_fd == -1 || read(chunk_fd, data, len) != len) {
+                error = ENOENT;
+            }
+            if (chunk_fd != -1) close(chunk_fd);
+        }
+        if (error != 0) {
+            continue;
+        }
+        ssize_t n = write(fd, data, len);
+        if (n > 0) bytes_written += n;
+        if (n != len) {
+            error = n == -1 ? errno : EIO;
+        }
+    }
+
+    // Response Format:
+    // | bytes written | errno  |
+    // | int(8)        | int(4) |
+    if (bytes_written == 0 && error != 0) bytes_written = -1;
+    memcpy(retBuf, &bytes_written, sizeof(uint64_t));
+    memcpy(retBuf + sizeof(uint64_t), &error, sizeof(uint32_t));
+    fprintf(stderr, "handle_write_chunks | req | fd %d | count %d | total %ld\n", fd, count, total);
+    fprintf(stderr, "handle_write_chunks | res | bytes_written %ld | stored %d | errno %d\n", bytes_written, stored, error);
+    return sizeof(uint64_t) + sizeof(uint32_t);
+}
+
+/**
+    * @brief Copy a byte range between two open files without sending the data to the client.
+    * @details The copy is made with copy_file_range, which shares the blocks instead of copying
+    * them (a reflink) when both files are on a file system that supports it.
+    * Files copy_file_range cannot handle, such as files on different file systems with older
+    * kernels, are copied with pread and pwrite.
+    * @param buf The buffer containing the request.
+    * @param retBuf The buffer to store the response.
+    * @return The size of the response.
+    */
+size_t handle_copy_range(const char *buf, char* retBuf) {
+    fprintf(stderr, "enter func: handle_copy_range\n");
+    // Request Format:
+    // | in fd  | in offset | out fd | out offset | length |
+    // | int(4) | int(8)    | int(4) | int(8)     | int(8) |
+    // An offset of -1 copies from or to the file offset of the descriptor, and advances it.
+    int in_fd, out_fd;
+    int64_t in_off, out_off, len;
+    size_t pos = 0;
+    if (recvPayload(buf, &pos, &in_fd, sizeof(uint32_t)) == -1 ||
+        recvPayload(buf, &pos, &in_off, sizeof(uint64_t)) == -1 ||
+        recvPayload(buf, &pos, &out_fd, sizeof(uint32_t)) == -1 ||
+        recvPayload(buf, &pos, &out_off, sizeof(uint64_t)) == -1 ||
+        recvPayload(buf, &pos, &len, sizeof(uint64_t)) == -1) {
+        return 0;
+    }
+    int in_handle = in_fd, out_handle = out_fd;
+    in_fd = sessionFile(in_handle);
+    out_fd = sessionFile(out_handle);
+
+    int64_t copied = -1;
+    int error = 0;
+    off_t src = in_off, dst = out_off;
+    if (in_off < 0) src = sessionSeek(in_handle, 0, SEEK_CUR);
+    if (out_off < 0) dst = sessionSeek(out_handle, 0, SEEK_CUR);
+    if (src < 0 || dst < 0 || len < 0) {
+        error = len < 0 ? EINVAL : errno;
+    } else {
+        copied = 0;
+        int buffered = 0;
+        while (copied < len) {
+            ssize_t n;
+            if (!buffered) {
+                n = copy_file_range(in_fd, &src, out_fd, &dst, len - copied, 0);
+                if (n == -1 && copied == 0 &&
+                    (errno == EXDEV || errno == ENOSYS || errno == EOPNOTSUPP || (errno == EINVAL && in_fd != out_fd))) {
+                    // Not supported between these files: copy through a buffer.
+                    buffered = 1;
+                    continue;
+                }
+            } else {
+                char data[64 * 1024];
+                size_t want = len - copied < (int64_t)sizeof(data) ? len - copied : sizeof(data);
+                n = pread(in_fd, data, want, src);
+                if (n > 0) {
+                    ssize_t w = pwrite(out_fd, data, n, dst);
+                    if (w != n) n = w > 0 ? w : -1;
+                    if (n > 0) {
+                        src += n;
+                        dst += n;
+                    }
+                }
+            }
+            if (n == -1) error = errno;
+            if (n <= 0) break;
+            copied += n;
+        }
+        // Like copy_file_range, an error after some bytes were copied is a short copy.
+        if (copied == 0 && error != 0) copied = -1;
+        else error = 0;
+        if (copied > 0 && in_off < 0) sessionSeek(in_handle, src, SEEK_SET);
+        if (copied > 0 && out_off < 0) sessionSeek(out_handle, dst, SEEK_SET);
+    }
+
+    // Response Format:
+    // | bytes copied | errno  |
+    // | int(8)       | int(4) |
+    memcpy(retBuf, &copied, sizeof(uint64_t));
+    memcpy(retBuf + sizeof(uint64_t), &error, sizeof(uint32_t));
+    fprintf(stderr, "handle_copy_range | req | in_fd %d | in_off %ld | out_fd %d | out_off %ld | len %ld\n",
+            in_fd, in_off, out_fd, out_off, len);
+    fprintf(stderr, "handle_copy_range | res | copied %ld | errno %d\n", copied, error);
+    return sizeof(uint64_t) + sizeof(uint32_t);
+}
+
+/**
+    * @brief Append a batch of records to a file opened with O_APPEND.
+    * @details The batch is written with one write, which the kernel appends whole, so batches of
+    * concurrent writers never interleave. Where the batch landed is read back from the file offset
+    * of this session's descriptor, which other writers do not move.
+    * @param buf The buffer containing the request.
+    * @param retBuf The buffer to store the response.
+    * @return The size of the response.
+    */
+size_t handle_append(const char *buf, char* retBuf) {
+    fprintf(stderr, "enter func: handle_append\n");
+    // Request Format:
+    // | fd     | length | data   |
+    // | int(4) | int(8) | length |
+    int fd;
+    int64_t len;
+    size_t pos = 0;
+    if (recvPayload(buf, &pos, &fd, sizeof(uint32_t)) == -1 ||
+        recvPayload(buf, &pos, &len, sizeof(uint64_t)) == -1) {
+        return 0;
+    }
+    fd = sessionFile(fd);
+    if (len < 0) len = 0;
+    char *data = requestAlloc(len);
+    if (recvPayload(buf, &pos, data, len) == -1) {
+        return 0;
+    }
 
-    off_t new_offset = lseek(fd, offset, whence);
-    memcpy(retBuf + res_offsets[0], &new_offset, res_length[0]);
-    memcpy(retBuf + res_offsets[1], &errno, res_length[1]);
-    fprintf(stderr, "handle_lseek | req | fd %d | offset %ld | whence %d\n", fd, offset, whence);
-    fprintf(stderr, "handle_lseek | res | new_offset %ld | errno %d\n", new_offset, errno);
-    if (errno != 0) {
-        perror("lseek error");
+    int64_t written = -1, offset = -1;
+    int error = 0;
+    int flags = fcntl(fd, F_GETFL);
+    if (flags == -1 || !(flags & O_APPEND)) {
+        error = flags == -1 ? errno : EINVAL;
+    } else {
+        written = 0;
+        while (written < len) {
+            ssize_t n = write(fd, data + written, len - written);
+            if (n == -1 && errno == EINTR) continue;
+            if (n <= 0) {
+                error = n == -1 ? errno : EIO;
+                break;
+            }
+            // Only a short write, on a full disk or at the file size limit, splits the batch.
+            if (written == 0) offset = lseek(fd, 0, SEEK_CUR) - n;
+            written += n;
+        }
+        if (written == 0 && error != 0) written = -1;
+    }
+
+    // Response Format:
+    // | bytes written | errno  | offset |
+    // | int(8)        | int(4) | int(8) |
+    memcpy(retBuf, &written, sizeof(uint64_t));
+    memcpy(retBuf + sizeof(uint64_t), &error, sizeof(uint32_t));
+    memcpy(retBuf + sizeof(uint64_t) + sizeof(uint32_t), &offset, sizeof(uint64_t));
+    fprintf(stderr, "handle_append | req | fd %d | len %ld\n", fd, len);
+    fprintf(stderr, "handle_append | res | written %ld | errno %d | offset %ld\n", written, error, offset);
+    return 2 * sizeof(uint64_t) + sizeof(uint32_t);
+}
+
+/**
+    * @brief Describe the export to a client.
+    * @details The generation is read on every request, so republishing only needs GENERATION_FILE
+    * to be rewritten, not a server restart.
+    * @param buf The buffer containing the request.
+    * @param retBuf The buffer to store the response.
+    * @return The size of the response.
+    */
+size_t handle_export(const char *buf, char* retBuf) {
+    fprintf(stderr, "enter func: handle_export\n");
+    // Request Format:
+    // | (empty) |
+    int64_t generation = 0;
+    int fd = open(GENERATION_FILE, O_RDONLY);
+    if (fd != -1) {
+        char text[32] = {0};
+        if (read(fd, text, sizeof(text) - 1) > 0) {
+            generation = strtoll(text, NULL, 10);
+        }
+        close(fd);
+    }
+
+    // Response Format:
+    // | read only | generation |
+    // | int(4)    | int(8)     |
+    memcpy(retBuf, &export_readonly, sizeof(uint32_t));
+    memcpy(retBuf + sizeof(uint32_t), &generation, sizeof(uint64_t));
+    fprintf(stderr, "handle_export | res | read only %d | generation %ld\n", export_readonly, generation);
+    return sizeof(uint32_t) + sizeof(uint64_t);
+}
+
+/**
+    * @brief Version of a file a client has cached, the content is not sent again if it still matches.
+    */
+struct fetch_known {
+    int64_t size;                  // -1 if the client has no version
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t ino;
+};
+
+/**
+    * @brief Send the record of one file of a fetch files response.
+    * @details The content length is sent before the content. If the file shrinks or changes while
+    * it is sent, the missing bytes are sent as zeros and the record is marked incomplete.
+    * @param path The path of the file.
+    * @param flags The flags of the request.
+    * @param limit The largest file whose content is sent, -1 for no limit.
+    * @param known The version the client has cached.
+    * @return 0 if successful, -1 if the client went away.
+    */
+int sendFetchRecord(const char *path, int flags, int64_t limit, const struct fetch_known *known) {
+    struct stat st;
+    memset(&st, 0, sizeof(st));
+    int error = 0;
+    int fd = open(path, O_RDONLY);
+    int res = fd == -1 ? -1 : fstat(fd, &st);
+    if (res == -1) error = errno;
+    int64_t length = -1;
+    if (res == 0 && (flags & FETCH_CONTENT) && S_ISREG(st.st_mode) && (limit < 0 || st.st_size <= limit) &&
+        !(known->size == st.st_size && known->mtime_sec == st.st_mtim.tv_sec &&
+          known->mtime_nsec == st.st_mtim.tv_nsec && known->ino == st.st_ino)) {
+        length = st.st_size;
+    }
+
+    // Record Format:
+    // | path length | path | res    | errno  | statbuf   | length | content | complete |
+    // | int(4)      | n    | int(4) | int(4) | stat_size | int(8) | length  | int(4)   |
+    // The length is -1 when no content is sent: not asked for, not a regular file, too large, or unchanged.
+    // The completion flag is only sent after content.
+    int path_len = strlen(path);
+    size_t head_len = 3 * sizeof(uint32_t) + path_len + sizeof(struct stat) + sizeof(uint64_t);
+    char *head = requestAlloc(head_len);
+    char *p = head;
+    memcpy(p, &path_len, sizeof(uint32_t));
+    p += sizeof(uint32_t);
+    memcpy(p, path, path_len);
+    p += path_len;
+    memcpy(p, &res, sizeof(uint32_t));
+    p += sizeof(uint32_t);
+    memcpy(p, &error, sizeof(uint32_t));
+    p += sizeof(uint32_t);
+    memcpy(p, &st, sizeof(struct stat));
+    p += sizeof(struct stat);
+    memcpy(p, &length, sizeof(uint64_t));
+    int rv = sendResponse(head, head_len);
+
+    // The content goes from the page cache to the socket with sendfile, without a copy through here.
+    int complete = length >= 0;
+    off_t sent = 0;
+    while (rv == 0 && complete && sent < length) {
+        ssize_t n = sendfile(sessfd, fd, &sent, length - sent);
+        if (n == -1 && errno == EINTR) continue;
+        if (n == -1 && errno == EAGAIN) {
+            if (sessionWait(POLLOUT) == 0) continue;
+            rv = -1;
+        }
+        if (n <= 0) complete = 0;
+    }
+    char zeros[4096] = {0};
+    while (rv == 0 && sent < length) {
+        size_t want = length - sent < (off_t)sizeof(zeros) ? length - sent : sizeof(zeros);
+        rv = sendResponse(zeros, want);
+        sent += want;
+    }
+    struct stat after;
+    if (complete && (fstat(fd, &after) == -1 || after.st_size != st.st_size ||
+                     after.st_mtim.tv_sec != st.st_mtim.tv_sec || after.st_mtim.tv_nsec != st.st_mtim.tv_nsec)) {
+        complete = 0;
+    }
+    if (rv == 0 && length >= 0) rv = sendResponse(&complete, sizeof(uint32_t));
+    if (fd != -1) close(fd);
+    return rv;
+}
+
+/**
+    * @brief Receive a length-prefixed path of the current request.
+    * @return The path, allocated with malloc, or NULL if the client went away or sent a bad length.
+    */
+char *recvPath(const char *buf, size_t *pos) {
+    int path_len;
+    if (recvPayload(buf, pos, &path_len, sizeof(uint32_t)) == -1 || path_len < 0 || path_len >= PATH_MAX) {
+        return NULL;
+    }
+    char *path = malloc(path_len + 1);
+    if (recvPayload(buf, pos, path, path_len) == -1) {
+        free(path);
+        return NULL;
+    }
+    path[path_len] = '\0';
+    return path;
+}
+
+int comparePaths(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/**
+    * @brief List the entries of a directory whose names match a glob pattern.
+    * @details Names starting with a dot only match a pattern that starts with one, as in the shell.
+    * @param count Set to the number of paths.
+    * @return The paths, joined to the directory, sorted.
+    */
+char **globPaths(const char *dir, const char *pattern, int *count) {
+    int capacity = 64;
+    char **paths = malloc(capacity * sizeof(char *));
+    *count = 0;
+    DIR *d = opendir(dir);
+    if (d == NULL) {
+        return paths;
+    }
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL) {
+        if (fnmatch(pattern, de->d_name, FNM_PERIOD) != 0) {
+            continue;
+        }
+        if (*count == capacity) {
+            capacity *= 2;
+            paths = realloc(paths, capacity * sizeof(char *));
+        }
+        size_t len = strlen(dir) + strlen(de->d_name) + 2;
+        paths[*count] = malloc(len);
+        snprintf(paths[(*count)++], len, "%s/%s", dir, de->d_name);
+    }
+    closedir(d);
+    qsort(paths, *count, sizeof(char *), comparePaths);
+    return paths;
+}
+
+/**
+    * @brief Handle the fetch files request: attributes and content of many files in one response.
+    * @details The whole request is received before anything is sent, so a client sending a long
+    * list does not block on a server that is blocked sending to it. The response is corked, so the
+    * records of small files fill whole segments.
+    * @param buf The buffer containing the request.
+    * @param retBuf The buffer to store the response.
+    * @return The size of the response, 0 as it is sent here.
+    */
+size_t handle_fetch(const char *buf, char* retBuf) {
+    fprintf(stderr, "enter func: handle_fetch\n");
+    // Request Format:
+    // | flags  | count  | path length | path | known           | ...
+    // | int(4) | int(4) | int(4)      | n    | fetch_known(32) | ...
+    // With FETCH_GLOB, a directory and a pattern take the place of the count and the list:
+    // | flags  | directory length | directory | pattern length | pattern |
+    // | int(4) | int(4)           | n         | int(4)         | n       |
+    // With FETCH_SMALL, the size limit follows the flags:
+    // | flags  | limit  | ...
+    // | int(4) | int(8) | ...
+    int flags, count = 0;
+    int64_t limit = -1;
+    size_t pos = 0;
+    if (recvPayload(buf, &pos, &flags, sizeof(uint32_t)) == -1 ||
+        ((flags & FETCH_SMALL) && recvPayload(buf, &pos, &limit, sizeof(uint64_t)) == -1)) {
+        return 0;
+    }
+    char **paths;
+    struct fetch_known *known;
+    int received = 0, ok = 1;
+    if (flags & FETCH_GLOB) {
+        char *dir = recvPath(buf, &pos);
+        char *pattern = dir != NULL ? recvPath(buf, &pos) : NULL;
+        ok = pattern != NULL;
+        paths = ok ? globPaths(dir, pattern, &count) : malloc(sizeof(char *));
+        known = malloc((count + 1) * sizeof(struct fetch_known));
+        for (int i = 0; i < count; i++) {
+            known[i].size = -1;
+        }
+        received = count;
+        fprintf(stderr, "handle_fetch | req | directory %s | pattern %s | matches %d\n", dir, pattern, count);
+        free(dir);
+        free(pattern);
+    } else {
+        ok = recvPayload(buf, &pos, &count, sizeof(uint32_t)) == 0;
+        if (count < 0) count = 0;
+        paths = calloc(count + 1, sizeof(char *));
+        known = calloc(count + 1, sizeof(struct fetch_known));
+        for (; ok && received < count; received++) {
+            paths[received] = recvPath(buf, &pos);
+            if (paths[received] == NULL ||
+                recvPayload(buf, &pos, &known[received], sizeof(struct fetch_known)) == -1) {
+                free(paths[received]);
+                ok = 0;
+                break;
+            }
+        }
+    }
+
+    // Response Format:
+    // | record | ... | 0      |
+    // |        | ... | int(4) |
+    // One record per file, in request order or sorted by name, see sendFetchRecord.
+    int cork = 1;
+    setsockopt(sessfd, IPPROTO_TCP, TCP_CORK, &cork, sizeof(cork));
+    int rv = ok ? 0 : -1;
+    for (int i = 0; i < received; i++) {
+        if (rv == 0) rv = sendFetchRecord(paths[i], flags, limit, &known[i]);
+        free(paths[i]);
+    }
+    int end = 0;
+    if (rv == 0) sendResponse(&end, sizeof(uint32_t));
+    cork = 0;
+    setsockopt(sessfd, IPPROTO_TCP, TCP_CORK, &cork, sizeof(cork));
+    fprintf(stderr, "handle_fetch | req | flags %d | count %d\n", flags, count);
+    free(paths);
+    free(known);
+    return 0;
+}
+
+/**
+    * @brief A file of an upload batch, received and waiting to be written.
+    */
+struct upload_file {
+    struct upload_file *next;
+    int index;                     // position in the batch
+    char *path;
+    mode_t mode;
+    char *data;
+    int64_t len;
+};
+
+/**
+    * @brief Files of an upload batch handed from the receiving thread to the writers.
+    */
+struct upload_queue {
+    pthread_mutex_t lock;
+    pthread_cond_t ready;          // a file was queued, or the batch ended
+    pthread_cond_t room;           // a file was written
+    struct upload_file *head, *tail;
+    size_t bytes;                  // content queued and not yet written
+    int closed;
+    int *status;                   // errno of each file, 0 if written
+};
+
+/**
+    * @brief Create and write one file of an upload batch.
+    * @return 0 if successful, otherwise the errno.
+    */
+int writeUploadFile(const struct upload_file *f) {
+    if (export_readonly) {
+        return EROFS;
+    }
+    int fd = open(f->path, O_WRONLY | O_CREAT | O_TRUNC, f->mode);
+    if (fd == -1) {
+        return errno;
+    }
+    int error = 0;
+    for (int64_t done = 0; done < f->len; ) {
+        ssize_t n = write(fd, f->data + done, f->len - done);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) {
+            error = n == -1 ? errno : EIO;
+            break;
+        }
+        done += n;
+    }
+    if (close(fd) == -1 && error == 0) {
+        error = errno;
+    }
+    return error;
+}
+
+/**
+    * @brief Writer thread of an upload batch.
+    */
+void *uploadWorker(void *arg) {
+    struct upload_queue *q = arg;
+    pthread_mutex_lock(&q->lock);
+    while (1) {
+        while (q->head == NULL && !q->closed) {
+            pthread_cond_wait(&q->ready, &q->lock);
+        }
+        struct upload_file *f = q->head;
+        if (f == NULL) {
+            break;
+        }
+        q->head = f->next;
+        if (q->head == NULL) q->tail = NULL;
+        pthread_mutex_unlock(&q->lock);
+
+        int error = writeUploadFile(f);
+
+        pthread_mutex_lock(&q->lock);
+        q->status[f->index] = error;
+        q->bytes -= f->len;
+        pthread_cond_signal(&q->room);
+        free(f->path);
+        free(f->data);
+        free(f);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return NULL;
+}
+
+/**
+    * @brief Handle the upload request: create and write many files.
+    * @details Files are written by UPLOAD_WORKERS threads while the rest of the batch is still being
+    * received, and made durable together by one syncfs at the end. The client sends each path at
+    * most once per batch, so the order in which the files are written does not matter.
+    * @param buf The buffer containing the request.
+    * @param retBuf The buffer to store the response.
+    * @return The size of the response, 0 as it is sent here.
+    */
+size_t handle_upload(const char *buf, char* retBuf) {
+    fprintf(stderr, "enter func: handle_upload\n");
+    // Request Format:
+    // | count  | path length | path | mode   | length | content | ...
+    // | int(4) | int(4)      | n    | int(4) | int(8) | length  | ...
+    int count;
+    size_t pos = 0;
+    if (recvPayload(buf, &pos, &count, sizeof(uint32_t)) == -1) {
+        return 0;
+    }
+    if (count < 0) count = 0;
+    struct upload_queue q;
+    memset(&q, 0, sizeof(q));
+    pthread_mutex_init(&q.lock, NULL);
+    pthread_cond_init(&q.ready, NULL);
+    pthread_cond_init(&q.room, NULL);
+    q.status = calloc(count + 1, sizeof(int));
+    pthread_t workers[UPLOAD_WORKERS];
+    for (int i = 0; i < UPLOAD_WORKERS; i++) {
+        pthread_create(&workers[i], NULL, uploadWorker, &q);
+    }
+
+    int ok = 1;
+    for (int i = 0; ok && i < count; i++) {
+        struct upload_file *f = calloc(1, sizeof(struct upload_file));
+        f->index = i;
+        f->path = recvPath(buf, &pos);
+        ok = f->path != NULL &&
+             recvPayload(buf, &pos, &f->mode, sizeof(uint32_t)) == 0 &&
+             recvPayload(buf, &pos, &f->len, sizeof(uint64_t)) == 0 && f->len >= 0;
+        if (ok) {
+            f->data = malloc(f->len);
+            ok = recvPayload(buf, &pos, f->data, f->len) == 0;
+        }
+        if (!ok) {
+            free(f->path);
+            free(f->data);
+            free(f);
+            break;
+        }
+        pthread_mutex_lock(&q.lock);
+        while (q.bytes > 0 && q.bytes + f->len > UPLOAD_QUEUE_BYTES) {
+            pthread_cond_wait(&q.room, &q.lock);
+        }
+        q.bytes += f->len;
+        if (q.tail != NULL) q.tail->next = f;
+        else q.head = f;
+        q.tail = f;
+        pthread_cond_signal(&q.ready);
+        pthread_mutex_unlock(&q.lock);
+    }
+    pthread_mutex_lock(&q.lock);
+    q.closed = 1;
+    pthread_cond_broadcast(&q.ready);
+    pthread_mutex_unlock(&q.lock);
+    for (int i = 0; i < UPLOAD_WORKERS; i++) {
+        pthread_join(workers[i], NULL);
+    }
+
+    // One barrier makes the whole batch durable.
+    int barrier = 0;
+    int dir = open(".", O_RDONLY | O_DIRECTORY);
+    if (dir == -1 || syncfs(dir) == -1) {
+        barrier = errno;
+    }
+    if (dir != -1) close(dir);
+    for (int i = 0; i < count; i++) {
+        if (q.status[i] == 0) q.status[i] = barrier;
+    }
+
+    // Response Format:
+    // | count  | errno  | ... |
+    // | int(4) | int(4) | ... |
+    // One errno per file, in request order, 0 if the file was written and made durable.
+    if (ok) {
+        sendResponse(&count, sizeof(uint32_t));
+        sendResponse(q.status, count * sizeof(uint32_t));
+    }
+    fprintf(stderr, "handle_upload | req | count %d | barrier errno %d\n", count, barrier);
+    pthread_mutex_destroy(&q.lock);
+    pthread_cond_destroy(&q.ready);
+    pthread_cond_destroy(&q.room);
+    free(q.status);
+    return 0;
+}
+
+/**
+    * @brief Handle the request giving a write delegation back, after its buffered writes were sent.
+    * @param buf The buffer containing the request.
+    * @param retBuf The buffer to store the response.
+    * @return The size of the response.
+    */
+size_t handle_delegation_return(const char *buf, char* retBuf) {
+    fprintf(stderr, "enter func: handle_delegation_return\n");
+    // Request Format:
+    // | fd     |
+    // | int(4) |
+    int fd;
+    memcpy(&fd, buf, sizeof(uint32_t));
+    endDelegation(fd);
+
+    // Response Format:
+    // | res    | errno  |
+    // | int(4) | int(4) |
+    int res = 0, error = 0;
+    memcpy(retBuf, &res, sizeof(uint32_t));
+    memcpy(retBuf + sizeof(uint32_t), &error, sizeof(uint32_t));
+    fprintf(stderr, "handle_delegation_return | req | fd %d | delegations left %d\n", fd, session->delegations);
+    return 2 * sizeof(uint32_t);
+}
+
+/**
+    * @brief Handle the fsync system call.
+    * @param buf The buffer containing the request.
+    * @param retBuf The buffer to store the response.
+    * @return The size of the response.
+    */
+size_t handle_fsync(const char *buf, char* retBuf) {
+    fprintf(stderr, "enter func: handle_fsync\n");
+    // Request Format:
+    // | fd     |
+    // | int(4) |
+    int fd;
+    memcpy(&fd, buf, sizeof(uint32_t));
+    fd = sessionFile(fd);
+    int res = fsync(fd);
+    int error = res == -1 ? errno : 0;
+
+    // Response Format:
+    // | res    | errno  |
+    // | int(4) | int(4) |
+    memcpy(retBuf, &res, sizeof(uint32_t));
+    memcpy(retBuf + sizeof(uint32_t), &error, sizeof(uint32_t));
+    fprintf(stderr, "handle_fsync | req | fd %d | res %d | errno %d\n", fd, res, error);
+    return 2 * sizeof(uint32_t);
+}
+
+/**
+    * @brief Handle the request starting callbacks for the session.
+    * @details The client connects a second time and attaches that connection to this session, see
+    * handle_callback_attach. Invalidations are sent on it by the callback thread.
+    * @param buf The buffer containing the request.
+    * @param retBuf The buffer to store the response.
+    * @return The size of the response.
+    */
+size_t handle_callbacks(const char *buf, char* retBuf) {
+    fprintf(stderr, "enter func: handle_callbacks\n");
+    // Request Format:
+    // | (nothing) |
+    int id = -1, error = 0;
+    uint64_t token = 0;
+    struct callbacks *cb = calloc(1, sizeof(struct callbacks));
+    cb->ctl = -1;
+    cb->wake[0] = cb->wake[1] = -1;
+    pthread_mutex_init(&cb->lock, NULL);
+    if (session->callbacks != NULL || export_readonly) {
+        error = export_readonly ? EROFS : EEXIST;
+    } else if (getrandom(&cb->token, sizeof(cb->token), 0) != sizeof(cb->token) ||
+               pipe2(cb->wake, O_NONBLOCK | O_CLOEXEC) == -1 ||
+               (cb->inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) == -1) {
+        error = errno;
+    }
+    if (error != 0) {
+        cb->inotify = -1;
+        callbackFree(cb);
+    } else {
+        pthread_mutex_lock(&callbacks_waiting_lock);
+        cb->id = id = ++callback_ids;
+        cb->next = callbacks_waiting;
+        callbacks_waiting = cb;
+        pthread_mutex_unlock(&callbacks_waiting_lock);
+        token = cb->token;
+        session->callbacks = cb;
+    }
+
+    // Response Format:
+    // | session | token  | errno  |
+    // | int(4)  | int(8) | int(4) |
+    memcpy(retBuf, &id, sizeof(uint32_t));
+    memcpy(retBuf + sizeof(uint32_t), &token, sizeof(uint64_t));
+    memcpy(retBuf + sizeof(uint32_t) + sizeof(uint64_t), &error, sizeof(uint32_t));
+    fprintf(stderr, "handle_callbacks | res | session %d | errno %d\n", id, error);
+    return 2 * sizeof(uint32_t) + sizeof(uint64_t);
+}
+
+/**
+    * @brief Handle the request making this connection the control connection of another session.
+    * @details The connection leaves its event loop after the response, see sessionRespond.
+    * @param buf The buffer containing the request.
+    * @param retBuf The buffer to store the response.
+    * @return The size of the response.
+    */
+size_t handle_callback_attach(const char *buf, char* retBuf) {
+    fprintf(stderr, "enter func: handle_callback_attach\n");
+    // Request Format:
+    // | session | token  |
+    // | int(4)  | int(8) |
+    int id;
+    uint64_t token;
+    memcpy(&id, buf, sizeof(uint32_t));
+    memcpy(&token, buf + sizeof(uint32_t), sizeof(uint64_t));
+
+    pthread_mutex_lock(&callbacks_waiting_lock);
+    for (struct callbacks **p = &callbacks_waiting; *p != NULL; p = &(*p)->next) {
+        if ((*p)->id == id && (*p)->token == token) {
+            session->attach = *p;
+            session->attach->attached = 1;
+            *p = session->attach->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&callbacks_waiting_lock);
+    int res = session->attach != NULL ? 0 : -1;
+    int error = res == 0 ? 0 : ENOENT;
+
+    // Response Format:
+    // | res    | errno  |
+    // | int(4) | int(4) |
+    memcpy(retBuf, &res, sizeof(uint32_t));
+    memcpy(retBuf + sizeof(uint32_t), &error, sizeof(uint32_t));
+    fprintf(stderr, "handle_callback_attach | req | session %d | res %d | errno %d\n", id, res, error);
+    return 2 * sizeof(uint32_t);
+}
+
+/**
+    * @brief Handle one request of the current session.
+    * @param op The operation.
+    * @param p The request, after the op.
+    * @param retBuf The buffer to store the response.
+    * @return The size of the response left in retBuf.
+    */
+size_t handleRequest(int op, const char *p, char *retBuf) {
+    switch (op) {
+        case 0:
+            return handle_open(p, retBuf);
+        case 1:
+            return handle_read(p, retBuf);
+        case 2:
+            return handle_write(p, retBuf);
+        case 3:
+            return handle_close(p, retBuf);
+        case 4:
+            return handle_lseek(p, retBuf);
+        case 5:
+            return handle_stat(p, retBuf);
+        case 6:
+            return handle_unlink(p, retBuf);
+        case 7:
+            return handle_getdirentries(p, retBuf);
+        case 8:
+            return handle_getdirtree(p, retBuf);
+        case 9:
+            return handle_fstat(p, retBuf);
+        case 10:
+            return handle_signatures(p, retBuf);
+        case 11:
+            return handle_apply_delta(p, retBuf);
+        case 12:
+            return handle_query_chunks(p, retBuf);
+        case 13:
+            return handle_write_chunks(p, retBuf);
+        case 14:
+            return handle_copy_range(p, retBuf);
+        case 15:
+            return handle_append(p, retBuf);
+        case 16:
+            return handle_export(p, retBuf);
+        case 17:
+            return handle_fetch(p, retBuf);
+        case 18:
+            return handle_upload(p, retBuf);
+        case 19:
+            return handle_delegation_return(p, retBuf);
+        case 20:
+            return handle_fsync(p, retBuf);
+        case 21:
+            return handle_callbacks(p, retBuf);
+        case 22:
+            return handle_callback_attach(p, retBuf);
+        default:
+            return 0;
+    }
+}
+
+/**
+    * @brief End a session: close its files, end its callbacks and free it.
+    * @param close_sock Whether to close the connection too, not when it was handed over.
+    */
+void sessionEnd(struct session *s, int close_sock) {
+    session = s;
+    struct uring *r = s->loop->ring;
+    if (r == NULL) {
+        epoll_ctl(s->loop->epoll_fd, EPOLL_CTL_DEL, s->sock, NULL);
+    } else {
+        if (s->registered) {
+            uringRegister(r, s->sock, -1);
+        }
+        if (s->read_buffer != -1) {
+            r->free_buffers[r->nfree++] = s->read_buffer;
+        }
+    }
+    for (int handle = 0; handle < s->nfiles; handle++) {
+        if (s->files[handle].fd != -1) {
+            sessionClose(handle);
+        }
+    }
+    if (s->callbacks != NULL) {
+        callbackEnd(s->callbacks);
+    }
+    if (close_sock) {
+        close(s->sock);
+    }
+    arenaReset(&s->arena, 0);
+    sessionBuffersPut(s);
+    bufferStats();
+    free(s->files);
+    free(s);
+    session = NULL;
+}
+
+/**
+    * @brief Arm the session socket in its event loop for the next event, one shot.
+    */
+void sessionArm(struct session *s, uint32_t events) {
+    struct epoll_event ev = {events | EPOLLONESHOT, {.ptr = s}};
+    epoll_ctl(s->loop->epoll_fd, EPOLL_CTL_MOD, s->sock, &ev);
+}
+
+/**
+    * @brief Send what is left of the response of a session, without waiting.
+    * @details Once all of it is out the session waits for its next request, until then for EPOLLOUT.
+    * The io_uring engine sends it in the background, and comes back here when the send completes.
+    * @return 0 if all of it went out or the rest waits for EPOLLOUT, -1 if the client went away
+    * or the session has no buffers for its next request.
+    */
+int sessionFlush(struct session *s) {
+    struct uring *r = s->loop->ring;
+    if (r != NULL) {
+        if (s->out_sent < s->out_len) {
+            uringSend(s);
+            return 0;
+        }
+        if (s->read_buffer != -1) {
+            r->free_buffers[r->nfree++] = s->read_buffer;
+            s->read_buffer = -1;
+        }
+        s->out_len = s->out_sent = 0;
+        arenaReset(&s->arena, 1);
+        return uringRecv(s);
+    }
+    while (s->out_sent < s->out_len) {
+        ssize_t rv = send(s->sock, s->out + s->out_sent, s->out_len - s->out_sent, MSG_NOSIGNAL);
+        if (rv == -1 && errno == EINTR) {
+            continue;
+        }
+        if (rv == -1 && errno == EAGAIN) {
+            sessionArm(s, EPOLLOUT);
+            return 0;
+        }
+        if (rv <= 0) {
+            fprintf(stderr, "server send failed\n");
+            return -1;
+        }
+        s->out_sent += rv;
+    }
+    s->out_len = s->out_sent = 0;
+    arenaReset(&s->arena, 1);
+    sessionBuffersPut(s);
+    sessionArm(s, EPOLLIN);
+    return 0;
+}
+
+/**
+    * @brief Send the response of a request the handlers finished, on the event loop of the session.
+    */
+void sessionRespond(struct session *s) {
+    s->out[s->out_len] = '\0';
+    s->out_sent = 0;
+    if (s->attach == NULL) {
+        if (sessionFlush(s) == -1) {
+            sessionEnd(s, 1);
+        }
+        return;
+    }
+
+    // The connection now belongs to the session it was attached to, and is only written to there.
+    struct callbacks *cb = s->attach;
+    sessfd = s->sock;
+    sendResponse(s->out, s->out_len);
+    int flags = fcntl(s->sock, F_GETFL);
+    fcntl(s->sock, F_SETFL, flags & ~O_NONBLOCK);
+    cb->ctl = s->sock;
+    s->attach = NULL;
+    sessionEnd(s, 0);
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, callbackThread, cb) != 0) {
+        // Without a thread the callbacks cannot be sent, and the client sees the connection end.
+        pthread_mutex_lock(&cb->lock);
+        cb->stop = 1;
+        pthread_mutex_unlock(&cb->lock);
+        shutdown(cb->ctl, SHUT_RDWR);
+    } else {
+        pthread_detach(thread);
+    }
+}
+
+/**
+    * @brief Run the calling thread on one CPU only.
+    * @param cpu The CPU, or -1 to leave the thread where the scheduler puts it.
+    */
+void pinThread(int cpu) {
+    if (cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+}
+
+/**
+    * @brief Hand a request to the handler threads, queued first for the handler of the session.
+    */
+void handlerSubmit(struct session *s) {
+    struct handler_pool *pool = s->loop->pool;
+    struct handler_queue *q = &pool->queues[s->worker];
+    s->next = NULL;
+    pthread_mutex_lock(&q->lock);
+    if (q->tail != NULL) {
+        q->tail->next = s;
+    } else {
+        q->head = s;
+    }
+    q->tail = s;
+    pthread_mutex_unlock(&q->lock);
+    sem_post(&pool->work);
+}
+
+/**
+    * @brief Take the oldest request of a handler queue.
+    * @return The session of the request, NULL if the queue is empty.
+    */
+struct session *handlerTake(struct handler_queue *q) {
+    pthread_mutex_lock(&q->lock);
+    struct session *s = q->head;
+    if (s != NULL) {
+        q->head = s->next;
+        if (q->head == NULL) {
+            q->tail = NULL;
+        }
+    }
+    pthread_mutex_unlock(&q->lock);
+    return s;
+}
+
+/**
+    * @brief Post a finished request to the event loop of its session.
+    * @details The loop is woken only when its completions were empty, it drains them all at once.
+    */
+void handlerDone(struct session *s) {
+    struct event_loop *loop = s->loop;
+    struct session *head = __atomic_load_n(&loop->done, __ATOMIC_RELAXED);
+    do {
+        s->next = head;
+    } while (!__atomic_compare_exchange_n(&loop->done, &head, s, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    if (head == NULL) {
+        uint64_t one = 1;
+        write(loop->wake, &one, sizeof(one));
+    }
+}
+
+/**
+    * @brief Handler thread: runs requests from its own queue, and from the other queues when its
+    * own is empty, so a handler blocked in a slow call does not hold up the requests behind it.
+    * @details Every queued request posts the work of the pool once, so a thread that takes a post
+    * finds a request in one of the queues.
+    */
+void *handlerThread(void *arg) {
+    struct handler *self = arg;
+    struct handler_pool *pool = self->pool;
+    pinThread(self->cpu);
+    while (1) {
+        if (sem_wait(&pool->work) == -1) {
+            continue;
+        }
+        struct session *s = NULL;
+        while (s == NULL) {
+            for (int i = 0; i < pool->count && s == NULL; i++) {
+                s = handlerTake(&pool->queues[(self->index + i) % pool->count]);
+            }
+        }
+        session = s;
+        sessfd = s->sock;
+        req_avail = s->in_len;
+        int op;
+        memcpy(&op, s->in, sizeof(uint32_t));
+        s->out_len = handleRequest(op, s->in + sizeof(uint32_t), s->out);
+        // fprintf(stderr, "retLen %ld\n", s->out_len);
+        session = NULL;
+        handlerDone(s);
     }
-    return res_offsets[2];
+    return NULL;
 }
 
 /**
-    * @brief Handle the stat system call.
-    * @param buf The buffer containing the request.
-    * @param retBuf The buffer to store the response.
-    * @return The size of the response.
+    * @brief Run a read request in the event loop with the io_uring engine, as a read of the file
+    * into a registered buffer linked to the send of that buffer to the client.
+    * @details The header of the response is written for a full read and sent along with the buffer.
+    * A short read breaks the link, the send is cancelled and uringReadDone sends what was read.
+    * @return 1 if the read was started, 0 if the request is left to the handler threads.
     */
-size_t handle_stat(const char *buf, char* retBuf) {
-    fprintf(stderr, "enter func: handle_stat\n");
-    // Request Format:
-    // | pathname length | pathname    | statbuf
-    // | int(4)          | c_string(n) | stat_size
-    size_t req_length[3] = {sizeof(uint32_t), 0, sizeof(struct stat)};
-    int req_offsets[4] = {0};
-    memcpy(&req_length[1], buf + req_offsets[0], req_length[0]);
-    for (int i = 0; i < 3; i++) {
-        req_offsets[i + 1] = req_offsets[i] + req_length[i];
+int uringRead(struct session *s) {
+    struct uring *r = s->loop->ring;
+    int op, handle, count;
+    memcpy(&op, s->in, sizeof(uint32_t));
+    if (op != 1 || s->in_len < 2 * sizeof(uint32_t) || r->nfree == 0) {
+        return 0;
+    }
+    memcpy(&handle, s->in + sizeof(uint32_t), sizeof(uint32_t));
+    memcpy(&count, s->in + 2 * sizeof(uint32_t), sizeof(uint32_t));
+    session = s;
+    int fd = sessionFile(handle);
+    session = NULL;
+    if (fd == -1 || count < 0 || count > URING_READ_BUFFER_SIZE) {
+        return 0;
+    }
+    // Sessions sharing a cached description share its slot, which none of them may empty.
+    if (s->files[handle].shared == NULL && !s->files[handle].registered && uringRegister(r, fd, fd) == 0) {
+        s->files[handle].registered = 1;
     }
 
-    char *pathname = malloc(req_length[1] + 1);
-    struct stat* statbuf = malloc(req_length[2]);
-    memcpy(pathname, buf + req_offsets[1], req_length[1]);
-    memcpy(statbuf, buf + req_offsets[2], req_length[2]);
+    int b = r->free_buffers[--r->nfree];
+    int error = 0;
+    memcpy(s->read_header, &count, sizeof(uint32_t));
+    memcpy(s->read_header + sizeof(uint32_t), &error, sizeof(uint32_t));
+    s->read_buffer = b;
+    s->read_fd = fd;
+    s->read_handle = handle;
+    s->read_count = count;
+    s->read_pending = 2;
+    s->out_len = sizeof(s->read_header) + count;
+    s->out_sent = 0;
 
-    int success = stat(pathname, statbuf);
+    struct io_uring_sqe *sqe = uringSqe(r, IORING_OP_READ_FIXED, fd, s->files[handle].registered, (uint64_t)(uintptr_t)s | URING_READ);
+    sqe->addr = (uint64_t)(uintptr_t)r->buffers[b];
+    sqe->len = count;
+    // At the file offset, as read does, kept by the handle when the description is shared
+    sqe->off = s->files[handle].shared != NULL ? (uint64_t)s->files[handle].offset : (uint64_t)-1;
+    sqe->buf_index = b;
+    sqe->flags |= IOSQE_IO_LINK;
+    uringSend(s);
+    return 1;
+}
 
-    // Response Format:
-    // | res | errno  |
-    // | int | int(4) |
-    size_t res_length[2] = {sizeof(uint32_t), sizeof(uint32_t)};
-    int res_offsets[3] = {0};
-    for (int i = 0; i < 2; i++) {
-        res_offsets[i + 1] = res_offsets[i] + res_length[i];
+/**
+    * @brief Finish a read run by the event loop, once the read and its linked send completed.
+    */
+void uringReadDone(struct session *s) {
+    int bytes_read = s->read_res;
+    int error = 0;
+    if (bytes_read < 0) {
+        error = -bytes_read;
+        bytes_read = -1;
     }
-
-    memcpy(retBuf + res_offsets[0], &success, res_length[0]);
-    memcpy(retBuf + res_offsets[1], &errno, res_length[1]);
-    fprintf(stderr, "handle_stat | req | pathname %s\n", pathname);
-    fprintf(stderr, "handle_stat | res | success %d | errno %d\n", success, errno);
-    if (errno != 0) {
-        perror("stat error");
+    fprintf(stderr, "enter func: handle_read\n");
+    fprintf(stderr, "handle_read | req | fd: %d | count: %d\n", s->read_fd, s->read_count);
+    fprintf(stderr, "handle_read | res | bytes_read: %d | errno: %d\n", bytes_read, error);
+    if (bytes_read > 0 && s->files[s->read_handle].shared != NULL) {
+        s->files[s->read_handle].offset += bytes_read;
     }
-    return res_offsets[2];
+    if (s->read_sent == -ECANCELED || bytes_read != s->read_count) {
+        // The read came short and the send did not happen, the header is rewritten for what was read.
+        memcpy(s->read_header, &bytes_read, sizeof(uint32_t));
+        memcpy(s->read_header + sizeof(uint32_t), &error, sizeof(uint32_t));
+        s->out_len = sizeof(s->read_header) + (bytes_read > 0 ? bytes_read : 0);
+        s->out_sent = 0;
+    } else if (s->read_sent <= 0) {
+        fprintf(stderr, "server send failed\n");
+        sessionEnd(s, 1);
+        return;
+    } else {
+        s->out_sent = s->read_sent;
+    }
+    sessionFlush(s);
 }
 
 /**
-    * @brief Handle the unlink system call.
-    * @param buf The buffer containing the request.
-    * @param retBuf The buffer to store the response.
-    * @return The size of the response.
+    * @brief Take in a request received from a session and hand it to the handler threads.
+    * @param rv What the receive of the request returned.
     */
-size_t handle_unlink(const char *buf, char* retBuf) {
-    fprintf(stderr, "enter func: handle_unlink\n");
-    // Request Format:
-    // | pathname length | pathname    |
-    // | int(4)          | c_string(n) |
-    size_t req_length[2] = {sizeof(uint32_t), 0};
-    int req_offsets[3] = {0};
-    memcpy(&req_length[1], buf + req_offsets[0], req_length[0]);
-    for (int i = 0; i < 2; i++) {
-        req_offsets[i + 1] = req_offsets[i] + req_length[i];
+void sessionReceived(struct session *s, ssize_t rv) {
+    if (rv <= 0) {
+        // either client closed connection, or error
+        sessionEnd(s, 1);
+        return;
     }
-    char *pathname = malloc(req_length[1] + 1);
-    memcpy(pathname, buf + req_offsets[1], req_length[1]);
-    
-    int success = unlink(pathname);
-
-    // Response Format:
-    // | res | errno  |
-    // | int | int(4) |
-    size_t res_length[2] = {sizeof(uint32_t), sizeof(uint32_t)};
-    int res_offsets[3] = {0};
-    for (int i = 0; i < 2; i++) {
-        res_offsets[i + 1] = res_offsets[i] + res_length[i];
+    s->in[rv] = 0;
+    // A client that gave every delegation back has taken in the recall, another one may be sent.
+    if (s->delegations == 0 && s->recall_sent) {
+        s->recall_sent = 0;
     }
-    memcpy(retBuf + res_offsets[0], &success, res_length[0]);
-    memcpy(retBuf + res_offsets[1], &errno, res_length[1]);
-    if (errno != 0) {
-        perror("unlink error");
+    s->in_len = rv > (int)sizeof(uint32_t) ? rv - sizeof(uint32_t) : 0;
+    if (s->loop->ring != NULL && uringRead(s)) {
+        return;
     }
-    fprintf(stderr, "handle_unlink | req | pathname %s\n", pathname);
-    fprintf(stderr, "handle_unlink | res | success %d | errno %d\n", success, errno);
-    return res_offsets[2];
+    handlerSubmit(s);
 }
 
 /**
-    * @brief Handle the getdirentries system call.
-    * @param buf The buffer containing the request.
-    * @param retBuf The buffer to store the response.
-    * @return The size of the response.
+    * @brief Receive a request of a session and hand it to the handler threads.
+    * @details Requests are received the way clients send them, the fixed part in one piece, so the
+    * first recv holds enough to dispatch on. Larger payloads are received by the handler.
     */
-size_t handle_getdirentries(const char *buf, char* retBuf) {
-    fprintf(stderr, "enter func: handle_getdirentries\n");
-    // Request Format:
-    // | fd     | nbyte  | basep  |
-    // | int(4) | int(4) | int(8) |
-    size_t req_length[3] = {sizeof(uint32_t), sizeof(uint32_t), sizeof(uint64_t)};
-    int req_offsets[4] = {0};
-    for (int i = 0; i < 3; i++) {
-        req_offsets[i + 1] = req_offsets[i] + req_length[i];
+void sessionRequest(struct session *s) {
+    if (sessionBuffers(s) == -1) {
+        fprintf(stderr, "server out of buffers\n");
+        sessionEnd(s, 1);
+        return;
     }
-    int fd, nbyte;
-    off_t basep;
-    memcpy(&fd, buf + req_offsets[0], req_length[0]);
-    memcpy(&nbyte, buf + req_offsets[1], req_length[1]);
-    memcpy(&basep, buf + req_offsets[2], req_length[2]);
+    ssize_t rv = recv(s->sock, s->in, MAX_MSG_LEN, 0);
+    if (rv == -1 && (errno == EAGAIN || errno == EINTR)) {
+        sessionBuffersPut(s);
+        sessionArm(s, EPOLLIN);
+        return;
+    }
+    sessionReceived(s, rv);
+}
 
-    size_t bytes_read = getdirentries(fd, retBuf, nbyte, &basep);
+/**
+    * @brief Start receiving from a session just accepted with the io_uring engine.
+    */
+void uringStart(struct session *s) {
+    s->registered = uringRegister(s->loop->ring, s->sock, s->sock) == 0;
+    if (uringRecv(s) == -1) {
+        sessionEnd(s, 1);
+    }
+}
 
-    // Response Format:
-    // | bytes read | errno  |
-    // | int(4)     | int(4) |
-    // | data               |
-    // | string(bytes read) |
-    size_t res_length[2] = {sizeof(uint32_t), sizeof(uint32_t)};
-    int res_offsets[3] = {0};
-    for (int i = 0; i < 2; i++) {
-        res_offsets[i + 1] = res_offsets[i] + res_length[i];
+/**
+    * @brief Send the responses of the requests the handler threads finished for an event loop.
+    * @details The loop has read its wake eventfd before, so a completion posted after the stack is
+    * taken wakes it again.
+    */
+void sessionsDone(struct event_loop *loop) {
+    struct session *s = __atomic_exchange_n(&loop->done, NULL, __ATOMIC_ACQUIRE);
+    // Oldest first
+    struct session *fifo = NULL;
+    while (s != NULL) {
+        struct session *next = s->next;
+        s->next = fifo;
+        fifo = s;
+        s = next;
+    }
+    while (fifo != NULL) {
+        struct session *next = fifo->next;
+        if (fifo->accepted) {
+            fifo->accepted = 0;
+            uringStart(fifo);
+        } else {
+            sessionRespond(fifo);
+        }
+        fifo = next;
     }
+}
 
-    char retBuf1[res_offsets[2]];
-    memcpy(retBuf1 + res_offsets[0], &bytes_read, res_length[0]);
-    memcpy(retBuf1 + res_offsets[1], &errno, res_length[1]);
-    if (errno != 0) {
-        perror("getdirentries error");
+/**
+    * @brief Set up the session of a client just accepted.
+    * @details Whichever loop accepts, sessions are dealt out to all of them in turn, and to the
+    * handler threads likewise. A shard keeps the sessions it accepts, and touches no counter of
+    * the other shards.
+    * @param loop The event loop that accepted the client.
+    */
+struct session *sessionCreate(struct event_loop *loop, int fd) {
+    // Large responses are sent header first, which Nagle's algorithm would hold back.
+    int nodelay = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    unsigned int n = sharded ? loop->accepted++ : __atomic_fetch_add(&next_loop, 1, __ATOMIC_RELAXED);
+    struct session *s = calloc(1, sizeof(struct session));
+    s->sock = fd;
+    s->loop = sharded ? loop : &loops[n % loop_count];
+    s->worker = n % s->loop->pool->count;
+    s->read_buffer = -1;
+    return s;
+}
+
+/**
+    * @brief Accept the clients waiting on the listening socket into an event loop.
+    */
+void sessionsAccept(struct event_loop *loop) {
+    while (1) {
+        int fd = accept4(loop->listener, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd == -1) {
+            if (errno != EAGAIN && errno != EINTR) {
+                perror("accept error");
+            }
+            return;
+        }
+        struct session *s = sessionCreate(loop, fd);
+        struct epoll_event ev = {EPOLLIN | EPOLLONESHOT, {.ptr = s}};
+        if (epoll_ctl(s->loop->epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+            close(fd);
+            free(s);
+        }
     }
+}
 
-    if (send(sessfd, retBuf1, res_offsets[2], 0) == -1) {
-        fprintf(stderr, "server send failed\n");
-        return 0;
+/**
+    * @brief Accept clients with one multishot accept, posted again when the kernel ends it.
+    */
+void uringAccept(struct event_loop *loop) {
+    struct io_uring_sqe *sqe = uringSqe(loop->ring, IORING_OP_ACCEPT, loop->listener, 0, URING_ACCEPT);
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+}
+
+/**
+    * @brief Wait for the handler threads to post completions to the loop.
+    */
+void uringWake(struct event_loop *loop) {
+    struct io_uring_sqe *sqe = uringSqe(loop->ring, IORING_OP_READ, loop->wake, 0, (uint64_t)(uintptr_t)loop | URING_WAKE);
+    sqe->addr = (uint64_t)(uintptr_t)&loop->wake_count;
+    sqe->len = sizeof(loop->wake_count);
+}
+
+/**
+    * @brief Handle one completion of the io_uring of an event loop.
+    */
+void uringComplete(struct event_loop *loop, const struct io_uring_cqe *cqe) {
+    void *ptr = (void *)(uintptr_t)(cqe->user_data & ~(uint64_t)URING_TAG_MASK);
+    struct session *s = ptr;
+    switch (cqe->user_data & URING_TAG_MASK) {
+        case URING_ACCEPT:
+            if (cqe->res >= 0) {
+                s = sessionCreate(loop, cqe->res);
+                if (s->loop == loop) {
+                    uringStart(s);
+                } else {
+                    s->accepted = 1;
+                    handlerDone(s);
+                }
+            } else if (cqe->res != -EINTR && cqe->res != -EAGAIN) {
+                fprintf(stderr, "accept error: %s\n", strerror(-cqe->res));
+            }
+            if (!(cqe->flags & IORING_CQE_F_MORE)) {
+                uringAccept(loop);
+            }
+            break;
+        case URING_WAKE:
+            sessionsDone(loop);
+            uringWake(loop);
+            break;
+        case URING_RECV:
+            if (cqe->res == -EINTR || cqe->res == -EAGAIN) {
+                if (uringRecv(s) == -1) {
+                    sessionEnd(s, 1);
+                }
+            } else {
+                sessionReceived(s, cqe->res);
+            }
+            break;
+        case URING_READ:
+            s->read_res = cqe->res;
+            if (--s->read_pending == 0) {
+                uringReadDone(s);
+            }
+            break;
+        case URING_SEND:
+            if (s->read_pending > 0) {
+                s->read_sent = cqe->res;
+                if (--s->read_pending == 0) {
+                    uringReadDone(s);
+                }
+            } else if (cqe->res <= 0) {
+                fprintf(stderr, "server send failed\n");
+                sessionEnd(s, 1);
+            } else {
+                s->out_sent += cqe->res;
+                sessionFlush(s);
+            }
+            break;
     }
+}
 
-    fprintf(stderr, "handle_getdirentries | req | fd %d | nbyte %d | basep %ld\n", fd, nbyte, basep);
-    fprintf(stderr, "handle_getdirentries | res | bytes_read %ld | errno %d\n", bytes_read, errno);
-    return bytes_read;
+/**
+    * @brief Event loop of the io_uring engine: every receive, send and loop-run read is an entry of
+    * the ring, and the loop makes one system call per round to submit them and wait for completions.
+    * @details The first loop accepts for all of them, unless each shard accepts its own.
+    */
+void uringLoop(struct event_loop *loop) {
+    struct uring *r = loop->ring;
+    if (sharded || loop == &loops[0]) {
+        uringAccept(loop);
+    }
+    uringWake(loop);
+    while (1) {
+        uringSubmit(r, 1);
+        unsigned head = *r->cq_head;
+        while (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe cqe = r->cqes[head & r->cq_mask];
+            __atomic_store_n(r->cq_head, ++head, __ATOMIC_RELEASE);
+            uringComplete(loop, &cqe);
+        }
+    }
 }
 
 /**
-    * @brief Handle the getdirtree system call.
-    * @param buf The buffer containing the request.
-    * @param retBuf The buffer to store the response.
-    * @return The size of the response.
+    * @brief Event loop thread: accepts clients, receives the requests of the sessions it owns and
+    * sends their responses. The requests themselves run in the handler threads.
+    * @details Every event loop waits on the listening socket, and one of them is woken per client.
+    * Sharded, each waits on a listener of its own, and the kernel spreads the clients among them.
     */
-void serialize_dirtree(struct dirtreenode *node, char *buf, int* offset) {
-    if (node == NULL) {
-        return;
+void *eventLoop(void *arg) {
+    struct event_loop *loop = arg;
+    pinThread(loop->cpu);
+    if (loop->ring != NULL) {
+        uringLoop(loop);
+        return NULL;
     }
-    int name_len = strlen(node->name);
-    memcpy(buf + *offset, node->name, name_len);
-    buf[*offset + name_len] = '\0';
-    *offset += name_len + 1;
-    memcpy(buf + *offset, &node->num_subdirs, sizeof(uint32_t));
-    *offset += sizeof(uint32_t);
-    for (int i = 0; i < node->num_subdirs; i++) {
-        serialize_dirtree(node->subdirs[i], buf, offset);
+    struct epoll_event ev = {EPOLLIN | EPOLLEXCLUSIVE, {.ptr = NULL}};
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->listener, &ev) == -1) err(1, 0);
+    struct epoll_event wake = {EPOLLIN, {.ptr = loop}};
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->wake, &wake) == -1) err(1, 0);
+    struct epoll_event events[MAX_EVENTS];
+    while (1) {
+        int n = epoll_wait(loop->epoll_fd, events, MAX_EVENTS, -1);
+        for (int i = 0; i < n; i++) {
+            void *ptr = events[i].data.ptr;
+            if (ptr == NULL) {
+                sessionsAccept(loop);
+            } else if (ptr == loop) {
+                uint64_t count;
+                read(loop->wake, &count, sizeof(count));
+                sessionsDone(loop);
+            } else {
+                struct session *s = ptr;
+                if (s->out_len > 0) {
+                    if (sessionFlush(s) == -1) sessionEnd(s, 1);
+                } else {
+                    sessionRequest(s);
+                }
+            }
+        }
     }
+    return NULL;
 }
 
-/** 
-    * @brief Handle the getdirtree system call.
-    * @param buf The buffer containing the request.
-    * @param retBuf The buffer to store the response.
-    * @return The size of the response.
+/**
+    * @brief Create a listening socket bound to the server address.
+    * @param reuseport Whether more listeners share the address, one per shard, with SO_REUSEPORT.
+    * @return The socket.
     */
-size_t handle_getdirtree(const char *buf, char* retBuf) {
-    // fprintf(stderr, "enter func: handle_getdirtree\n");
-    // Request Format:
-    // | pathname length | pathname    |
-    // | int(4)          | c_string(n) |
-    size_t req_length[2] = {sizeof(uint32_t), 0};
-    int req_offsets[3] = {0};
-    memcpy(&req_length[1], buf + req_offsets[0], req_length[0]);
-    for (int i = 0; i < 2; i++) {
-        req_offsets[i + 1] = req_offsets[i] + req_length[i];
+int listenSocket(struct sockaddr_in *srv, int reuseport) {
+    // Create socket
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);    // TCP/IP socket
+    if (fd<0) err(1, 0);            // in case of error
+
+    if (reuseport) {
+        int one = 1;
+        if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0) err(1, 0);
     }
-    
-    char *folder_path = malloc(req_length[1] + 1);
-    memcpy(folder_path, buf + req_offsets[1], req_length[1]);
-    folder_path[req_length[1]] = '\0';
 
-    struct dirtreenode* root = getdirtree(folder_path);
+    // bind to our port
+    int rv = bind(fd, (struct sockaddr*)srv, sizeof(struct sockaddr));
+    if (rv<0) err(1,0);
 
-    int ret_data_length = 0;
-    serialize_dirtree(root, retBuf, &ret_data_length);
+    // start listening for connections, with room for a burst of them
+    rv = listen(fd, SOMAXCONN);
+    if (rv<0) err(1,0);
+    return fd;
+}
 
-    // Response Format:
-    // | data_length |
-    // | int(4)      |
-    // | node_name_len | node_name | node_num_subdirs | ...
-    // | int(4)        | string(n) | int(4)              | ...    
-    char retBuf1[sizeof(uint32_t)];
-    memcpy(retBuf1, &ret_data_length, sizeof(uint32_t));
-    if (send(sessfd, retBuf1, sizeof(uint32_t), 0) == -1) {
-        fprintf(stderr, "server send failed\n");
-        return 0;
+/**
+    * @brief Start the handler threads of a pool.
+    * @param cpu The CPU the threads run on, -1 if not pinned.
+    */
+void handlerPool(struct handler_pool *pool, int count, int cpu) {
+    pool->queues = calloc(count, sizeof(struct handler_queue));
+    pool->count = count;
+    sem_init(&pool->work, 0, 0);
+    struct handler *handlers = calloc(count, sizeof(struct handler));
+    for (int i = 0; i < count; i++) {
+        pthread_mutex_init(&pool->queues[i].lock, NULL);
+        handlers[i].pool = pool;
+        handlers[i].index = i;
+        handlers[i].cpu = cpu;
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, handlerThread, &handlers[i]) != 0) err(1, 0);
+        pthread_detach(thread);
     }
-
-    // fprintf(stderr, "handle_getdirtree | req | folder_path %s\n", folder_path);
-    // fprintf(stderr, "handle_getdirtree | res | ret_data_length %d\n", ret_data_length);
-    freedirtree(root);
-    return ret_data_length;
 }
 
 /**
@@ -465,108 +3721,125 @@ size_t handle_getdirtree(const char *buf, char* retBuf) {
     * @return 0 if successful, 1 if error.
     */
 int main(int argc, char**argv) {
-    char buf[MAX_MSG_LEN+1];
     char *serverport;
     unsigned short port;
-    int rv;
-    struct sockaddr_in srv, cli;
-    socklen_t sa_size;
-    
+    struct sockaddr_in srv;
+
     // Get environment variable indicating the port of the server
     serverport = getenv("serverport15440");
     if (serverport) port = (unsigned short)atoi(serverport);
     else port=15440;
-    
-    // Create socket
-    sockfd = socket(AF_INET, SOCK_STREAM, 0);    // TCP/IP socket
-    if (sockfd<0) err(1, 0);            // in case of error
-    
+
+    // Get environment variable indicating the directory of the chunk store
+    chunk_store = getenv("RPC_CHUNK_STORE");
+    if (chunk_store == NULL) chunk_store = "/tmp/rpc-chunks";
+    mkdir(chunk_store, 0700);
+
+    // Get environment variable indicating whether the export is read-only published data
+    char *readonly = getenv("RPC_EXPORT_READONLY");
+    export_readonly = readonly != NULL && strcmp(readonly, "1") == 0;
+
+    // Get environment variable indicating the number of event loop threads, one per CPU by default
+    int cpus = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    char *loops_env = getenv("RPC_EVENT_LOOPS");
+    loop_count = loops_env != NULL ? atoi(loops_env) : cpus;
+    if (loop_count < 1) loop_count = 1;
+
+    // Get environment variable indicating the number of handler threads
+    char *handlers_env = getenv("RPC_HANDLER_THREADS");
+    handler_count = handlers_env != NULL ? atoi(handlers_env) : HANDLER_THREADS_PER_CPU * cpus;
+    if (handler_count < 1) handler_count = 1;
+
+    // Get environment variable indicating whether each event loop is a shard pinned to a CPU
+    char *sharded_env = getenv("RPC_SHARDED");
+    sharded = sharded_env != NULL && strcmp(sharded_env, "1") == 0;
+
+    // Get environment variable indicating the I/O engine of the event loops, epoll by default
+    char *engine = getenv("RPC_IO_ENGINE");
+    int use_uring = engine != NULL && strcmp(engine, "io_uring") == 0;
+
+    // Get environment variable indicating whether the buffer pool is backed by huge pages
+    char *huge_pages = getenv("RPC_HUGE_PAGES");
+    buffer_huge_pages = huge_pages != NULL && strcmp(huge_pages, "1") == 0;
+
+    // Get environment variable indicating the number of idle descriptors the open file cache keeps,
+    // 0 to open every file for its session alone
+    char *open_cache_env = getenv("RPC_OPEN_CACHE");
+    if (open_cache_env != NULL) open_cache_budget = atoi(open_cache_env);
+
+    // All sessions share the descriptor table of the process.
+    struct rlimit nofile;
+    if (getrlimit(RLIMIT_NOFILE, &nofile) == 0 && nofile.rlim_cur < nofile.rlim_max) {
+        nofile.rlim_cur = nofile.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &nofile);
+    }
+    lease_capacity = getrlimit(RLIMIT_NOFILE, &nofile) == 0 && nofile.rlim_cur < MAX_LEASE_FDS ? (int)nofile.rlim_cur : MAX_LEASE_FDS;
+    lease_sessions = calloc(lease_capacity, sizeof(struct session *));
+
+    // A client gone while we write to it must not end the whole server. Lease breaks and recall
+    // timeouts are restarted, as handlers treat an interrupted recv as a lost client.
+    signal(SIGPIPE, SIG_IGN);
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = leaseBroken;
+    sa.sa_flags = SA_RESTART | SA_SIGINFO;
+    sigaction(SIGIO, &sa, NULL);
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = recallExpired;
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGALRM, &sa, NULL);
+
     // setup address structure to indicate server port
     memset(&srv, 0, sizeof(srv));            // clear it first
     srv.sin_family = AF_INET;            // IP family
     srv.sin_addr.s_addr = htonl(INADDR_ANY);    // don't care IP address
     srv.sin_port = htons(port);            // server port
 
-    // bind to our port
-    rv = bind(sockfd, (struct sockaddr*)&srv, sizeof(struct sockaddr));
-    if (rv<0) err(1,0);
-    
-    // start listening for connections
-    rv = listen(sockfd, 5);
-    if (rv<0) err(1,0);
-    
-    // main server loop, handle clients one at a time
-    while (1) {
-        // wait for next client, get session socket
-        sa_size = sizeof(struct sockaddr_in);
-        sessfd = accept(sockfd, (struct sockaddr *)&cli, &sa_size);
+    if (!sharded) {
+        sockfd = listenSocket(&srv, 0);
+    }
 
-        if (sessfd<0) {
-            err(1,0);
-            continue;
-        }
-        pid_t pid = fork();
-        if (pid != 0) {
-            close(sessfd);
-            continue;
-        }
-        close(sockfd);
-        
-        // get messages and send replies to this client, until it goes away
-        while ( (rv=recv(sessfd, buf, MAX_MSG_LEN, 0)) > 0) {
-            buf[rv]=0;        // null terminate string to print
-            int op;
-            memcpy(&op, buf, sizeof(uint32_t));
-            char *p = buf;
-            p += sizeof(uint32_t);
-            size_t retLen;
-            char retBuf[MAX_MSG_LEN+1];
-            switch (op) {
-                case 0:
-                    retLen = handle_open(p, retBuf);
-                    break;
-                case 1:
-                    retLen = handle_read(p, retBuf);
-                    break;
-                case 2:
-                    retLen = handle_write(p, retBuf);
-                    break;
-                case 3:
-                    retLen = handle_close(p, retBuf);
-                    break;
-                case 4:
-                    retLen = handle_lseek(p, retBuf);
-                    break;
-                case 5:
-                    retLen = handle_stat(p, retBuf);
-                    break;
-                case 6:
-                    retLen = handle_unlink(p, retBuf);
-                    break;
-                case 7:
-                    retLen = handle_getdirentries(p, retBuf);
-                    break;
-                case 8:
-                    retLen = handle_getdirtree(p, retBuf);
-                    break;
-                default:
-                    retLen = 0;
-            }
-            // fprintf(stderr, "retLen %ld\n", retLen);
-            retBuf[retLen] = '\0';
-            if (send(sessfd, retBuf, retLen, 0) == -1) {
-                fprintf(stderr, "server send failed\n");
+    // event loops, each with its handler threads when sharded, this thread being the last of them
+    loops = calloc(loop_count, sizeof(struct event_loop));
+    int pools = sharded ? loop_count : 1;
+    struct handler_pool *pool = calloc(pools, sizeof(struct handler_pool));
+    for (int i = 0; i < pools; i++) {
+        int cpu = sharded ? i % cpus : -1;
+        handlerPool(&pool[i], sharded ? (handler_count + loop_count - 1) / loop_count : handler_count, cpu);
+    }
+    for (int i = 0; i < loop_count; i++) {
+        loops[i].listener = sharded ? listenSocket(&srv, 1) : sockfd;
+        loops[i].cpu = sharded ? i % cpus : -1;
+        loops[i].pool = sharded ? &pool[i] : pool;
+        loops[i].epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        loops[i].wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (loops[i].epoll_fd == -1 || loops[i].wake == -1) err(1, 0);
+    }
+    for (int i = 0; use_uring && i < loop_count; i++) {
+        loops[i].ring = uringCreate(lease_capacity < URING_MAX_FILES ? lease_capacity : URING_MAX_FILES);
+        if (loops[i].ring == NULL) {
+            // All loops use the same engine, the io_uring one accepts for the others.
+            fprintf(stderr, "io_uring not available, using epoll\n");
+            for (int j = 0; j < i; j++) {
+                close(loops[j].ring->fd);
+                loops[j].ring = NULL;
             }
+            use_uring = 0;
         }
-        // either client closed connection, or error
-        if (rv<0) err(1,0);
-        close(sessfd);
-        break;
     }
-    
+    for (int i = 1; i < loop_count; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, eventLoop, &loops[i]) != 0) err(1, 0);
+        pthread_detach(thread);
+    }
+    eventLoop(&loops[0]);
+
     fprintf(stderr, "server shutting down cleanly\n");
-    // close socket
-    close(sockfd);
+    // close sockets
+    for (int i = 0; i < loop_count; i++) {
+        if (loops[i].listener != sockfd) close(loops[i].listener);
+    }
+    if (!sharded) close(sockfd);
 
     return 0;
-}
\ No newline at end of file
+}